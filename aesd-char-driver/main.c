@@ -24,6 +24,8 @@
 #include <linux/rwsem.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
@@ -48,9 +50,41 @@ static int aesd_release(struct inode *const inode, struct file *const filp)
     return 0;
 }
 
+/// Finds the device data at `pos` for reading: where it is (`*data`), and how much of it to copy (`*size`, at most
+/// `count` bytes, up to the end of its entry; 0 at the end of the data).
+///
+/// Returns with the device lock held for reading, to be released by `up_read` once the data is copied,
+/// or -ERESTARTSYS (without the lock) if interrupted while waiting for it.
+///
+static int aesd_read_lock(struct aesd_dev *const dev, const loff_t pos, const size_t count, const char **const data,
+                          size_t *const size)
+{
+    if (down_read_interruptible(&dev->lock) != 0)
+    {
+        return -ERESTARTSYS;
+    }
+
+    size_t offset;
+    const struct aesd_buffer_entry *const entry =
+        aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, pos, &offset);
+    if (entry)
+    {
+        assert(entry->buffptr);
+        assert(offset < entry->size);
+
+        *data = entry->buffptr + offset;
+        *size = min(count, entry->size - offset);
+    }
+    else
+    {
+        *data = NULL;
+        *size = 0; // EOF
+    }
+    return 0;
+}
+
 static ssize_t aesd_read(struct file *const filp, char __user *const buf, const size_t count, loff_t *const f_pos)
 {
-    ssize_t retval = 0;
     PDEBUG("read %zu bytes with offset %lld\n", count, *f_pos);
 
     if (count == 0)
@@ -61,40 +95,62 @@ static ssize_t aesd_read(struct file *const filp, char __user *const buf, const
     struct aesd_dev *const dev = filp->private_data;
     assert(dev);
 
-    int res = down_read_interruptible(&dev->lock);
-    if (res == 0)
+    const char *data;
+    size_t size;
+    const int res = aesd_read_lock(dev, *f_pos, count, &data, &size);
+    if (res != 0)
     {
-        size_t offset;
-        const struct aesd_buffer_entry *const entry = aesd_circular_buffer_find_entry_offset_for_fpos(
-            &dev->buffer,
-            *f_pos,
-            &offset);
-        if (entry)
-        {
-            assert(entry->buffptr);
-            assert(offset < entry->size);
+        return res;
+    }
 
-            const size_t size = min(count, entry->size - offset);
-            if (0 == copy_to_user(buf, entry->buffptr + offset, size))
-            {
-                *f_pos += size;
-                retval = size;
-            }
-            else
-            {
-                retval = -EFAULT;
-            }
-        }
-        else
-        {
-            retval = 0; // EOF
-        }
+    ssize_t retval = size;
+    if ((size > 0) && (0 != copy_to_user(buf, data, size)))
+    {
+        retval = -EFAULT;
+    }
+    up_read(&dev->lock);
 
-        up_read(&dev->lock);
+    if (retval > 0)
+    {
+        *f_pos += retval;
     }
-    else
+    return retval;
+}
+
+/// The same as `aesd_read` but for an iterator, so that the device content could be spliced
+/// (by `sendfile`/`splice` calls) to a pipe or a socket without going through user space.
+///
+static ssize_t aesd_read_iter(struct kiocb *const iocb, struct iov_iter *const to)
+{
+    const size_t count = iov_iter_count(to);
+    PDEBUG("read_iter %zu bytes with offset %lld\n", count, iocb->ki_pos);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    struct aesd_dev *const dev = iocb->ki_filp->private_data;
+    assert(dev);
+
+    const char *data;
+    size_t size;
+    const int res = aesd_read_lock(dev, iocb->ki_pos, count, &data, &size);
+    if (res != 0)
+    {
+        return res;
+    }
+
+    ssize_t retval = size;
+    if ((size > 0) && (size != copy_to_iter(data, size, to)))
+    {
+        retval = -EFAULT;
+    }
+    up_read(&dev->lock);
+
+    if (retval > 0)
     {
-        retval = -ERESTARTSYS;
+        iocb->ki_pos += retval;
     }
     return retval;
 }
@@ -277,6 +333,12 @@ static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
     .read = aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write = aesd_write,
     .open = aesd_open,
     .release = aesd_release,
@@ -0,0 +1,516 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Load generator for aesdsocket.
+///
+/// Every connection is driven by its own thread, with at most one request in flight
+/// (the server processes packets of a connection strictly one after another anyway):
+/// - closed loop: the next packet is sent as soon as the previous reply has arrived (plus the think time);
+/// - open loop: packets are scheduled at a fixed rate, and the latency is measured from the *scheduled*
+///   send time, so that a stalled server is not hidden by the generator slowing down with it.
+///
+/// A reply has no framing - it's the store content - so it's considered complete once it has
+/// contained the packet's own line (a unique token) and no more data is immediately available.
+///
+
+#define BENCH_MIN_PACKET_SIZE 24
+#define BENCH_RECV_SIZE 65536
+#define BENCH_TOKEN_SIZE 24
+
+struct bench_options
+{
+    const char *host;
+    const char *port;
+    size_t connections;
+    unsigned duration_sec;
+    size_t packet_size;    // including the newline
+    size_t splits;         // number of `send` calls per packet
+    unsigned split_gap_us; // pause between the pieces (so that they arrive in separate `recv`s)
+    unsigned seekto_percent;
+    unsigned think_us;     // closed loop only
+    double rate;           // requests per second over all connections; 0 for the closed loop
+    unsigned timeout_ms;   // for a reply
+};
+
+struct bench_connection
+{
+    pthread_t thread;
+    size_t index;
+    const struct bench_options *options;
+    uint64_t start_ns;
+    uint64_t stop_ns;
+
+    // Results.
+    //
+    uint64_t *latencies; // nanoseconds
+    size_t latencies_count;
+    size_t latencies_capacity;
+    uint64_t reply_bytes;
+    uint64_t seekto_count;
+    uint64_t errors;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_until_ns(const uint64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static int connect_to_server(const struct bench_options *const options)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = NULL;
+    const int res = getaddrinfo(options->host, options->port, &hints, &result);
+    if (res != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return -1;
+    }
+
+    int sock_fd = -1;
+    for (const struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        sock_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock_fd == -1)
+            continue;
+        if (connect(sock_fd, rp->ai_addr, rp->ai_addrlen) == 0)
+            break; // Success
+
+        close(sock_fd);
+        sock_fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock_fd == -1)
+    {
+        perror("connect");
+        return -1;
+    }
+
+    // Split pieces must not be coalesced by Nagle.
+    const int opt_val = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    return sock_fd;
+}
+
+static bool send_all(const int sock_fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t res = send(sock_fd, data, size, MSG_NOSIGNAL);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+static bool send_packet(const struct bench_options *const options, const int sock_fd, const char *const packet,
+                        const size_t packet_size)
+{
+    const size_t piece_size = (packet_size + options->splits - 1) / options->splits;
+    for (size_t sent = 0; sent < packet_size; sent += piece_size)
+    {
+        if ((sent > 0) && (options->split_gap_us > 0))
+        {
+            usleep(options->split_gap_us);
+        }
+        const size_t size = ((packet_size - sent) < piece_size) ? (packet_size - sent) : piece_size;
+        if (!send_all(sock_fd, packet + sent, size))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Tracks the lines of the reply stream, looking for the one starting with the token.
+struct reply_scanner
+{
+    char line_start[BENCH_TOKEN_SIZE];
+    size_t line_length;
+    bool token_seen;
+    bool ends_with_newline;
+};
+
+static void scan_reply(struct reply_scanner *const scanner, const char *const token, const size_t token_size,
+                       const char *const data, const size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (data[i] == '\n')
+        {
+            if ((scanner->line_length >= token_size) && (memcmp(scanner->line_start, token, token_size) == 0))
+            {
+                scanner->token_seen = true;
+            }
+            scanner->line_length = 0;
+            continue;
+        }
+        if (scanner->line_length < BENCH_TOKEN_SIZE)
+        {
+            scanner->line_start[scanner->line_length] = data[i];
+        }
+        scanner->line_length++;
+    }
+    if (size > 0)
+    {
+        scanner->ends_with_newline = (data[size - 1] == '\n');
+    }
+}
+
+/// Receives the reply. With `token` NULL (a seekto reply) any newline terminated data completes it.
+/// Returns the number of reply bytes, or -1 on failure (or timeout).
+///
+static ssize_t receive_reply(const struct bench_options *const options, const int sock_fd, const char *const token,
+                             char *const buffer)
+{
+    struct reply_scanner scanner;
+    memset(&scanner, 0, sizeof(scanner));
+    const size_t token_size = (token != NULL) ? strlen(token) : 0;
+
+    size_t total = 0;
+    for (;;)
+    {
+        const bool complete = scanner.ends_with_newline && ((token == NULL) || scanner.token_seen);
+        struct pollfd pfd = {.fd = sock_fd, .events = POLLIN, .revents = 0};
+        const int ready = poll(&pfd, 1, complete ? 0 : (int)options->timeout_ms);
+        if (ready == 0)
+        {
+            return complete ? (ssize_t)total : -1;
+        }
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        const ssize_t received = recv(sock_fd, buffer, BENCH_RECV_SIZE, 0);
+        if (received <= 0)
+        {
+            if ((received == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            return -1;
+        }
+        scan_reply(&scanner, token, token_size, buffer, received);
+        total += received;
+    }
+}
+
+static void record_latency(struct bench_connection *const connection, const uint64_t latency)
+{
+    if (connection->latencies_count == connection->latencies_capacity)
+    {
+        const size_t capacity = (connection->latencies_capacity > 0) ? (connection->latencies_capacity * 2) : 1024;
+        uint64_t *const latencies = realloc(connection->latencies, capacity * sizeof(uint64_t));
+        if (latencies == NULL)
+        {
+            return;
+        }
+        connection->latencies = latencies;
+        connection->latencies_capacity = capacity;
+    }
+    connection->latencies[connection->latencies_count++] = latency;
+}
+
+static void *connection_thread(void *const arg)
+{
+    struct bench_connection *const connection = arg;
+    const struct bench_options *const options = connection->options;
+
+    char *const packet = malloc(options->packet_size);
+    char *const buffer = malloc(BENCH_RECV_SIZE);
+    const int sock_fd = connect_to_server(options);
+    if ((packet == NULL) || (buffer == NULL) || (sock_fd == -1))
+    {
+        connection->errors++;
+        free(packet);
+        free(buffer);
+        if (sock_fd != -1)
+        {
+            close(sock_fd);
+        }
+        return NULL;
+    }
+
+    // Requests of the open loop are evenly spread over the connections (and shifted within the interval).
+    //
+    const uint64_t interval_ns =
+        (options->rate > 0) ? (uint64_t)((1e9 * (double)options->connections) / options->rate) : 0;
+    uint64_t scheduled = connection->start_ns + ((interval_ns * connection->index) / options->connections);
+    unsigned seed = (unsigned)(connection->index * 7919U) ^ (unsigned)connection->start_ns;
+
+    for (uint64_t sequence = 0;; ++sequence)
+    {
+        uint64_t sent_at = now_ns();
+        if (interval_ns > 0)
+        {
+            if (scheduled > sent_at)
+            {
+                sleep_until_ns(scheduled);
+            }
+            sent_at = scheduled;
+            scheduled += interval_ns;
+        }
+        if (sent_at >= connection->stop_ns)
+        {
+            break;
+        }
+
+        // Either a seekto command, or a unique line padded up to the packet size.
+        //
+        char token[BENCH_TOKEN_SIZE];
+        size_t packet_size = 0;
+        const bool seekto = ((unsigned)(rand_r(&seed) % 100)) < options->seekto_percent;
+        if (seekto)
+        {
+            packet_size = snprintf(packet, options->packet_size, "AESDCHAR_IOCSEEKTO:0,0\n");
+            connection->seekto_count++;
+        }
+        else
+        {
+            snprintf(token, sizeof(token), "c%zus%lu:", connection->index, (unsigned long)sequence);
+            const size_t token_size = strlen(token);
+            memcpy(packet, token, token_size);
+            memset(packet + token_size, 'x', options->packet_size - token_size - 1);
+            packet_size = options->packet_size;
+            packet[packet_size - 1] = '\n';
+        }
+
+        ssize_t reply_size = -1;
+        if (send_packet(options, sock_fd, packet, packet_size))
+        {
+            reply_size = receive_reply(options, sock_fd, seekto ? NULL : token, buffer);
+        }
+        if (reply_size < 0)
+        {
+            connection->errors++;
+            break;
+        }
+        record_latency(connection, now_ns() - sent_at);
+        connection->reply_bytes += reply_size;
+
+        if ((interval_ns == 0) && (options->think_us > 0))
+        {
+            usleep(options->think_us);
+        }
+    }
+
+    close(sock_fd);
+    free(packet);
+    free(buffer);
+    return NULL;
+}
+
+static int compare_u64(const void *const a, const void *const b)
+{
+    const uint64_t lhs = *(const uint64_t *)a;
+    const uint64_t rhs = *(const uint64_t *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static double percentile_us(const uint64_t *const sorted, const size_t count, const double quantile)
+{
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    size_t rank = (size_t)((quantile * (double)count) + 0.5);
+    rank = (rank == 0) ? 1 : ((rank > count) ? count : rank);
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+static void print_usage(const char *const program)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-s packet_size] [-k splits]\n",
+            program);
+    fprintf(stderr, "          [-g split_gap_us] [-x seekto_percent] [-t think_us] [-r rate] [-T timeout_ms]\n");
+    fprintf(stderr, "  -H  server host (default: localhost)\n");
+    fprintf(stderr, "  -p  server port (default: 9000)\n");
+    fprintf(stderr, "  -c  concurrent connections (default: 8)\n");
+    fprintf(stderr, "  -d  duration in seconds (default: 10)\n");
+    fprintf(stderr, "  -s  packet size including the newline (default: 64, minimum: %d)\n", BENCH_MIN_PACKET_SIZE);
+    fprintf(stderr, "  -k  send every packet in K pieces (default: 1)\n");
+    fprintf(stderr, "  -g  pause between the pieces in microseconds (default: 100)\n");
+    fprintf(stderr, "  -x  percentage of `AESDCHAR_IOCSEEKTO:0,0` commands (default: 0)\n");
+    fprintf(stderr, "  -t  closed loop think time in microseconds (default: 0)\n");
+    fprintf(stderr, "  -r  open loop: fixed total rate in requests per second (default: closed loop)\n");
+    fprintf(stderr, "  -T  reply timeout in milliseconds (default: 2000)\n");
+}
+
+int main(const int argc, const char **const argv)
+{
+    struct bench_options options;
+    options.host = "localhost";
+    options.port = "9000";
+    options.connections = 8;
+    options.duration_sec = 10;
+    options.packet_size = 64;
+    options.splits = 1;
+    options.split_gap_us = 100;
+    options.seekto_percent = 0;
+    options.think_us = 0;
+    options.rate = 0;
+    options.timeout_ms = 2000;
+
+    int opt;
+    while ((opt = getopt(argc, (char *const *)argv, "H:p:c:d:s:k:g:x:t:r:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'c':
+            options.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            options.duration_sec = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            options.packet_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            options.splits = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            options.split_gap_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            options.seekto_percent = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            options.think_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.rate = strtod(optarg, NULL);
+            break;
+        case 'T':
+            options.timeout_ms = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((options.connections == 0) || (options.duration_sec == 0) || (options.splits == 0) ||
+        (options.packet_size < BENCH_MIN_PACKET_SIZE) || (options.seekto_percent > 100) || (options.rate < 0))
+    {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_connection *const connections = calloc(options.connections, sizeof(struct bench_connection));
+    if (connections == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    const uint64_t start_ns = now_ns();
+    const uint64_t stop_ns = start_ns + ((uint64_t)options.duration_sec * 1000000000ULL);
+    size_t started = 0;
+    for (; started < options.connections; ++started)
+    {
+        struct bench_connection *const connection = &connections[started];
+        connection->index = started;
+        connection->options = &options;
+        connection->start_ns = start_ns;
+        connection->stop_ns = stop_ns;
+        const int err = pthread_create(&connection->thread, NULL, connection_thread, connection);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    // Merge the results.
+    //
+    size_t total_count = 0;
+    uint64_t reply_bytes = 0, seekto_count = 0, errors = 0;
+    for (size_t i = 0; i < started; ++i)
+    {
+        pthread_join(connections[i].thread, NULL);
+        total_count += connections[i].latencies_count;
+        reply_bytes += connections[i].reply_bytes;
+        seekto_count += connections[i].seekto_count;
+        errors += connections[i].errors;
+    }
+    const double elapsed_sec = (double)(now_ns() - start_ns) / 1e9;
+
+    uint64_t *const latencies = malloc((total_count + 1) * sizeof(uint64_t));
+    if (latencies == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < started; ++i)
+    {
+        memcpy(latencies + count, connections[i].latencies, connections[i].latencies_count * sizeof(uint64_t));
+        count += connections[i].latencies_count;
+        free(connections[i].latencies);
+    }
+    assert(count == total_count);
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+
+    printf("mode:         %s\n", (options.rate > 0) ? "open loop" : "closed loop");
+    printf("connections:  %zu\n", started);
+    printf("duration:     %.3f s\n", elapsed_sec);
+    printf("requests:     %zu (seekto: %lu, errors: %lu)\n", count, (unsigned long)seekto_count,
+           (unsigned long)errors);
+    printf("throughput:   %.1f req/s\n", (double)count / elapsed_sec);
+    printf("reply bytes:  %lu (%.1f MiB/s)\n", (unsigned long)reply_bytes,
+           (double)reply_bytes / elapsed_sec / (1024.0 * 1024.0));
+    printf("latency (us): p50=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", percentile_us(latencies, count, 0.5),
+           percentile_us(latencies, count, 0.99), percentile_us(latencies, count, 0.999),
+           percentile_us(latencies, count, 1.0));
+
+    free(latencies);
+    free(connections);
+    return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
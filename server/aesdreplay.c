@@ -0,0 +1,503 @@
+#include "session_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Replays sessions recorded by `aesdsocket -R` against a server.
+///
+/// Every session is driven by its own thread, which connects and sends the recorded bytes
+/// (with the same chunking) at the recorded times scaled by the speed factor (or as fast as possible),
+/// while draining whatever the server replies. Replies have no framing, so the received bytes are split
+/// by the recorded reply sizes, and each reply is compared by its digest; the total received by a session
+/// is compared against the sum of its recorded reply sizes as well.
+///
+
+#define REPLAY_RECV_SIZE 65536
+
+struct replay_options
+{
+    const char *host;
+    const char *port;
+    double speed; // 0 for the maximum speed
+    unsigned timeout_ms;
+};
+
+struct replay_event
+{
+    const struct session_trace_record *record;
+    const char *payload;
+};
+
+struct replay_session
+{
+    pthread_t thread;
+    uint32_t id;
+    const struct replay_options *options;
+    uint64_t start_ns;
+
+    struct replay_event *events;
+    size_t events_count;
+    size_t events_capacity;
+
+    uint64_t expected_bytes;
+    uint64_t received_bytes;
+    size_t expected_replies;
+    size_t different_replies; // complete replies whose digest differs from the recorded one
+    bool failed;
+
+    // The recorded reply being received (an index to `events`), and its bytes received so far.
+    size_t reply_event;
+    uint64_t reply_received;
+    uint64_t reply_digest;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/// When (on the replay clock) the recorded moment comes.
+static uint64_t replay_time(const struct replay_session *const session, const uint64_t timestamp_ns)
+{
+    if (session->options->speed <= 0)
+    {
+        return session->start_ns;
+    }
+    return session->start_ns + (uint64_t)((double)timestamp_ns / session->options->speed);
+}
+
+static int connect_to_server(const struct replay_options *const options)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = NULL;
+    const int res = getaddrinfo(options->host, options->port, &hints, &result);
+    if (res != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return -1;
+    }
+
+    int sock_fd = -1;
+    for (const struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        sock_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock_fd == -1)
+            continue;
+        if (connect(sock_fd, rp->ai_addr, rp->ai_addrlen) == 0)
+            break; // Success
+
+        close(sock_fd);
+        sock_fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock_fd == -1)
+    {
+        perror("connect");
+        return -1;
+    }
+
+    // Keep the recorded chunking.
+    const int opt_val = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    return sock_fd;
+}
+
+/// Splits the received bytes into the recorded replies, and compares the digest of each complete one.
+/// Bytes beyond the recorded replies are only counted (see `received_bytes`).
+///
+static void compare_replies(struct replay_session *const session, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        while ((session->reply_event < session->events_count) &&
+               (session->events[session->reply_event].record->type != SESSION_TRACE_REPLY))
+        {
+            session->reply_event++;
+        }
+        if (session->reply_event == session->events_count)
+        {
+            return;
+        }
+
+        const struct session_trace_record *const record = session->events[session->reply_event].record;
+        const uint64_t rest = record->size - session->reply_received;
+        const size_t taken = (size < rest) ? size : (size_t)rest;
+        session->reply_digest = session_trace_digest(session->reply_digest, data, taken);
+        session->reply_received += taken;
+        data += taken;
+        size -= taken;
+        if (session->reply_received == record->size)
+        {
+            if (session->reply_digest != record->digest)
+            {
+                session->different_replies++;
+            }
+            session->reply_event++;
+            session->reply_received = 0;
+            session->reply_digest = SESSION_TRACE_DIGEST_INIT;
+        }
+    }
+}
+
+/// Receives (and compares) the replies until the deadline.
+/// With `until_eof` it also stops as soon as the server closes the connection (returning true),
+/// and the deadline is an inactivity timeout.
+///
+static bool drain_replies(struct replay_session *const session, const int sock_fd, char *const buffer,
+                          const uint64_t deadline, const bool until_eof)
+{
+    uint64_t current_deadline = deadline;
+    for (;;)
+    {
+        const uint64_t now = now_ns();
+        if (now >= current_deadline)
+        {
+            return false;
+        }
+
+        struct pollfd pfd = {.fd = sock_fd, .events = POLLIN, .revents = 0};
+        const int ready = poll(&pfd, 1, (int)((current_deadline - now + 999999) / 1000000));
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if (ready == 0)
+        {
+            continue;
+        }
+
+        const ssize_t received = recv(sock_fd, buffer, REPLAY_RECV_SIZE, 0);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if (received == 0)
+        {
+            return true;
+        }
+        session->received_bytes += received;
+        compare_replies(session, buffer, received);
+        if (until_eof)
+        {
+            current_deadline = now_ns() + ((uint64_t)session->options->timeout_ms * 1000000ULL);
+        }
+    }
+}
+
+static bool send_all(const int sock_fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t res = send(sock_fd, data, size, MSG_NOSIGNAL);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+static void *session_thread(void *const arg)
+{
+    struct replay_session *const session = arg;
+    char *const buffer = malloc(REPLAY_RECV_SIZE);
+    if ((buffer == NULL) || (session->events_count == 0))
+    {
+        session->failed = true;
+        free(buffer);
+        return NULL;
+    }
+
+    // Connect at the recorded time of the session start.
+    //
+    const uint64_t open_at = replay_time(session, session->events[0].record->timestamp_ns);
+    const uint64_t now = now_ns();
+    if (open_at > now)
+    {
+        usleep((open_at - now) / 1000);
+    }
+    const int sock_fd = connect_to_server(session->options);
+    if (sock_fd == -1)
+    {
+        session->failed = true;
+        free(buffer);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < session->events_count; ++i)
+    {
+        const struct session_trace_record *const record = session->events[i].record;
+        if (record->type == SESSION_TRACE_DATA)
+        {
+            drain_replies(session, sock_fd, buffer, replay_time(session, record->timestamp_ns), false);
+            if (!send_all(sock_fd, session->events[i].payload, record->size))
+            {
+                session->failed = true;
+                break;
+            }
+        }
+        else if (record->type == SESSION_TRACE_CLOSE)
+        {
+            drain_replies(session, sock_fd, buffer, replay_time(session, record->timestamp_ns), false);
+            break;
+        }
+    }
+
+    // The server finishes the replies (and closes) once it sees the end of the stream.
+    //
+    shutdown(sock_fd, SHUT_WR);
+    const uint64_t timeout_ns = (uint64_t)session->options->timeout_ms * 1000000ULL;
+    if (!drain_replies(session, sock_fd, buffer, now_ns() + timeout_ns, true))
+    {
+        session->failed = true;
+    }
+
+    close(sock_fd);
+    free(buffer);
+    return NULL;
+}
+
+static struct replay_session *find_session(struct replay_session **const sessions, size_t *const sessions_count,
+                                           size_t *const sessions_capacity, const uint32_t id)
+{
+    // Session ids are assigned sequentially, so the most recent sessions are the most likely ones.
+    for (size_t i = *sessions_count; i > 0; --i)
+    {
+        if ((*sessions)[i - 1].id == id)
+        {
+            return &(*sessions)[i - 1];
+        }
+    }
+
+    if (*sessions_count == *sessions_capacity)
+    {
+        const size_t capacity = (*sessions_capacity > 0) ? (*sessions_capacity * 2) : 64;
+        struct replay_session *const grown = realloc(*sessions, capacity * sizeof(struct replay_session));
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        *sessions = grown;
+        *sessions_capacity = capacity;
+    }
+    struct replay_session *const session = &(*sessions)[(*sessions_count)++];
+    memset(session, 0, sizeof(struct replay_session));
+    session->id = id;
+    session->reply_digest = SESSION_TRACE_DIGEST_INIT;
+    return session;
+}
+
+static bool add_event(struct replay_session *const session, const struct session_trace_record *const record,
+                      const char *const payload)
+{
+    if (session->events_count == session->events_capacity)
+    {
+        const size_t capacity = (session->events_capacity > 0) ? (session->events_capacity * 2) : 16;
+        struct replay_event *const grown = realloc(session->events, capacity * sizeof(struct replay_event));
+        if (grown == NULL)
+        {
+            return false;
+        }
+        session->events = grown;
+        session->events_capacity = capacity;
+    }
+    session->events[session->events_count].record = record;
+    session->events[session->events_count].payload = payload;
+    session->events_count++;
+    return true;
+}
+
+static void print_usage(const char *const program)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-x speed|max] [-T timeout_ms] trace_path\n", program);
+    fprintf(stderr, "  -H  server host (default: localhost)\n");
+    fprintf(stderr, "  -p  server port (default: 9000)\n");
+    fprintf(stderr, "  -x  replay speed factor, e.g. 1 (default) or 10, or `max` for no pauses\n");
+    fprintf(stderr, "  -T  timeout for the server replies in milliseconds (default: 2000)\n");
+}
+
+int main(const int argc, const char **const argv)
+{
+    struct replay_options options;
+    options.host = "localhost";
+    options.port = "9000";
+    options.speed = 1.0;
+    options.timeout_ms = 2000;
+
+    int opt;
+    while ((opt = getopt(argc, (char *const *)argv, "H:p:x:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'x':
+            options.speed = (strcmp(optarg, "max") == 0) ? 0.0 : strtod(optarg, NULL);
+            if (options.speed < 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            options.timeout_ms = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != (argc - 1))
+    {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Map the whole trace, and index its records by session.
+    //
+    const int trace_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat trace_stat;
+    if ((trace_fd == -1) || (fstat(trace_fd, &trace_stat) == -1))
+    {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    const size_t trace_size = trace_stat.st_size;
+    const struct session_trace_header *const header =
+        (trace_size >= sizeof(struct session_trace_header))
+            ? mmap(NULL, trace_size, PROT_READ, MAP_PRIVATE, trace_fd, 0)
+            : MAP_FAILED;
+    close(trace_fd);
+    if ((header == MAP_FAILED) || (memcmp(header->magic, SESSION_TRACE_MAGIC, sizeof(SESSION_TRACE_MAGIC)) != 0) ||
+        (header->version != SESSION_TRACE_VERSION))
+    {
+        fprintf(stderr, "%s: not a session trace (of this version and byte order)\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    const char *const trace = (const char *)header;
+
+    struct replay_session *sessions = NULL;
+    size_t sessions_count = 0, sessions_capacity = 0;
+    uint64_t recorded_span_ns = 0;
+    size_t offset = sizeof(struct session_trace_header);
+    while ((offset + sizeof(struct session_trace_record)) <= trace_size)
+    {
+        const struct session_trace_record *const record = (const struct session_trace_record *)(trace + offset);
+        const char *const payload = trace + offset + sizeof(struct session_trace_record);
+        const size_t payload_size = (record->type == SESSION_TRACE_DATA) ? record->size : 0;
+        if ((offset + sizeof(struct session_trace_record) + payload_size) > trace_size)
+        {
+            fprintf(stderr, "%s: truncated record at offset %zu (ignored)\n", argv[optind], offset);
+            break;
+        }
+        offset += sizeof(struct session_trace_record) + payload_size;
+        recorded_span_ns = record->timestamp_ns;
+
+        struct replay_session *const session = find_session(&sessions, &sessions_count, &sessions_capacity, //
+                                                            record->session_id);
+        if ((session == NULL) || !add_event(session, record, payload))
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        if (record->type == SESSION_TRACE_REPLY)
+        {
+            session->expected_bytes += record->size;
+            session->expected_replies++;
+        }
+    }
+
+    // Replay all sessions at once (each at its own recorded time).
+    //
+    const uint64_t start_ns = now_ns();
+    size_t started = 0;
+    for (; started < sessions_count; ++started)
+    {
+        sessions[started].options = &options;
+        sessions[started].start_ns = start_ns;
+        const int err = pthread_create(&sessions[started].thread, NULL, session_thread, &sessions[started]);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    size_t mismatched = 0, failed = 0, replies = 0;
+    uint64_t expected_bytes = 0, received_bytes = 0;
+    for (size_t i = 0; i < started; ++i)
+    {
+        struct replay_session *const session = &sessions[i];
+        pthread_join(session->thread, NULL);
+        replies += session->expected_replies;
+        expected_bytes += session->expected_bytes;
+        received_bytes += session->received_bytes;
+        if (session->failed)
+        {
+            failed++;
+        }
+        if ((session->received_bytes != session->expected_bytes) || (session->different_replies > 0))
+        {
+            mismatched++;
+            printf("session %u: expected %" PRIu64 " reply bytes (%zu replies), received %" PRIu64
+                   " (%zu replies differ)\n",
+                   session->id, session->expected_bytes, session->expected_replies, session->received_bytes,
+                   session->different_replies);
+        }
+    }
+    const double elapsed_sec = (double)(now_ns() - start_ns) / 1e9;
+
+    printf("sessions:     %zu replayed (failed: %zu, mismatched replies: %zu)\n", started, failed, mismatched);
+    printf("replies:      %zu recorded, %" PRIu64 " bytes expected, %" PRIu64 " bytes received\n", replies,
+           expected_bytes, received_bytes);
+    printf("duration:     %.3f s replayed, %.3f s recorded\n", elapsed_sec, (double)recorded_span_ns / 1e9);
+
+    for (size_t i = 0; i < sessions_count; ++i)
+    {
+        free(sessions[i].events);
+    }
+    free(sessions);
+    munmap((void *)header, trace_size);
+    return ((failed == 0) && (mismatched == 0) && (started == sessions_count)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,24 @@
+#define _GNU_SOURCE // pthread_tryjoin_np
+
+#include "async_log.h"
 #include "client_flow.h"
+#include "newline_scan.h"
 #include "queue.h"
+#include "reactor.h"
+#include "session_trace.h"
+#include "stats.h"
+#include "stats_server.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "worker_pool.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -12,10 +26,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-static volatile sig_atomic_t g_running = 1;
+static volatile sig_atomic_t g_running = SERVER_RUNNING;
+
+/// The thread running `main` (the one woken up to drain on a hot upgrade).
+static pthread_t g_main_thread;
 
 static void signal_handler(const int sig)
 {
@@ -23,14 +43,44 @@ static void signal_handler(const int sig)
     {
     case SIGINT:
     case SIGTERM:
-        g_running = 0;
+        g_running = SERVER_STOPPED;
         break;
+    case SIGUSR2: // only interrupts a blocking call, so that `g_running` is checked (see `drain_engines`)
     default:
         break;
     }
 }
 
-static int open_aesd_socket()
+/// Called by the upgrade thread once the listeners are handed over (see `upgrade.h`), and then periodically:
+/// a signal could arrive right before the main thread blocks in `accept`, and the thread and pool engines only check
+/// whether they are idle when woken up, so it's repeated until the engines return.
+///
+static void drain_engines(void *const context, const bool stop)
+{
+    (void)context;
+
+    if (g_running != SERVER_STOPPED)
+    {
+        g_running = stop ? SERVER_STOPPED : SERVER_DRAINING;
+    }
+    pthread_kill(g_main_thread, SIGUSR2);
+}
+
+/// How often the listener shards are checked whether they are drained.
+#define DRAIN_POLL_MS 10
+
+static void drain_pause()
+{
+    const struct timespec pause = {.tv_sec = 0, .tv_nsec = DRAIN_POLL_MS * 1000000L};
+    nanosleep(&pause, NULL);
+}
+
+/// Opens and binds the server socket.
+///
+/// With `reuse_port` several sockets can be bound to the same port, and the kernel
+/// distributes incoming connections between them.
+///
+static int open_aesd_socket(const bool reuse_port)
 {
     // Build address data structure.
     //
@@ -72,6 +122,11 @@ static int open_aesd_socket()
             close(sock_fd);
             continue;
         }
+        if (reuse_port && (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt_val, sizeof(opt_val)) == -1))
+        {
+            close(sock_fd);
+            continue;
+        }
 
         if (bind(sock_fd, rp->ai_addr, rp->ai_addrlen) == 0)
             break; // Success
@@ -94,79 +149,120 @@ static int open_aesd_socket()
 }
 
 TAILQ_HEAD(clients_s, client_info);
+SLIST_HEAD(finished_clients_s, client_info);
+
+/// Completion queue of the thread-per-client engine.
+///
+/// A client thread posts itself once it's done, and wakes the accepting thread up through `event_fd`,
+/// so the finished threads are joined right away, visiting only them (rather than all the clients).
+///
+struct client_completions
+{
+    pthread_mutex_t lock;
+    struct finished_clients_s finished;
+    int event_fd;
+};
+
+/// Serves the client, and then posts it to the completion queue (it could be joined and deallocated
+/// right after that).
+///
+static void *client_thread(void *const arg)
+{
+    struct client_info *const client = process_client_thread(arg);
+    if (client != NULL)
+    {
+        struct client_completions *const completions = client->completions;
+        pthread_mutex_lock(&completions->lock);
+        SLIST_INSERT_HEAD(&completions->finished, client, completed);
+        pthread_mutex_unlock(&completions->lock);
 
-static void start_client_processing(struct clients_s *clients, struct shared_info *shared, const int peer_fd)
+        const uint64_t one = 1;
+        if (write(completions->event_fd, &one, sizeof(one)) == -1)
+        {
+            syslog(LOG_ERR, "write eventfd: %s", strerror(errno));
+        }
+    }
+    return client;
+}
+
+static void start_client_processing(struct clients_s *clients, struct client_completions *completions,
+                                    struct shared_info *shared, const int peer_fd)
 {
     assert(clients != NULL);
+    assert(completions != NULL);
     assert(shared != NULL);
     assert(peer_fd >= 0);
 
-    struct client_info *client = malloc(sizeof(struct client_info));
+    struct client_info *const client = client_info_create(shared, peer_fd);
     if (client == NULL)
     {
-        syslog(LOG_ERR, "malloc `client_info`: %s", strerror(errno));
         close(peer_fd);
         return;
     }
-    memset(client, 0, sizeof(struct client_info));
+    client->completions = completions;
 
-    client->shared = shared;
-    client->peer_fd = peer_fd;
-    client->fragments = NULL;
-    client->file = fopen(SOCKET_DATA_FILE, "a+");
-    if (client->file == NULL)
+    if (0 != pthread_create(&client->thread, NULL, client_thread, client))
     {
-        syslog(LOG_ERR, "fopen '%s': %s", SOCKET_DATA_FILE, strerror(errno));
-        free(client);
-        close(peer_fd);
+        syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
+        client_info_destroy(client);
         return;
     }
 
-    if (0 != pthread_create(&client->thread, NULL, process_client_thread, client))
+    TAILQ_INSERT_TAIL(clients, client, nodes);
+}
+
+static void join_client(struct clients_s *clients, struct client_info *client)
+{
+    async_log(LOG_DEBUG, "Joining client thread (thread=%p)...", (const void *)client->thread);
+    pthread_join(client->thread, NULL);
+    async_log(LOG_DEBUG, "Joined the client thread (thread=%p).", (const void *)client->thread);
+
+    // Deallocate any leftovers (if any) from the client thread.
+    //
+    TAILQ_REMOVE(clients, client, nodes);
+    client_info_destroy(client);
+}
+
+/// Joins the client threads posted to the completion queue so far.
+static void join_completed_clients(struct clients_s *clients, struct client_completions *completions)
+{
+    assert(clients != NULL);
+    assert(completions != NULL);
+
+    // The counter is reset before the queue is taken, so a post racing with this one wakes the next wait up.
+    uint64_t value;
+    if ((read(completions->event_fd, &value, sizeof(value)) == -1) && (errno != EAGAIN))
     {
-        syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
-        free(client);
-        close(peer_fd);
+        syslog(LOG_ERR, "read eventfd: %s", strerror(errno));
     }
 
-    TAILQ_INSERT_TAIL(clients, client, nodes);
+    struct finished_clients_s finished = SLIST_HEAD_INITIALIZER(finished);
+    pthread_mutex_lock(&completions->lock);
+    SLIST_SWAP(&finished, &completions->finished, client_info);
+    pthread_mutex_unlock(&completions->lock);
+
+    while (!SLIST_EMPTY(&finished))
+    {
+        struct client_info *const client = SLIST_FIRST(&finished);
+        SLIST_REMOVE_HEAD(&finished, completed);
+        join_client(clients, client);
+    }
 }
 
-void join_completed_clients(struct clients_s *clients, const bool cancel)
+/// Cancels and joins all the client threads (whether they have posted themselves already or not).
+static void cancel_clients(struct clients_s *clients, struct client_completions *completions)
 {
     assert(clients != NULL);
+    assert(completions != NULL);
 
     struct client_info *client = NULL;
     struct client_info *next = NULL;
     TAILQ_FOREACH_SAFE(client, clients, nodes, next)
     {
-        if (cancel)
-        {
-            pthread_cancel(client->thread);
-        }
-
-        if (cancel || (client->peer_fd < 0))
-        {
-            syslog(LOG_DEBUG, "Joining client thread (thread=%p)...", (const void *)client->thread);
-            pthread_join(client->thread, NULL);
-            syslog(LOG_DEBUG, "Joined the client thread (thread=%p).", (const void *)client->thread);
-
-            // Deallocate any leftovers (if any) from the client thread.
-            //
-            if (client->peer_fd >= 0)
-            {
-                close(client->peer_fd);
-            }
-            packet_fragments_free(client->fragments);
-            if (client->file != NULL)
-            {
-                fclose(client->file);
-            }
-
-            TAILQ_REMOVE(clients, client, nodes);
-            free(client);
-        }
+        pthread_cancel(client->thread);
+        join_client(clients, client);
     }
+    SLIST_INIT(&completions->finished); // all joined already
 }
 
 /*
@@ -225,102 +321,893 @@ static timer_t setup_timer(struct shared_info *const shared) {
 }
 */
 
-static void run_server_logic(const int server_sock_fd)
+/// Accepts the next connection, and logs the peer address.
+/// Returns -1 on failure (including interruption by a signal).
+///
+static int accept_client(const int server_sock_fd)
 {
     assert(server_sock_fd >= 0);
 
-    int res = listen(server_sock_fd, 1);
-    if (res == -1)
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addrlen = sizeof(peer_addr);
+    int peer_fd = accept(server_sock_fd, (struct sockaddr *)&peer_addr, &peer_addrlen);
+    if (peer_fd == -1)
     {
-        syslog(LOG_ERR, "listen: %s", strerror(errno));
-        return;
+        // A listener taken over on a hot upgrade is shared with the predecessor (until it exits),
+        // whose reactor could have made it non-blocking.
+        //
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            struct pollfd pollfd = {.fd = server_sock_fd, .events = POLLIN, .revents = 0};
+            poll(&pollfd, 1, -1);
+            return -1;
+        }
+        syslog(LOG_WARNING, "accept: %s", strerror(errno));
+        return -1;
     }
 
-    struct shared_info shared;
-    if (pthread_rwlock_init(&shared.rw_file_lock, NULL) != 0)
-    {
-        perror("pthread_rwlock_init");
-        exit(EXIT_FAILURE);
-    }
+    // The address is only formatted by the logging thread.
+    async_log_peer(LOG_INFO, "Accepted connection from", (struct sockaddr *)&peer_addr, peer_addrlen, peer_fd);
 
-    // const timer_t timer_id = setup_timer(&shared);
+    return peer_fd;
+}
+
+/// Serves clients with a dedicated thread per each accepted connection.
+///
+static void run_thread_per_client(const int server_sock_fd, struct shared_info *const shared)
+{
+    assert(server_sock_fd >= 0);
+    assert(shared != NULL);
 
     struct clients_s clients;
     TAILQ_INIT(&clients);
 
-    // The main loop.
+    struct client_completions completions;
+    SLIST_INIT(&completions.finished);
+    completions.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (completions.event_fd == -1)
+    {
+        syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+        return;
+    }
+    pthread_mutex_init(&completions.lock, NULL);
+
+    // The main loop: accepts new connections, and joins the client threads as soon as they are done.
+    //
+    struct pollfd pollfds[2] = {
+        {.fd = server_sock_fd, .events = POLLIN, .revents = 0},
+        {.fd = completions.event_fd, .events = POLLIN, .revents = 0},
+    };
+    // While draining it keeps accepting, until it's idle (what is left in the backlog is the successor's).
     //
-    while (g_running == 1)
+    while ((g_running == SERVER_RUNNING) ||
+           ((g_running == SERVER_DRAINING) && (!TAILQ_EMPTY(&clients) || !clients_idle(shared))))
     {
-        struct sockaddr_storage peer_addr;
-        socklen_t peer_addrlen = sizeof(peer_addr);
-        int peer_fd = accept(server_sock_fd, (struct sockaddr *)&peer_addr, &peer_addrlen);
-        if (peer_fd == -1)
+        if (poll(pollfds, 2, -1) == -1)
         {
-            syslog(LOG_WARNING, "accept: %s", strerror(errno));
+            if (errno != EINTR)
+            {
+                syslog(LOG_ERR, "poll: %s", strerror(errno));
+                break;
+            }
             continue;
         }
+        if (pollfds[1].revents & POLLIN)
+        {
+            join_completed_clients(&clients, &completions);
+        }
+        if (pollfds[0].revents & POLLIN)
+        {
+            const int peer_fd = accept_client(server_sock_fd);
+            if (peer_fd != -1)
+            {
+                start_client_processing(&clients, &completions, shared, peer_fd);
+            }
+        }
+    }
+
+    cancel_clients(&clients, &completions);
+    assert(TAILQ_EMPTY(&clients));
+
+    pthread_mutex_destroy(&completions.lock);
+    close(completions.event_fd);
+}
+
+/// Serves clients with a fixed number of worker threads.
+///
+static void run_worker_pool(const int server_sock_fd, struct shared_info *const shared, const size_t workers_count)
+{
+    assert(server_sock_fd >= 0);
+    assert(shared != NULL);
+
+    struct worker_pool *const pool = worker_pool_create(shared, workers_count);
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    // The main loop. While draining it keeps accepting, until it's idle (what is left in the backlog is
+    // the successor's).
+    //
+    while ((g_running == SERVER_RUNNING) ||
+           ((g_running == SERVER_DRAINING) && (!worker_pool_idle(pool) || !clients_idle(shared))))
+    {
+        const int peer_fd = accept_client(server_sock_fd);
+        if (peer_fd != -1)
+        {
+            worker_pool_submit(pool, peer_fd);
+        }
+    }
+    worker_pool_destroy(pool);
+}
+
+enum server_engine
+{
+    SERVER_ENGINE_THREAD, // a thread per client
+    SERVER_ENGINE_EPOLL,  // single-threaded epoll reactor
+    SERVER_ENGINE_POOL,   // fixed number of worker threads
+    SERVER_ENGINE_URING,  // single-threaded io_uring loop (falls back to epoll if unsupported)
+};
+
+struct server_options
+{
+    bool daemonize;
+    enum server_engine engine;
+    size_t workers_count;
+    size_t listeners_count;
+    int backlog;
+    const char *stats_endpoint; // NULL if the statistics are only dumped on SIGUSR1
+    const char *trace_path;     // NULL if the sessions are not recorded
+    const char *upgrade_path;   // NULL if there is no hot upgrade
+    bool pipelining;
+    int log_level;
+    enum fsync_policy fsync_policy;
+    unsigned long fsync_interval;
+    unsigned long upgrade_drain_timeout_s;
+    struct segment_log_config log_config;
+    size_t subscription_buffer_size;
+    enum subscriber_policy subscriber_policy;
+    size_t spill_threshold;
+    size_t buffer_budget;
+    bool low_latency;
+    struct cpu_rotation *cpus; // NULL unless the engine threads are pinned to the configured CPUs
+};
+
+static void run_engine(const int server_sock_fd, struct shared_info *const shared, //
+                       const struct server_options *const options, const size_t workers_count)
+{
+    switch (options->engine)
+    {
+    case SERVER_ENGINE_THREAD:
+        run_thread_per_client(server_sock_fd, shared);
+        break;
+    case SERVER_ENGINE_EPOLL:
+        reactor_run(server_sock_fd, shared, &g_running);
+        break;
+    case SERVER_ENGINE_POOL:
+        run_worker_pool(server_sock_fd, shared, workers_count);
+        break;
+    case SERVER_ENGINE_URING:
+        if (!uring_run(server_sock_fd, shared, &g_running))
+        {
+            syslog(LOG_WARNING, "io_uring is not available, falling back to epoll");
+            reactor_run(server_sock_fd, shared, &g_running);
+        }
+        break;
+    }
+}
+
+/// A listener of the SO_REUSEPORT group, served by its own thread (running the selected engine).
+struct listener_shard
+{
+    pthread_t thread;
+    int server_sock_fd;
+    int cpu; // the CPU the thread is pinned to (negative if not pinned)
+    bool joined;
+    size_t workers_count;
+    struct shared_info *shared;
+    const struct server_options *options;
+};
+
+static void *listener_shard_thread(void *const arg)
+{
+    struct listener_shard *const shard = arg;
+    assert(shard != NULL);
+
+    pin_thread(shard->cpu);
+    syslog(LOG_DEBUG, "Listener shard started (server_sock_fd=%d, cpu=%d).", shard->server_sock_fd, shard->cpu);
+
+    run_engine(shard->server_sock_fd, shard->shared, shard->options, shard->workers_count);
+    return NULL;
+}
+
+/// Serves each listener by its own thread, pinned to one of the configured CPUs (or of all the CPUs
+/// the process may run on) in turn, until a termination signal arrives.
+///
+static void run_listener_shards(const int *const server_sock_fds, struct shared_info *const shared,
+                                const struct server_options *const options)
+{
+    const size_t count = options->listeners_count;
+    struct listener_shard *const shards = calloc(count, sizeof(struct listener_shard));
+    if (shards == NULL)
+    {
+        syslog(LOG_ERR, "calloc `listener_shard`: %s", strerror(errno));
+        return;
+    }
+
+    // The configured CPUs are shared with the pool workers; otherwise the shards take all the CPUs in turn.
+    struct cpu_rotation allowed;
+    struct cpu_rotation *cpus = shared->cpus;
+    if (cpus == NULL)
+    {
+        cpu_rotation_allowed(&allowed);
+        cpus = &allowed;
+    }
+
+    // Termination signals are only handled by this (main) thread, which is waiting for them;
+    // the shard threads inherit the blocked mask, and get woken up by shutting their listeners down.
+    //
+    sigset_t stop_signals, prev_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &prev_mask);
+
+    size_t started = 0;
+    for (; started < count; ++started)
+    {
+        struct listener_shard *const shard = &shards[started];
+        shard->server_sock_fd = server_sock_fds[started];
+        shard->cpu = cpu_rotation_next(cpus);
+        shard->workers_count = options->workers_count / count;
+        if (shard->workers_count == 0)
+        {
+            shard->workers_count = 1;
+        }
+        shard->shared = shared;
+        shard->options = options;
+        const int err = pthread_create(&shard->thread, NULL, listener_shard_thread, shard);
+        if (err != 0)
+        {
+            syslog(LOG_ERR, "pthread_create: %s", strerror(err));
+            g_running = SERVER_STOPPED;
+            break;
+        }
+    }
+
+    while (g_running == SERVER_RUNNING)
+    {
+        sigsuspend(&prev_mask);
+    }
+
+    if (g_running == SERVER_DRAINING)
+    {
+        // The listeners are the successor's now, so they must not be shut down: the shards are woken up
+        // by SIGUSR2 instead, until they return. Termination signals cut the drain short meanwhile.
+        //
+        pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+        size_t running = started;
+        while (running > 0)
+        {
+            running = 0;
+            for (size_t i = 0; i < started; ++i)
+            {
+                if (!shards[i].joined)
+                {
+                    shards[i].joined = (pthread_tryjoin_np(shards[i].thread, NULL) == 0);
+                }
+                if (!shards[i].joined)
+                {
+                    pthread_kill(shards[i].thread, SIGUSR2);
+                    running++;
+                }
+            }
+            if (running > 0)
+            {
+                drain_pause();
+            }
+        }
+    }
+    else
+    {
+        // Pending `accept` calls (and the listener's poll) complete once the listening socket is shut down.
+        //
+        for (size_t i = 0; i < started; ++i)
+        {
+            shutdown(shards[i].server_sock_fd, SHUT_RDWR);
+        }
+        for (size_t i = 0; i < started; ++i)
+        {
+            pthread_join(shards[i].thread, NULL);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+    free(shards);
+}
+
+/// Runs the server on the listening sockets; `predecessor_fd` is the connection to the server they were
+/// taken over from (see `upgrade_take_over`), or -1.
+///
+static void run_server_logic(const int *const server_sock_fds, const struct server_options *const options,
+                             const int predecessor_fd)
+{
+    assert(server_sock_fds != NULL);
+    assert(options->listeners_count > 0);
+
+    // The predecessor keeps accepting until it's idle, and releases the file backend log right then, so only
+    // the connections arriving meanwhile wait in the (shared) listen backlog. The device is shared by both right away.
+    //
+    void *inherited = NULL;
+    size_t inherited_size = 0;
+    if (predecessor_fd >= 0)
+    {
+#if USE_AESD_CHAR_DEVICE
+        close(predecessor_fd);
+#else
+        inherited = upgrade_receive_store(predecessor_fd, &inherited_size);
+#endif
+    }
+
+    for (size_t i = 0; i < options->listeners_count; ++i)
+    {
+        if (listen(server_sock_fds[i], options->backlog) == -1)
+        {
+            syslog(LOG_ERR, "listen: %s", strerror(errno));
+            free(inherited);
+            return;
+        }
+        if (options->low_latency)
+        {
+            latency_profile_tune_listener(server_sock_fds[i]);
+        }
+    }
+    if (options->low_latency)
+    {
+        stats_rwlock_set_spin(LATENCY_PROFILE_LOCK_SPIN);
+    }
 
-        char host[NI_MAXHOST], service[NI_MAXSERV];
-        res = getnameinfo((struct sockaddr *)&peer_addr, peer_addrlen, host, NI_MAXHOST, service, NI_MAXSERV,
-                          NI_NUMERICSERV);
-        if (res == 0)
+    struct shared_info shared;
+    if (pthread_rwlock_init(&shared.rw_file_lock, NULL) != 0)
+    {
+        free(inherited);
+        perror("pthread_rwlock_init");
+        exit(EXIT_FAILURE);
+    }
+
+    shared.pipelining = options->pipelining;
+    shared.spill_threshold = options->spill_threshold;
+    shared.buffer_budget = options->buffer_budget;
+    shared.low_latency = options->low_latency;
+    shared.cpus = options->cpus;
+    shared.connected = 0;
+    shared.recorder = NULL;
+    if (options->trace_path != NULL)
+    {
+        shared.recorder = session_recorder_create(options->trace_path);
+        if (shared.recorder == NULL)
         {
-            syslog(LOG_INFO, "Accepted connection from %s:%s (peer_fd=%d)", host, service, peer_fd);
+            free(inherited);
+            pthread_rwlock_destroy(&shared.rw_file_lock);
+            return;
         }
-        else
+    }
+
+    // Subscriptions are opt-in: otherwise every commit would be copied to the fan-out buffer for nobody.
+    shared.subscriptions = NULL;
+    if (options->subscription_buffer_size > 0)
+    {
+        shared.subscriptions = subscription_hub_create(options->subscription_buffer_size, options->subscriber_policy);
+        if (shared.subscriptions == NULL)
         {
-            syslog(LOG_WARNING, "getnameinfo: %s", gai_strerror(res));
+            free(inherited);
+            session_recorder_destroy(shared.recorder);
+            pthread_rwlock_destroy(&shared.rw_file_lock);
+            return;
         }
-        start_client_processing(&clients, &shared, peer_fd);
+    }
+
+    snapshot_cache_init(&shared.snapshots);
+    compressed_reply_cache_init(&shared.compressed_replies, !USE_AESD_CHAR_DEVICE); // the device is a ring
+    const bool store_opened = group_commit_init(&shared.commits, &shared.rw_file_lock, &shared.snapshots, //
+                                                options->fsync_policy, options->fsync_interval,
+                                                &options->log_config, shared.subscriptions, inherited, inherited_size);
+    free(inherited);
+    if (!store_opened)
+    {
+        compressed_reply_cache_destroy(&shared.compressed_replies);
+        snapshot_cache_destroy(&shared.snapshots);
+        subscription_hub_destroy(shared.subscriptions);
+        session_recorder_destroy(shared.recorder);
+        pthread_rwlock_destroy(&shared.rw_file_lock);
+        return;
+    }
 
-        join_completed_clients(&clients, false);
+    // const timer_t timer_id = setup_timer(&shared);
+
+    // Blocks SIGUSR1 in this thread before the engine threads are started, so that they inherit it. (The storage,
+    // hub and log draining threads, started earlier, block every signal themselves.)
+    //
+    struct stats_server *const stats_server = stats_server_start(options->stats_endpoint);
+
+    struct upgrade_server *upgrade = NULL;
+    if (options->upgrade_path != NULL)
+    {
+        upgrade = upgrade_server_start(options->upgrade_path, server_sock_fds, options->listeners_count,
+                                       options->upgrade_drain_timeout_s, drain_engines, NULL);
     }
 
-    if (g_running == 0)
+    if (options->listeners_count == 1)
+    {
+        if (shared.cpus != NULL)
+        {
+            pin_thread(cpu_rotation_next(shared.cpus));
+        }
+        run_engine(server_sock_fds[0], &shared, options, options->workers_count);
+    }
+    else
+    {
+        run_listener_shards(server_sock_fds, &shared, options);
+    }
+
+    stats_server_stop(stats_server);
+    const bool handed_over = upgrade_server_stop(upgrade);
+
+    if (handed_over)
+    {
+        syslog(LOG_INFO, "Drained, handing the store over to the successor");
+    }
+    else if (g_running == SERVER_STOPPED)
     {
         syslog(LOG_INFO, "Caught signal, exiting");
     }
-    // timer_delete(timer_id);
 
-    join_completed_clients(&clients, true);
-    assert(TAILQ_EMPTY(&clients));
+    struct recv_buffer_pool_stats pool_stats;
+    recv_buffer_pool_stats(&pool_stats);
+    syslog(LOG_INFO, "Receive buffer pools: hits=%zu, misses=%zu, trimmed=%zu, cached=%zu, high_water=%zu, grown=%zu",
+           pool_stats.hits, pool_stats.misses, pool_stats.trimmed, pool_stats.cached, pool_stats.high_water,
+           pool_stats.grown_bytes);
+    // timer_delete(timer_id);
 
+    session_recorder_destroy(shared.recorder);
+    if (handed_over)
+    {
+        size_t state_size = 0;
+        void *const state = group_commit_hand_over(&shared.commits, &state_size);
+        upgrade_server_release(upgrade, state, state_size);
+        free(state);
+    }
+    else
+    {
+        group_commit_destroy(&shared.commits);
+        upgrade_server_release(upgrade, NULL, 0);
+    }
+    subscription_hub_destroy(shared.subscriptions);
+    compressed_reply_cache_destroy(&shared.compressed_replies);
+    snapshot_cache_destroy(&shared.snapshots);
     pthread_rwlock_destroy(&shared.rw_file_lock);
 }
 
-int main(const int argc, const char **const argv)
+/// Raises the soft limit of open descriptors up to the hard one,
+/// so that the reactor could hold as many connections as the system allows.
+///
+static void raise_open_files_limit()
 {
-#if !USE_AESD_CHAR_DEVICE
-    unlink(SOCKET_DATA_FILE);
-#endif
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if (limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+            {
+                syslog(LOG_WARNING, "setrlimit: %s", strerror(errno));
+            }
+        }
+    }
+}
+
+static void close_sockets(int *const sock_fds, const size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        close(sock_fds[i]);
+    }
+    free(sock_fds);
+}
+
+#define DEFAULT_WORKERS_PER_CPU 4
+
+/// Parses `none`, `<packets>` or `<ms>ms` fsync policy.
+static bool parse_fsync_policy(const char *const arg, struct server_options *const options)
+{
+    if (strcmp(arg, "none") == 0)
+    {
+        options->fsync_policy = FSYNC_NONE;
+        options->fsync_interval = 0;
+        return true;
+    }
+
+    char *end = NULL;
+    const unsigned long interval = strtoul(arg, &end, 10);
+    if ((end == arg) || (interval == 0))
+    {
+        return false;
+    }
+    if (*end == '\0')
+    {
+        options->fsync_policy = FSYNC_EVERY_PACKETS;
+    }
+    else if (strcmp(end, "ms") == 0)
+    {
+        options->fsync_policy = FSYNC_EVERY_MS;
+    }
+    else
+    {
+        return false;
+    }
+    options->fsync_interval = interval;
+    return true;
+}
+
+/// Parses a byte count with an optional `K`, `M`, or `G` suffix. Returns 0 if it's not valid.
+static uint64_t parse_size(const char *const arg)
+{
+    char *end = NULL;
+    const unsigned long long value = strtoull(arg, &end, 10);
+    if (end == arg)
+    {
+        return 0;
+    }
+
+    unsigned shift = 0;
+    switch (*end)
+    {
+    case '\0':
+        break;
+    case 'K':
+    case 'k':
+        shift = 10;
+        break;
+    case 'M':
+    case 'm':
+        shift = 20;
+        break;
+    case 'G':
+    case 'g':
+        shift = 30;
+        break;
+    default:
+        return 0;
+    }
+    if ((shift > 0) && (end[1] != '\0'))
+    {
+        return 0;
+    }
+    return (uint64_t)value << shift;
+}
 
-    // Make sure we have socket open.
+static void print_usage(const char *const program)
+{
+    fprintf(stderr, "Usage: %s [-d] [-e thread|epoll|pool|uring] [-w workers] [-l listeners] [-b backlog] [-p]\n", program);
+    fprintf(stderr, "          [-f none|<packets>|<ms>ms] [-g segment_size] [-m retention_size] [-a retention_s]\n");
+    fprintf(stderr, "          [-t subscription_buffer_size] [-T drop|disconnect] [-S <port>|<unix socket path>]\n");
+    fprintf(stderr, "          [-R trace_path] [-L err|warning|notice|info|debug] [-U upgrade_socket_path]\n");
+    fprintf(stderr, "          [-D drain_timeout_s]\n");
+    fprintf(stderr, "          [-M spill_threshold] [-B buffer_budget] [-P low-latency] [-c cpu_list]\n");
+    fprintf(stderr, "  -d  run as a daemon\n");
+    fprintf(stderr, "  -e  I/O engine: `thread` per client, `epoll` reactor (default), `pool` of workers,\n");
+    fprintf(stderr, "      or `uring` (io_uring; falls back to `epoll` if the kernel doesn't support it)\n");
+    fprintf(stderr, "  -w  number of `pool` workers (default: %d per online CPU), split between the listeners\n",
+            DEFAULT_WORKERS_PER_CPU);
+    fprintf(stderr, "  -l  number of SO_REUSEPORT listeners, each served by its own engine on a thread\n");
+    fprintf(stderr, "      (default: 1, served by the main thread); the threads are pinned to the `-c` CPUs\n");
+    fprintf(stderr, "      in turn, or without it to the CPUs the server may run on in turn\n");
+    fprintf(stderr, "  -b  listen backlog (default: SOMAXCONN)\n");
+    fprintf(stderr, "  -p  pipelining: all complete lines received together are appended as one batch,\n");
+    fprintf(stderr, "      and answered with a single reply (by default each line gets its own reply)\n");
+    fprintf(stderr, "  -f  fsync policy of the file backend: `none` (default), every N packets,\n");
+    fprintf(stderr, "      or every T milliseconds (checked when packets are committed)\n");
+    fprintf(stderr, "  -g  segment size of the file backend log, with an optional K/M/G suffix (default: %luM)\n",
+            SEGMENT_LOG_DEFAULT_SEGMENT_SIZE >> 20);
+    fprintf(stderr, "  -m  drop the oldest file backend segments once the log exceeds this size (K/M/G suffix)\n");
+    fprintf(stderr, "  -a  drop the file backend segments this many seconds after they got full\n");
+    fprintf(stderr, "  -t  enables `SUBSCRIBE`: size of the buffer of the latest records streamed to subscribed\n");
+    fprintf(stderr, "      connections, with an optional K/M/G suffix (e.g. %luM); without it, `SUBSCRIBE` is\n",
+            SUBSCRIPTION_SUGGESTED_BUFFER_SIZE >> 20);
+    fprintf(stderr, "      an ordinary packet\n");
+    fprintf(stderr, "  -T  what happens to a subscriber which falls behind the whole buffer: it skips the lost\n");
+    fprintf(stderr, "      records (`drop`, default), or gets disconnected (`disconnect`)\n");
+    fprintf(stderr, "  -S  serve the statistics on a loopback TCP port or a Unix socket (send `json` for JSON);\n");
+    fprintf(stderr, "      they are also dumped to syslog on SIGUSR1\n");
+    fprintf(stderr, "  -L  log level (default: debug); can be changed at runtime by sending `level <name>`\n");
+    fprintf(stderr, "      to the statistics endpoint\n");
+    fprintf(stderr, "  -R  record all sessions (received bytes, reply sizes and digests) to a trace file\n");
+    fprintf(stderr, "      for `aesdreplay`\n");
+    fprintf(stderr, "  -U  hot upgrade: a server started with the same Unix socket path takes the listeners over\n");
+    fprintf(stderr, "      from the running one, which keeps serving (and accepting) until it has no client left,\n");
+    fprintf(stderr, "      and then hands the file backend log over as it is\n");
+    fprintf(stderr, "  -D  how long the `-U` predecessor waits for its clients to finish before closing them\n");
+    fprintf(stderr, "      (default: %ds, 0 closes them right away)\n", UPGRADE_DEFAULT_DRAIN_TIMEOUT_S);
+    fprintf(stderr, "  -M  an unterminated packet longer than this (K/M/G suffix, default: %dM) is moved from memory\n",
+            PACKET_SPILL_DEFAULT_THRESHOLD >> 20);
+    fprintf(stderr, "      to a temporary file in %s, and appended from there once terminated; longer binary\n",
+            PACKET_SPILL_DIR);
+    fprintf(stderr, "      frames are refused\n");
+    fprintf(stderr, "  -B  once the receive buffers of all connections grow beyond this (K/M/G suffix, default: %dM),\n",
+            PACKET_SPILL_DEFAULT_BUDGET >> 20);
+    fprintf(stderr, "      every unterminated packet longer than %d bytes is moved to a temporary file, and binary\n",
+            BUFFER_SIZE);
+    fprintf(stderr, "      frames which would grow them further are answered as busy\n");
+    fprintf(stderr, "  -P  `low-latency` profile for dedicated hosts, trading CPU time for the tail latency: busy polling\n");
+    fprintf(stderr, "      sockets (%dus), TCP_NODELAY and TCP_QUICKACK, corked multi-chunk replies, and spinning\n",
+            LATENCY_PROFILE_BUSY_POLL_US);
+    fprintf(stderr, "      on the contended store lock before blocking\n");
+    fprintf(stderr, "  -c  pin the engine threads (listener shards, or the main one, and pool workers) to these CPUs\n");
+    fprintf(stderr, "      in turn, e.g. `2-5,8`\n");
+}
+
+int main(const int argc, const char **const argv)
+{
+    // Parse the command line arguments.
     //
-    int sock_fd = open_aesd_socket();
+    struct server_options options;
+    options.daemonize = false;
+    options.engine = SERVER_ENGINE_EPOLL;
+    options.workers_count = 0;
+    options.listeners_count = 1;
+    options.backlog = SOMAXCONN;
+    options.stats_endpoint = NULL;
+    options.trace_path = NULL;
+    options.upgrade_path = NULL;
+    options.upgrade_drain_timeout_s = UPGRADE_DEFAULT_DRAIN_TIMEOUT_S;
+    options.pipelining = false;
+    options.log_level = LOG_DEBUG;
+    options.fsync_policy = FSYNC_NONE;
+    options.fsync_interval = 0;
+    options.log_config.segment_size = SEGMENT_LOG_DEFAULT_SEGMENT_SIZE;
+    options.log_config.retention_bytes = 0;
+    options.log_config.retention_seconds = 0;
+    options.subscription_buffer_size = 0; // no subscriptions
+    options.subscriber_policy = SUBSCRIBER_DROP;
+    options.spill_threshold = PACKET_SPILL_DEFAULT_THRESHOLD;
+    options.buffer_budget = PACKET_SPILL_DEFAULT_BUDGET;
+    options.low_latency = false;
+    options.cpus = NULL;
+    int opt;
+    while ((opt = getopt(argc, (char *const *)argv, "a:b:B:c:dD:e:f:g:l:L:m:M:pP:R:S:t:T:U:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            options.log_config.retention_seconds = strtoul(optarg, NULL, 10);
+            if (options.log_config.retention_seconds == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            options.backlog = (int)strtol(optarg, NULL, 10);
+            if (options.backlog <= 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            options.buffer_budget = parse_size(optarg);
+            if (options.buffer_budget == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            free(options.cpus);
+            options.cpus = malloc(sizeof(struct cpu_rotation));
+            if ((options.cpus == NULL) || !cpu_rotation_parse(options.cpus, optarg))
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            options.daemonize = true;
+            break;
+        case 'D':
+        {
+            char *end = NULL;
+            options.upgrade_drain_timeout_s = strtoul(optarg, &end, 10);
+            if ((end == optarg) || (*end != '\0'))
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'e':
+            if (strcmp(optarg, "thread") == 0)
+            {
+                options.engine = SERVER_ENGINE_THREAD;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                options.engine = SERVER_ENGINE_EPOLL;
+            }
+            else if (strcmp(optarg, "pool") == 0)
+            {
+                options.engine = SERVER_ENGINE_POOL;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                options.engine = SERVER_ENGINE_URING;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            if (!parse_fsync_policy(optarg, &options))
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            options.log_config.segment_size = parse_size(optarg);
+            if (options.log_config.segment_size == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            options.listeners_count = strtoul(optarg, NULL, 10);
+            if (options.listeners_count == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            options.log_level = async_log_parse_level(optarg);
+            if (options.log_level < 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            options.log_config.retention_bytes = parse_size(optarg);
+            if (options.log_config.retention_bytes == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            options.spill_threshold = parse_size(optarg);
+            if (options.spill_threshold == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            options.pipelining = true;
+            break;
+        case 'P':
+            if (strcmp(optarg, "low-latency") != 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            options.low_latency = true;
+            break;
+        case 'R':
+            options.trace_path = optarg;
+            break;
+        case 'S':
+            options.stats_endpoint = optarg;
+            break;
+        case 't':
+            options.subscription_buffer_size = parse_size(optarg);
+            if (options.subscription_buffer_size == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            if (strcmp(optarg, "drop") == 0)
+            {
+                options.subscriber_policy = SUBSCRIBER_DROP;
+            }
+            else if (strcmp(optarg, "disconnect") == 0)
+            {
+                options.subscriber_policy = SUBSCRIBER_DISCONNECT;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'U':
+            options.upgrade_path = optarg;
+            break;
+        case 'w':
+            options.workers_count = strtoul(optarg, NULL, 10);
+            if (options.workers_count == 0)
+            {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.workers_count == 0)
+    {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.workers_count = DEFAULT_WORKERS_PER_CPU * ((cpus > 0) ? cpus : 1);
+    }
 
-    // Detect `-d` flag in the command line arguments.
+    // Make sure we have socket(s) open: taken over from the running server on a hot upgrade, or bound anew.
     //
-    const bool daemonize = ((argc == 2) && (strcmp(argv[1], "-d") == 0));
-    if (daemonize)
+    const size_t sock_fds_capacity =
+        (options.listeners_count > UPGRADE_MAX_LISTENERS) ? options.listeners_count : UPGRADE_MAX_LISTENERS;
+    int *const sock_fds = calloc(sock_fds_capacity, sizeof(int));
+    if (sock_fds == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    int predecessor_fd = -1;
+    if (options.upgrade_path != NULL)
+    {
+        size_t taken = 0;
+        predecessor_fd = upgrade_take_over(options.upgrade_path, sock_fds, sock_fds_capacity, &taken);
+        if ((predecessor_fd >= 0) && (taken != options.listeners_count))
+        {
+            syslog(LOG_NOTICE, "Took %zu listeners over (rather than %zu).", taken, options.listeners_count);
+            options.listeners_count = taken;
+        }
+    }
+    if (predecessor_fd == -1)
+    {
+        for (size_t i = 0; i < options.listeners_count; ++i)
+        {
+            sock_fds[i] = open_aesd_socket(options.listeners_count > 1);
+        }
+    }
+    if (options.daemonize)
     {
         const int res = fork();
         if (res < 0)
         {
             perror("fork");
-            close(sock_fd);
+            close_sockets(sock_fds, options.listeners_count);
             exit(EXIT_FAILURE);
         }
         if (res > 0)
         {
             // Parent process.
-            close(sock_fd);
+            close_sockets(sock_fds, options.listeners_count);
             exit(EXIT_SUCCESS);
         }
     }
+    g_main_thread = pthread_self();
 
-    openlog(NULL, LOG_PID | LOG_NDELAY, daemonize ? LOG_DAEMON : LOG_USER);
+    openlog(NULL, LOG_PID | LOG_NDELAY, options.daemonize ? LOG_DAEMON : LOG_USER);
     syslog(LOG_INFO, "Started");
+    async_log_start(options.log_level);
+    async_log(LOG_DEBUG, "Newline scanner: %s.", newline_scan_implementation());
 
     // Set up signal handlers.
     //
@@ -329,14 +1216,23 @@ int main(const int argc, const char **const argv)
     sigbreak.sa_handler = &signal_handler;
     sigaction(SIGINT, &sigbreak, NULL);
     sigaction(SIGTERM, &sigbreak, NULL);
+    sigaction(SIGUSR2, &sigbreak, NULL);
 
-    run_server_logic(sock_fd);
+    // Zero-copy replies (`sendfile`/`splice`) can't suppress SIGPIPE per call (like `MSG_NOSIGNAL` does),
+    // so a peer closing its connection in the middle of a reply must not kill the whole server.
+    //
+    struct sigaction sigignore;
+    memset(&sigignore, 0, sizeof sigignore);
+    sigignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigignore, NULL);
 
-    close(sock_fd);
-#if !USE_AESD_CHAR_DEVICE
-    unlink(SOCKET_DATA_FILE);
-#endif
+    raise_open_files_limit();
+
+    run_server_logic(sock_fds, &options, predecessor_fd);
+
+    close_sockets(sock_fds, options.listeners_count);
 
+    async_log_stop();
     syslog(LOG_INFO, "Completed!");
     return 0;
 }
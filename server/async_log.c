@@ -0,0 +1,466 @@
+#define _GNU_SOURCE // SYS_futex
+
+#include "async_log.h"
+#include "background_thread.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <linux/futex.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// The new rings stack once the logger is stopped (see `get_ring`).
+#define LOG_RINGS_CLOSED ((struct log_ring *)1)
+
+enum log_entry_kind
+{
+    LOG_ENTRY_TEXT, // already formatted message
+    LOG_ENTRY_PEER, // `prefix` plus the peer address (formatted by the draining thread)
+};
+
+struct log_entry
+{
+    int priority;
+    enum log_entry_kind kind;
+    union
+    {
+        char text[ASYNC_LOG_MESSAGE_SIZE];
+        struct
+        {
+            const char *prefix;
+            int peer_fd;
+            socklen_t addrlen;
+            struct sockaddr_storage addr;
+        } peer;
+    };
+};
+
+/// Who frees a ring is decided by a single exchange of its state.
+enum log_ring_state
+{
+    LOG_RING_OWNED,    // its thread is running, and the ring is drained
+    LOG_RING_ORPHANED, // its thread has exited; the consumer frees it
+    LOG_RING_DETACHED, // not drained any more (the logger is stopped); its thread frees it on exit
+};
+
+/// Single producer (the owning thread), single consumer (the draining thread) ring.
+struct log_ring
+{
+    uint32_t head; // next entry to drain (written by the consumer only)
+    uint32_t tail; // next entry to fill (written by the producer only)
+    uint64_t dropped;
+    uint64_t dropped_reported; // consumer only
+    uint32_t state;            // `log_ring_state`
+    bool busy;                 // the producer is filling an entry (so `async_log_stop` waits for it)
+
+    struct log_ring *next_new;
+    LIST_ENTRY(log_ring) nodes;
+
+    struct log_entry entries[ASYNC_LOG_RING_SIZE];
+};
+
+int g_async_log_level = LOG_DEBUG;
+
+static bool g_started = false;
+static bool g_stopping = false;
+static pthread_t g_drain_thread;
+
+// The draining thread sleeps on `g_wakeups` while all rings are empty; the first producer to publish
+// after that wakes it up.
+//
+static bool g_drainer_sleeping = false;
+static uint32_t g_wakeups = 0;
+
+static __thread struct log_ring *tls_ring = NULL;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+
+// New rings are pushed onto a lock-free stack (so that a producer never waits),
+// and adopted into the list owned by the draining thread.
+//
+static struct log_ring *g_new_rings = NULL;
+static LIST_HEAD(log_rings_s, log_ring) g_rings = LIST_HEAD_INITIALIZER(g_rings);
+
+static void futex_wait(uint32_t *const word, const uint32_t expected)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *const word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void orphan_ring(void *const arg)
+{
+    struct log_ring *const ring = arg;
+    if (__atomic_exchange_n(&ring->state, LOG_RING_ORPHANED, __ATOMIC_ACQ_REL) == LOG_RING_DETACHED)
+    {
+        free(ring);
+    }
+}
+
+static void create_ring_key()
+{
+    pthread_key_create(&g_ring_key, orphan_ring);
+}
+
+/// Gets (lazily creating) the ring of the calling thread. Returns NULL if it can't be allocated.
+///
+/// A ring created while the logger is being stopped is detached right away (the caller sees it's stopped then).
+///
+static struct log_ring *get_ring()
+{
+    struct log_ring *ring = tls_ring;
+    if (ring == NULL)
+    {
+        pthread_once(&g_ring_key_once, create_ring_key);
+
+        ring = calloc(1, sizeof(struct log_ring));
+        if (ring != NULL)
+        {
+            ring->state = LOG_RING_OWNED;
+            ring->next_new = __atomic_load_n(&g_new_rings, __ATOMIC_SEQ_CST);
+            do
+            {
+                if (ring->next_new == LOG_RINGS_CLOSED)
+                {
+                    ring->state = LOG_RING_DETACHED;
+                    break;
+                }
+            } while (!__atomic_compare_exchange_n(&g_new_rings, &ring->next_new, ring, true, __ATOMIC_SEQ_CST,
+                                                  __ATOMIC_SEQ_CST));
+
+            pthread_setspecific(g_ring_key, ring);
+            tls_ring = ring;
+        }
+    }
+    return ring;
+}
+
+/// Starts filling an entry of the calling thread's ring. Returns false if the logger is not running
+/// (the message is to be logged directly then). Otherwise `*entry` is the entry to fill, or NULL if the ring
+/// is full (the drop is counted), and `end_entry` must follow.
+///
+static bool begin_entry(struct log_ring **const ring_out, struct log_entry **const entry_out)
+{
+    if (!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    struct log_ring *const ring = get_ring();
+    if (ring == NULL)
+    {
+        return false;
+    }
+
+    // Either `async_log_stop` sees the producer busy (and waits for the entry), or the producer sees it stopped.
+    __atomic_store_n(&ring->busy, true, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&g_started, __ATOMIC_SEQ_CST))
+    {
+        __atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    *ring_out = ring;
+    *entry_out = NULL;
+    const uint32_t tail = ring->tail;
+    if ((tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) >= ASYNC_LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    *entry_out = &ring->entries[tail & (ASYNC_LOG_RING_SIZE - 1)];
+    return true;
+}
+
+/// Publishes the filled entry (unless the ring was full), and wakes the draining thread up if it's sleeping.
+static void end_entry(struct log_ring *const ring, const bool filled)
+{
+    if (filled)
+    {
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+
+    // Only the first producer after the draining thread went to sleep pays for the wake-up.
+    if (filled && __atomic_load_n(&g_drainer_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&g_drainer_sleeping, false, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&g_wakeups, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&g_wakeups);
+    }
+}
+
+static void write_entry(const struct log_entry *const entry)
+{
+    if (entry->kind == LOG_ENTRY_TEXT)
+    {
+        syslog(entry->priority, "%s", entry->text);
+        return;
+    }
+
+    char host[NI_MAXHOST], service[NI_MAXSERV];
+    const int res = getnameinfo((const struct sockaddr *)&entry->peer.addr, entry->peer.addrlen, host, NI_MAXHOST,
+                                service, NI_MAXSERV, NI_NUMERICSERV);
+    if (res == 0)
+    {
+        syslog(entry->priority, "%s %s:%s (peer_fd=%d)", entry->peer.prefix, host, service, entry->peer.peer_fd);
+    }
+    else
+    {
+        syslog(LOG_WARNING, "getnameinfo: %s", gai_strerror(res));
+    }
+}
+
+/// Moves the new rings to the list of the drained ones, leaving `replacement` for the next ones.
+static void adopt_rings(struct log_ring *const replacement)
+{
+    struct log_ring *adopted = __atomic_exchange_n(&g_new_rings, replacement, __ATOMIC_SEQ_CST);
+    while (adopted != NULL)
+    {
+        struct log_ring *const next = adopted->next_new;
+        LIST_INSERT_HEAD(&g_rings, adopted, nodes);
+        adopted = next;
+    }
+}
+
+/// Drains all adopted rings once (freeing the orphaned ones). Returns the number of drained messages.
+static size_t drain_rings()
+{
+    size_t drained = 0;
+    struct log_ring *ring = NULL;
+    struct log_ring *next = NULL;
+    LIST_FOREACH_SAFE(ring, &g_rings, nodes, next)
+    {
+        const bool orphaned = (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == LOG_RING_ORPHANED);
+        const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint32_t head = ring->head;
+        for (; head != tail; ++head)
+        {
+            write_entry(&ring->entries[head & (ASYNC_LOG_RING_SIZE - 1)]);
+            drained++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        const uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported)
+        {
+            syslog(LOG_WARNING, "Log ring overflow: dropped %lu message(s).",
+                   (unsigned long)(dropped - ring->dropped_reported));
+            ring->dropped_reported = dropped;
+        }
+
+        if (orphaned)
+        {
+            LIST_REMOVE(ring, nodes);
+            free(ring);
+        }
+    }
+    return drained;
+}
+
+static bool rings_empty()
+{
+    if (__atomic_load_n(&g_new_rings, __ATOMIC_SEQ_CST) != NULL)
+    {
+        return false;
+    }
+    struct log_ring *ring = NULL;
+    LIST_FOREACH(ring, &g_rings, nodes)
+    {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Sleeps until a producer publishes a message (or the stop is requested).
+static void wait_for_messages()
+{
+    const uint32_t wakeups = __atomic_load_n(&g_wakeups, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_drainer_sleeping, true, __ATOMIC_SEQ_CST);
+
+    // A producer which published before seeing the flag is found by this check.
+    if (rings_empty() && !__atomic_load_n(&g_stopping, __ATOMIC_SEQ_CST))
+    {
+        futex_wait(&g_wakeups, wakeups);
+    }
+    __atomic_store_n(&g_drainer_sleeping, false, __ATOMIC_SEQ_CST);
+}
+
+static void *drain_thread(void *const arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&g_stopping, __ATOMIC_SEQ_CST))
+    {
+        adopt_rings(NULL);
+        if (drain_rings() == 0)
+        {
+            wait_for_messages();
+        }
+    }
+    adopt_rings(NULL);
+    drain_rings();
+    return NULL;
+}
+
+bool async_log_start(const int level)
+{
+    assert(!g_started && (g_new_rings != LOG_RINGS_CLOSED)); // not restartable
+
+    async_log_set_level(level);
+
+    __atomic_store_n(&g_stopping, false, __ATOMIC_RELEASE);
+    if (!create_unsignalled_thread(&g_drain_thread, drain_thread, NULL))
+    {
+        return false;
+    }
+
+    __atomic_store_n(&g_started, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void async_log_stop()
+{
+    if (!g_started)
+    {
+        return;
+    }
+
+    __atomic_store_n(&g_started, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_stopping, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&g_wakeups, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&g_wakeups);
+    pthread_join(g_drain_thread, NULL);
+
+    // This thread is the consumer now. No ring is created any more, and the messages of the producers which
+    // still saw the logger running are drained once they are published.
+    //
+    adopt_rings(LOG_RINGS_CLOSED);
+    struct log_ring *ring = NULL;
+    LIST_FOREACH(ring, &g_rings, nodes)
+    {
+        while (__atomic_load_n(&ring->busy, __ATOMIC_ACQUIRE))
+        {
+            sched_yield();
+        }
+    }
+    drain_rings();
+
+    // The rest of the rings are left to their threads (which only log directly now), to be freed on their exit.
+    struct log_ring *next = NULL;
+    LIST_FOREACH_SAFE(ring, &g_rings, nodes, next)
+    {
+        LIST_REMOVE(ring, nodes);
+        if (ring == tls_ring)
+        {
+            // This thread's own ring (the main thread's destructors don't run on exit).
+            pthread_setspecific(g_ring_key, NULL);
+            tls_ring = NULL;
+            free(ring);
+        }
+        else if (__atomic_exchange_n(&ring->state, LOG_RING_DETACHED, __ATOMIC_ACQ_REL) == LOG_RING_ORPHANED)
+        {
+            free(ring);
+        }
+    }
+}
+
+void async_log_set_level(const int level)
+{
+    __atomic_store_n(&g_async_log_level, level, __ATOMIC_RELAXED);
+}
+
+int async_log_parse_level(const char *const name)
+{
+    static const struct
+    {
+        const char *name;
+        int level;
+    } levels[] = {{"err", LOG_ERR}, {"warning", LOG_WARNING}, {"notice", LOG_NOTICE}, {"info", LOG_INFO},
+                  {"debug", LOG_DEBUG}};
+
+    for (size_t i = 0; i < (sizeof(levels) / sizeof(levels[0])); ++i)
+    {
+        if (strcmp(name, levels[i].name) == 0)
+        {
+            return levels[i].level;
+        }
+    }
+    return -1;
+}
+
+void async_log(const int priority, const char *const format, ...)
+{
+    if (!async_log_enabled(priority))
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    struct log_ring *ring = NULL;
+    struct log_entry *entry = NULL;
+    if (!begin_entry(&ring, &entry))
+    {
+        vsyslog(priority, format, args);
+    }
+    else
+    {
+        if (entry != NULL)
+        {
+            entry->priority = priority;
+            entry->kind = LOG_ENTRY_TEXT;
+            vsnprintf(entry->text, sizeof(entry->text), format, args);
+        }
+        end_entry(ring, entry != NULL);
+    }
+    va_end(args);
+}
+
+void async_log_peer(const int priority, const char *const prefix, const struct sockaddr *const addr,
+                    const socklen_t addrlen, const int peer_fd)
+{
+    if (!async_log_enabled(priority))
+    {
+        return;
+    }
+
+    struct log_ring *ring = NULL;
+    struct log_entry *entry = NULL;
+    if (!begin_entry(&ring, &entry))
+    {
+        struct log_entry direct;
+        direct.priority = priority;
+        direct.kind = LOG_ENTRY_PEER;
+        direct.peer.prefix = prefix;
+        direct.peer.peer_fd = peer_fd;
+        direct.peer.addrlen = (addrlen <= sizeof(direct.peer.addr)) ? addrlen : sizeof(direct.peer.addr);
+        memcpy(&direct.peer.addr, addr, direct.peer.addrlen);
+        write_entry(&direct);
+        return;
+    }
+
+    if (entry != NULL)
+    {
+        entry->priority = priority;
+        entry->kind = LOG_ENTRY_PEER;
+        entry->peer.prefix = prefix;
+        entry->peer.peer_fd = peer_fd;
+        entry->peer.addrlen = (addrlen <= sizeof(entry->peer.addr)) ? addrlen : sizeof(entry->peer.addr);
+        memcpy(&entry->peer.addr, addr, entry->peer.addrlen);
+    }
+    end_entry(ring, entry != NULL);
+}
@@ -0,0 +1,47 @@
+#ifndef AESDSOCKET_ASYNC_LOG_H
+#define AESDSOCKET_ASYNC_LOG_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+/// Number of messages a thread can have queued (must be a power of 2); more are dropped.
+#define ASYNC_LOG_RING_SIZE 64
+
+/// Maximum length of a formatted message (longer ones are truncated).
+#define ASYNC_LOG_MESSAGE_SIZE 200
+
+/// Asynchronous logger for the request path.
+///
+/// Every thread formats its messages into its own lock-free ring, which a background thread drains to syslog;
+/// a full ring drops the message (the drops are reported) rather than blocking the caller. Messages above
+/// the current level are filtered out before any formatting. Until `async_log_start` (and after
+/// `async_log_stop`) messages go to syslog directly.
+///
+
+/// Starts the draining thread (with all signals blocked), once per process. Returns false on failure.
+bool async_log_start(int level);
+
+/// Stops the draining thread, and drains all queued messages (including the ones being queued meanwhile).
+void async_log_stop();
+
+/// Changes the level (a `LOG_*` priority) at runtime: messages with a greater priority are dropped.
+void async_log_set_level(int level);
+
+/// Parses a level name (`err`, `warning`, `notice`, `info` or `debug`). Returns -1 if unknown.
+int async_log_parse_level(const char *name);
+
+static inline bool async_log_enabled(const int priority)
+{
+    extern int g_async_log_level;
+    return priority <= __atomic_load_n(&g_async_log_level, __ATOMIC_RELAXED);
+}
+
+void async_log(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/// Logs "<prefix> <host>:<port> (peer_fd=N)". The address is only resolved (by `getnameinfo`)
+/// on the draining thread; `prefix` must be a string literal (it's referenced, not copied).
+///
+void async_log_peer(int priority, const char *prefix, const struct sockaddr *addr, socklen_t addrlen, int peer_fd);
+
+#endif // AESDSOCKET_ASYNC_LOG_H
@@ -0,0 +1,22 @@
+#include "background_thread.h"
+
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+
+bool create_unsignalled_thread(pthread_t *const thread, void *(*const start)(void *), void *const arg)
+{
+    // The new thread inherits the mask of this one.
+    //
+    sigset_t all_signals, prev_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &prev_mask);
+    const int err = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &prev_mask, NULL);
+    if (err != 0)
+    {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(err));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef AESDSOCKET_BACKGROUND_THREAD_H
+#define AESDSOCKET_BACKGROUND_THREAD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/// Creates a thread which never gets any process-directed signal (all signals are blocked in it), so that
+/// the termination signals are only ever handled by the main thread. Returns false on failure (logged).
+///
+bool create_unsignalled_thread(pthread_t *thread, void *(*start)(void *), void *arg);
+
+#endif // AESDSOCKET_BACKGROUND_THREAD_H
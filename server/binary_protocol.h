@@ -0,0 +1,102 @@
+#ifndef AESDSOCKET_BINARY_PROTOCOL_H
+#define AESDSOCKET_BINARY_PROTOCOL_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Length-prefixed binary framing, negotiated per connection on the same port as the newline protocol.
+///
+/// A connection whose very first byte is `BINARY_PROTOCOL_MAGIC` (a text packet never starts with NUL)
+/// speaks binary frames from the next byte on. Every frame is a `BINARY_HEADER_SIZE` header followed
+/// by `length` bytes of payload; all integers are big-endian. Each request gets exactly one response
+/// frame (with the same opcode), in the request order.
+///
+#define BINARY_PROTOCOL_MAGIC '\0'
+
+#define BINARY_HEADER_SIZE 8
+
+/// Larger requests (or larger than the spill threshold of the server, see `-M`) are answered
+/// with `BINARY_STATUS_TOO_LARGE` (and their payload is skipped).
+///
+#define BINARY_MAX_PAYLOAD (64u * 1024 * 1024)
+
+/// Maximum size of the fixed part of a response payload (the rest comes from the store).
+#define BINARY_MAX_FIXED_PAYLOAD 24
+
+enum binary_opcode
+{
+    BINARY_OP_APPEND = 1,      // payload: the record, terminated by its only newline (anything else is
+                               // a bad request, as the store delimits the records by newlines);
+                               // response: u64 sequence, u64 end offset
+    BINARY_OP_SEEKTO = 2,      // payload: u32 command, u32 offset; response: u64 the new position
+    BINARY_OP_READ = 3,        // payload: u64 offset, u64 length; response: the store bytes (clipped to its size)
+    BINARY_OP_STAT = 4,        // no payload; response: u64 store size, u64 generation, u64 sequence
+    BINARY_OP_READ_RECORD = 5, // payload: u32 command, u32 offset, u64 length; response: u64 offset of the
+                               // first byte, followed by up to `length` store bytes from there
+};
+
+enum binary_status
+{
+    BINARY_STATUS_OK = 0,
+    BINARY_STATUS_BAD_REQUEST = 1, // the payload doesn't fit the opcode
+    BINARY_STATUS_FAILED = 2,      // the store operation failed
+    BINARY_STATUS_UNSUPPORTED = 3, // unknown opcode
+    BINARY_STATUS_TOO_LARGE = 4,   // the payload exceeds `BINARY_MAX_PAYLOAD` (or the spill threshold)
+    BINARY_STATUS_BUSY = 5,        // the receive buffers are over the memory budget; the request may be retried
+};
+
+/// Header of both requests and responses (`status` is zero in requests).
+struct binary_header
+{
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t length;
+};
+
+static inline void binary_header_encode(char *const out, const struct binary_header *const header)
+{
+    const uint32_t length = htobe32(header->length);
+    out[0] = (char)header->opcode;
+    out[1] = (char)header->status;
+    out[2] = 0;
+    out[3] = 0;
+    memcpy(out + 4, &length, sizeof(length));
+}
+
+static inline void binary_header_decode(const char *const in, struct binary_header *const header)
+{
+    uint32_t length;
+    memcpy(&length, in + 4, sizeof(length));
+    header->opcode = (uint8_t)in[0];
+    header->status = (uint8_t)in[1];
+    header->length = be32toh(length);
+}
+
+static inline void binary_put_u32(char *const out, const uint32_t value)
+{
+    const uint32_t be = htobe32(value);
+    memcpy(out, &be, sizeof(be));
+}
+
+static inline void binary_put_u64(char *const out, const uint64_t value)
+{
+    const uint64_t be = htobe64(value);
+    memcpy(out, &be, sizeof(be));
+}
+
+static inline uint32_t binary_get_u32(const char *const in)
+{
+    uint32_t be;
+    memcpy(&be, in, sizeof(be));
+    return be32toh(be);
+}
+
+static inline uint64_t binary_get_u64(const char *const in)
+{
+    uint64_t be;
+    memcpy(&be, in, sizeof(be));
+    return be64toh(be);
+}
+
+#endif // AESDSOCKET_BINARY_PROTOCOL_H
@@ -1,188 +1,1812 @@
+#define _GNU_SOURCE // splice, pipe2
+
 #include "aesd_ioctl.h"
+#include "async_log.h"
 #include "client_flow.h"
-#include "packet_fragment.h"
+#include "compressed_reply.h"
+#include "packet_spill.h"
+#include "recv_buffer.h"
+#include "stats.h"
+#include "store_snapshot.h"
 
 #include "assert.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-/// Atomically read the file and send it to the client.
+/// Counts the client as connected, and records the start of a new session (if recording).
+static void begin_session(struct client_info *const client)
+{
+    __atomic_add_fetch(&client->shared->connected, 1, __ATOMIC_RELEASE);
+    client->connected = true;
+    if (client->shared->recorder != NULL)
+    {
+        client->session_id = session_recorder_open(client->shared->recorder);
+    }
+}
+
+/// Records the end of the session (if recording, and not recorded yet), and stops counting the client as connected.
+static void end_session(struct client_info *const client)
+{
+    if (client->connected)
+    {
+        __atomic_sub_fetch(&client->shared->connected, 1, __ATOMIC_RELEASE);
+        client->connected = false;
+    }
+    if (client->session_id != 0)
+    {
+        session_recorder_close(client->shared->recorder, client->session_id);
+        client->session_id = 0;
+    }
+}
+
+/// Accounts bytes received from the peer.
+static void received_data(struct client_info *const client, const char *const data, const size_t size)
+{
+    if (client->shared->low_latency)
+    {
+        latency_profile_quickack(client->peer_fd);
+    }
+    stats_count(STATS_BYTES_IN, size);
+    if (client->session_id != 0)
+    {
+        session_recorder_data(client->shared->recorder, client->session_id, data, size);
+    }
+}
+
+static void release_reply_snapshot(struct client_info *const client)
+{
+    if (client->reply_snapshot != NULL)
+    {
+        store_snapshot_release(client->reply_snapshot);
+        client->reply_snapshot = NULL;
+    }
+}
+
+struct client_info *client_info_create(struct shared_info *const shared, const int peer_fd)
+{
+    assert(shared != NULL);
+    assert(peer_fd >= 0);
+
+    struct client_info *client = malloc(sizeof(struct client_info));
+    if (client == NULL)
+    {
+        syslog(LOG_ERR, "malloc `client_info`: %s", strerror(errno));
+        return NULL;
+    }
+    memset(client, 0, sizeof(struct client_info));
+
+    client->shared = shared;
+    client->peer_fd = peer_fd;
+    client->framing = CLIENT_FRAMING_UNKNOWN;
+    recv_buffer_init(&client->received);
+    client->discard = 0;
+    packet_spill_init(&client->spill);
+    client->notifier = NULL;
+    client->commit_owner = client;
+    client->commit_requests = NULL;
+    client->commit_count = 0;
+    recv_buffer_init(&client->held);
+    client->reply_pending = false;
+    client->reply_corked = false;
+    client->reply_snapshot = NULL;
+    client->reply_pipe[0] = -1;
+    client->reply_pipe[1] = -1;
+    client->reply_piped = 0;
+    client->zero_copy = true;
+#if USE_AESD_CHAR_DEVICE
+    // Only the storage thread (see `group_commit`) writes to the store.
+    client->file_fd = open(SOCKET_DATA_FILE, O_RDONLY | O_CLOEXEC);
+    if (client->file_fd == -1)
+    {
+        syslog(LOG_ERR, "open '%s': %s", SOCKET_DATA_FILE, strerror(errno));
+        free(client);
+        return NULL;
+    }
+#else
+    // The log is only read through snapshots (see `segment_log`).
+    client->file_fd = -1;
+#endif
+    if (shared->low_latency)
+    {
+        latency_profile_tune_peer(peer_fd);
+    }
+    stats_count(STATS_CONNECTIONS, 1);
+    begin_session(client);
+
+    return client;
+}
+
+void client_info_recycle(struct client_info *const client, const int peer_fd)
+{
+    assert(client != NULL);
+    assert(client->peer_fd < 0);
+    assert(peer_fd >= 0);
+
+    client->framing = CLIENT_FRAMING_UNKNOWN;
+    recv_buffer_release(&client->received);
+    client->discard = 0;
+    packet_spill_release(&client->spill);
+    client->subscribing = false;
+    client->compressing = false;
+    client->reply_pending = false;
+    client->reply_corked = false;
+    client->reply_compressed = false;
+    release_reply_snapshot(client);
+    client->zero_copy = true;
+    client->peer_fd = peer_fd;
+    if (client->shared->low_latency)
+    {
+        latency_profile_tune_peer(peer_fd);
+    }
+    if (client->reply_piped > 0)
+    {
+        // The previous peer has gone in the middle of a reply, so its leftovers are still in the pipe.
+        close(client->reply_pipe[0]);
+        close(client->reply_pipe[1]);
+        client->reply_pipe[0] = -1;
+        client->reply_pipe[1] = -1;
+        client->reply_piped = 0;
+    }
+
+#if USE_AESD_CHAR_DEVICE
+    // The device stays open, but the previous peer could have moved its position (by seeking).
+    lseek(client->file_fd, 0, SEEK_SET);
+#endif
+    stats_count(STATS_CONNECTIONS, 1);
+    begin_session(client);
+}
+
+void client_info_destroy(struct client_info *const client)
+{
+    assert(client != NULL);
+
+    end_session(client);
+    if (client->peer_fd >= 0)
+    {
+        close(client->peer_fd);
+    }
+    recv_buffer_release(&client->received);
+    recv_buffer_release(&client->held);
+    packet_spill_release(&client->spill);
+    release_reply_snapshot(client);
+    free(client->commit_requests);
+    if (client->reply_pipe[0] >= 0)
+    {
+        close(client->reply_pipe[0]);
+        close(client->reply_pipe[1]);
+    }
+    if (client->file_fd >= 0)
+    {
+        close(client->file_fd);
+    }
+    free(client);
+}
+
+/// Marks the text reply (from `reply_offset` up to `reply_end`) pending.
+///
+/// A `ranged` reply covers an explicitly requested range, so it leaves the device position alone.
+///
+static void begin_reply(struct client_info *const client, const bool ranged)
+{
+    client->reply_header_size = 0;
+    client->reply_header_sent = 0;
+    client->reply_ranged = ranged;
+    client->reply_compressed = false;
+    client->reply_pending = true;
+    client->reply_started = stats_now();
+    client->reply_begin = client->reply_offset;
+}
+
+/// Prepares the reply with the current content of the store.
 ///
-/// Note that the file is locked for reading,
-/// so not preventing other threads from reading it as well.
+/// Must be called with the store lock held, so that the reply exactly reflects the store right after the packet.
+/// The actual sending is done by `reply_to_client` (without the lock).
 ///
-static void reply_to_client(struct client_info *const client)
+static void start_reply(struct client_info *const client)
 {
     assert(client != NULL);
-    assert(client->file != NULL);
+    assert(!client->reply_pending);
+    assert(client->reply_snapshot == NULL);
+
+    client->reply_snapshot = snapshot_cache_acquire(&client->shared->snapshots);
+
+#if USE_AESD_CHAR_DEVICE
+    // The device reply starts at the current file position (which could be moved by `AESDCHAR_IOCSEEKTO`),
+    // and goes until the end of the device data.
+    client->reply_offset = lseek(client->file_fd, 0, SEEK_CUR);
+    client->reply_end = (client->reply_snapshot != NULL) ? (off_t)client->reply_snapshot->size : -1;
+    if (client->reply_offset < 0)
+    {
+        syslog(LOG_ERR, "lseek: %s", strerror(errno));
+        release_reply_snapshot(client);
+        return;
+    }
+#else
+    // The log is append-only, so the snapshot fixes the content of the reply (the whole retained log)
+    // no matter how many packets will be appended by other clients while we are sending.
+    // Without any snapshot (nothing could be published yet) the store is taken as empty.
+    client->reply_offset = 0;
+    client->reply_end = (client->reply_snapshot != NULL) ? (off_t)client->reply_snapshot->size : 0;
+#endif
+
+    begin_reply(client, false);
+}
 
-    pthread_rwlock_rdlock(&client->shared->rw_file_lock);
+/// Digest of the sent reply (for the session trace): its header, and the sent range of the snapshot
+/// (or of the device, read again, without any snapshot).
+///
+static uint64_t reply_digest(const struct client_info *const client)
+{
+    uint64_t digest =
+        session_trace_digest(SESSION_TRACE_DIGEST_INIT, client->reply_header, client->reply_header_size);
+    off_t offset = client->reply_begin;
+    if (client->reply_snapshot != NULL)
+    {
+        while (offset < client->reply_offset)
+        {
+            struct snapshot_chunk chunk;
+            store_snapshot_chunk(client->reply_snapshot, offset, &chunk);
+            const off_t rest = client->reply_offset - offset;
+            const size_t size = ((off_t)chunk.size < rest) ? chunk.size : (size_t)rest;
+            digest = session_trace_digest(digest, chunk.data, size);
+            offset += size;
+        }
+    }
+#if USE_AESD_CHAR_DEVICE
+    else
     {
         char buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), client->file)) > 0)
+        while (offset < client->reply_offset)
         {
-            send(client->peer_fd, buffer, bytes_read, 0);
+            const off_t rest = client->reply_offset - offset;
+            const size_t size = ((off_t)sizeof(buffer) < rest) ? sizeof(buffer) : (size_t)rest;
+            const ssize_t bytes_read = pread(client->file_fd, buffer, size, offset);
+            if (bytes_read <= 0)
+            {
+                break;
+            }
+            digest = session_trace_digest(digest, buffer, bytes_read);
+            offset += bytes_read;
         }
     }
-    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+#endif
+    return digest;
 }
 
-static char *flatten_fragments(struct client_info *const client, size_t *const size)
+void client_finish_reply(struct client_info *const client)
 {
     assert(client != NULL);
-    assert(size != NULL);
+    assert(client->reply_pending);
+
+    client->reply_pending = false;
+    stats_record_since(STATS_STAGE_REPLY, client->reply_started);
+    const size_t reply_size = client->reply_header_size + (client->reply_offset - client->reply_begin);
+    stats_count(STATS_BYTES_OUT, reply_size);
+    if (client->session_id != 0)
+    {
+        session_recorder_reply(client->shared->recorder, client->session_id, reply_size, reply_digest(client));
+    }
+    release_reply_snapshot(client);
+#if USE_AESD_CHAR_DEVICE
+    // Move the file position past the sent data - the same way as regular `read` would do.
+    // Range reads (and all binary ones) are positioned explicitly, so they leave the position alone.
+    if (!client->reply_ranged)
+    {
+        lseek(client->file_fd, client->reply_compressed ? client->reply_raw_end : client->reply_offset, SEEK_SET);
+    }
+#endif
+}
 
-    size_t total_size = 0;
-    struct packet_fragment *curr_fragment;
-    for (curr_fragment = client->fragments; curr_fragment != NULL; curr_fragment = curr_fragment->next)
+/// Result of a single attempt to send (the rest of) the reply.
+enum reply_status
+{
+    REPLY_DONE,        // the whole reply has been sent
+    REPLY_WOULD_BLOCK, // the peer socket can't accept more data right now
+    REPLY_FAILED,      // the peer is gone (or the file can't be read)
+    REPLY_UNSUPPORTED, // the zero-copy path is not supported by the file
+};
+
+static enum reply_status reply_send_error(const char *const what)
+{
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
     {
-        total_size += curr_fragment->size;
+        return REPLY_WOULD_BLOCK;
     }
 
-    char *const buffer = malloc(total_size);
-    if (buffer != NULL)
+    syslog(LOG_ERR, "%s: %s", what, strerror(errno));
+    return REPLY_FAILED;
+}
+
+#if USE_AESD_CHAR_DEVICE
+
+/// Sends the reply by copying the file content through a user space buffer.
+///
+/// This is the fallback for files which support neither `sendfile` nor `splice`.
+///
+static enum reply_status copy_reply(struct client_info *const client)
+{
+    char buffer[BUFFER_SIZE];
+    for (;;)
     {
-        char *curr_buffer = buffer;
-        struct packet_fragment *next_fragment;
-        for (curr_fragment = client->fragments; curr_fragment != NULL; curr_fragment = next_fragment)
+        size_t bytes_to_read = sizeof(buffer);
+        if (client->reply_end >= 0)
+        {
+            const off_t bytes_to_end = client->reply_end - client->reply_offset;
+            if (bytes_to_end <= 0)
+            {
+                return REPLY_DONE;
+            }
+            if ((off_t)bytes_to_read > bytes_to_end)
+            {
+                bytes_to_read = bytes_to_end;
+            }
+        }
+
+        const ssize_t bytes_read = pread(client->file_fd, buffer, bytes_to_read, client->reply_offset);
+        if (bytes_read == 0)
         {
-            memcpy(curr_buffer, curr_fragment->data, curr_fragment->size);
-            curr_buffer += curr_fragment->size;
+            return REPLY_DONE;
+        }
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Not to be mistaken for the end of the data: the client would take the truncated reply as complete.
+            syslog(LOG_ERR, "pread: %s", strerror(errno));
+            return REPLY_FAILED;
+        }
 
-            next_fragment = curr_fragment->next;
-            if (next_fragment != NULL)
+        const int flags = ((client->reply_end >= 0) && ((client->reply_offset + bytes_read) < client->reply_end))
+                              ? (MSG_NOSIGNAL | MSG_MORE)
+                              : MSG_NOSIGNAL;
+        const ssize_t bytes_sent = send(client->peer_fd, buffer, bytes_read, flags);
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
             {
-                free(curr_fragment);
-                client->fragments = next_fragment;
+                continue;
             }
+            return reply_send_error("send");
         }
+        client->reply_offset += bytes_sent;
+    }
+}
 
-        *size = total_size;
+/// Sends the reply by splicing the device content into the client's pipe, and then from the pipe to the socket,
+/// so that the data never leaves the kernel.
+///
+/// Bytes already moved into the pipe (but not yet to the socket) are accounted by `reply_piped`,
+/// so the reply could be resumed when the socket becomes writable again.
+///
+static enum reply_status splice_reply(struct client_info *const client)
+{
+    if (client->reply_pipe[0] == -1)
+    {
+        if (pipe2(client->reply_pipe, O_CLOEXEC) == -1)
+        {
+            syslog(LOG_ERR, "pipe2: %s", strerror(errno));
+            return REPLY_UNSUPPORTED;
+        }
+        client->reply_piped = 0;
     }
 
-    return buffer;
+    for (;;)
+    {
+        if (client->reply_piped == 0)
+        {
+            size_t bytes_to_pipe = BUFFER_SIZE;
+            if (client->reply_end >= 0)
+            {
+                const off_t bytes_to_end = client->reply_end - client->reply_offset;
+                if (bytes_to_end <= 0)
+                {
+                    return REPLY_DONE;
+                }
+                if ((off_t)bytes_to_pipe > bytes_to_end)
+                {
+                    bytes_to_pipe = bytes_to_end;
+                }
+            }
+
+            loff_t offset = client->reply_offset;
+            const ssize_t bytes_piped = splice(client->file_fd, &offset, client->reply_pipe[1], NULL, bytes_to_pipe,
+                                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_piped == 0)
+            {
+                return REPLY_DONE;
+            }
+            if (bytes_piped == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EINVAL)
+                {
+                    return REPLY_UNSUPPORTED;
+                }
+                syslog(LOG_ERR, "splice: %s", strerror(errno));
+                return REPLY_FAILED;
+            }
+            client->reply_offset = offset;
+            client->reply_piped = bytes_piped;
+        }
+
+        const ssize_t bytes_sent = splice(client->reply_pipe[0], NULL, client->peer_fd, NULL, client->reply_piped,
+                                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return reply_send_error("splice");
+        }
+        client->reply_piped -= bytes_sent;
+    }
 }
 
-/// Atomically writes list of packet fragments to the file.
+#endif // USE_AESD_CHAR_DEVICE
+
+/// Sends the reply from the snapshot of the store, one contiguous chunk at a time.
 ///
-/// The list is freed as the fragments are written to the file -
-/// except the last fragment b/c it could be still reused.
+/// Chunks of the log segments go straight from the page cache to the socket (`sendfile`)
+/// unless zero-copy is off; the device copy (and the mapped segments as the fallback) are sent from memory.
 ///
-static void write_new_packet(struct client_info *const client)
+static enum reply_status snapshot_reply(struct client_info *const client)
 {
-    assert(client != NULL);
-    assert(client->file != NULL);
+    const struct store_snapshot *const snapshot = client->reply_snapshot;
+    assert(snapshot != NULL);
 
-    size_t flat_size = 0;
-    char *const flat_data = flatten_fragments(client, &flat_size);
-    if (flat_data != NULL)
+    while (client->reply_offset < client->reply_end)
     {
-        assert(flat_size > 0);
-        assert(flat_data[flat_size - 1] == '\n');
-        struct aesd_seekto seekto = {0, 0};
-        flat_data[flat_size - 1] = '\0'; // null-terminate the string
-        const int params = sscanf(flat_data, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset);
-        flat_data[flat_size - 1] = '\n'; // restore the newline
+        struct snapshot_chunk chunk;
+        store_snapshot_chunk(snapshot, client->reply_offset, &chunk);
+        const off_t bytes_to_end = client->reply_end - client->reply_offset;
+        const size_t bytes_to_send = ((off_t)chunk.size < bytes_to_end) ? chunk.size : (size_t)bytes_to_end;
 
-        pthread_rwlock_wrlock(&client->shared->rw_file_lock);
+        ssize_t bytes_sent;
+        if (client->zero_copy && (chunk.fd >= 0))
         {
-            if (params == 2)
+            off_t offset = chunk.file_offset;
+            bytes_sent = sendfile(client->peer_fd, chunk.fd, &offset, bytes_to_send);
+            if ((bytes_sent == -1) && ((errno == EINVAL) || (errno == ENOSYS)))
             {
-                syslog(LOG_DEBUG, "AESDCHAR_IOCSEEKTO:%u,%u", //
-                    seekto.write_cmd, seekto.write_cmd_offset);                
-                
-                ioctl(fileno(client->file), AESDCHAR_IOCSEEKTO, &seekto);
+                async_log(LOG_DEBUG, "Zero-copy reply is not supported, falling back to copying (peer_fd=%d).",
+                          client->peer_fd);
+                client->zero_copy = false;
+                continue;
             }
-            else
+        }
+        else
+        {
+            // The next chunk follows right away, so this one is not pushed out on its own.
+            const int flags = ((off_t)bytes_to_send < bytes_to_end) ? (MSG_NOSIGNAL | MSG_MORE) : MSG_NOSIGNAL;
+            bytes_sent = send(client->peer_fd, chunk.data, bytes_to_send, flags);
+        }
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
             {
-                fwrite(flat_data, 1, flat_size, client->file);
-                fflush(client->file);
-
-                #if !USE_AESD_CHAR_DEVICE
-                // prepare for the next read from the beginning
-                fseek(client->file, 0, SEEK_SET);
-                #endif
+                continue;
             }
+            return reply_send_error("send");
         }
-        pthread_rwlock_unlock(&client->shared->rw_file_lock);
+        if (bytes_sent == 0)
+        {
+            break; // the segment is shorter than expected
+        }
+        client->reply_offset += bytes_sent;
+    }
+
+    return REPLY_DONE;
+}
 
-        free(flat_data);
+/// Sends the (rest of the) binary response header, ahead of the store data.
+static enum reply_status header_reply(struct client_info *const client)
+{
+    // More data follows the header, so there is no point to push the header out on its own.
+    const int flags = (client->reply_offset < client->reply_end) ? (MSG_NOSIGNAL | MSG_MORE) : MSG_NOSIGNAL;
+    while (client->reply_header_sent < client->reply_header_size)
+    {
+        const ssize_t bytes_sent = send(client->peer_fd, client->reply_header + client->reply_header_sent,
+                                        client->reply_header_size - client->reply_header_sent, flags);
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return reply_send_error("send");
+        }
+        client->reply_header_sent += bytes_sent;
     }
 
-    reply_to_client(client);
+    return REPLY_DONE;
+}
+
+/// Whether the rest of the reply data takes more than a single send (or `sendfile`, `splice`) call.
+static bool reply_spans_chunks(const struct client_info *const client)
+{
+    if (client->reply_end < 0)
+    {
+        return true; // until the end of the device
+    }
+    const off_t rest = client->reply_end - client->reply_offset;
+    if (rest <= 0)
+    {
+        return false;
+    }
+    if (client->reply_snapshot == NULL)
+    {
+        return rest > BUFFER_SIZE;
+    }
+    struct snapshot_chunk chunk;
+    store_snapshot_chunk(client->reply_snapshot, client->reply_offset, &chunk);
+    return (off_t)chunk.size < rest;
 }
 
-static void process_client(struct client_info *const client)
+/// Sends the store snapshot (captured at the start of the reply) to the client.
+///
+/// The snapshot is immutable, so no lock is held while sending it, and a slow client
+/// never blocks writers. Only without any snapshot of the device (e.g. its allocation failed)
+/// the device is locked for reading (still not preventing other threads from reading it as well).
+/// For a non-blocking peer socket the reply is resumed later from the same offset.
+///
+static enum client_state reply_to_client(struct client_info *const client)
 {
     assert(client != NULL);
-    assert(client->peer_fd >= 0);
-    assert(client->shared != NULL);
-    assert(client->fragments == NULL);
+    assert(client->reply_pending);
 
-    client->fragments = packet_fragment_alloc();
-    struct packet_fragment *curr_fragment = client->fragments;
+    // `sendfile` and `splice` can't pass `MSG_MORE`, so with TCP_NODELAY each call would push out
+    // a partial segment; the cork holds them until the reply is complete.
+    //
+    if (client->shared->low_latency && !client->reply_corked && reply_spans_chunks(client))
+    {
+        latency_profile_cork(client->peer_fd, true);
+        client->reply_corked = true;
+    }
 
-    ssize_t bytes_read;
-    while ((bytes_read = recv(client->peer_fd, curr_fragment->buffer, sizeof(curr_fragment->buffer), 0)) > 0)
+    enum reply_status status = header_reply(client);
+    const struct store_snapshot *const snapshot = client->reply_snapshot;
+    if (status != REPLY_DONE)
     {
-        curr_fragment->data = curr_fragment->buffer;
-        ssize_t bytes_left = bytes_read;
+        // Not even the header is sent yet.
+    }
+    else if ((client->reply_end >= 0) && (client->reply_offset >= client->reply_end))
+    {
+        // Nothing (more) to send from the store.
+    }
+    else if (snapshot != NULL)
+    {
+        status = snapshot_reply(client);
+    }
+#if USE_AESD_CHAR_DEVICE
+    else
+    {
+        status = REPLY_UNSUPPORTED;
+        stats_rwlock_rdlock(&client->shared->rw_file_lock);
 
-        const char *newline_pos;
-        while (NULL != (newline_pos = memchr(curr_fragment->data, '\n', bytes_left)))
+        if (client->zero_copy)
         {
-            curr_fragment->size = newline_pos - curr_fragment->data + 1; // including \n
-
-            write_new_packet(client);
-            assert(client->fragments == curr_fragment);
-
-            bytes_left -= curr_fragment->size;
-            curr_fragment->data += curr_fragment->size;
+            status = splice_reply(client);
+            if (status == REPLY_UNSUPPORTED)
+            {
+                async_log(LOG_DEBUG, "Zero-copy reply is not supported, falling back to copying (peer_fd=%d).",
+                          client->peer_fd);
+                client->zero_copy = false;
+            }
+        }
+        if (status == REPLY_UNSUPPORTED)
+        {
+            status = copy_reply(client);
         }
 
-        if (bytes_left > 0)
+        pthread_rwlock_unlock(&client->shared->rw_file_lock);
+    }
+#endif // the file backend always replies from a snapshot (or has nothing to send without one)
+
+    switch (status)
+    {
+    case REPLY_DONE:
+        if (client->reply_corked)
         {
-            curr_fragment->size = bytes_left;
-            curr_fragment->next = packet_fragment_alloc();
-            curr_fragment = curr_fragment->next;
+            latency_profile_cork(client->peer_fd, false);
+            client->reply_corked = false;
         }
+        client_finish_reply(client);
+        return CLIENT_WANTS_READ;
+    case REPLY_WOULD_BLOCK:
+        return CLIENT_WANTS_WRITE;
+    default:
+        client->reply_corked = false;
+        client->reply_pending = false;
+        release_reply_snapshot(client);
+        return CLIENT_DONE;
     }
+}
 
-    // All done so we can free the fragments (instead of postponing it to the thread join).
-    packet_fragments_free(client->fragments);
-    client->fragments = NULL;
+/// The compression handshake, which is also the acknowledgement (without the newline).
+#define COMPRESS_HANDSHAKE "COMPRESS:lz4"
 
-    if (bytes_read == -1)
+/// Parses the packet (including its terminating newline) as a command.
+/// `SUBSCRIBE` is only a command when subscriptions are enabled.
+///
+static enum text_command_kind parse_command(const struct client_info *const client, char *const packet,
+                                            const size_t packet_size, struct text_command *const command)
+{
+    command->kind = TEXT_DATA;
+    command->from_sequence = 0;
+    packet[packet_size - 1] = '\0'; // null-terminate the string
+    if (sscanf(packet, "AESDCHAR_IOCSEEKTO:%u,%u", &command->seekto.write_cmd, &command->seekto.write_cmd_offset) ==
+        2)
     {
-        syslog(LOG_ERR, "recv: %s", strerror(errno));
+        command->kind = TEXT_SEEKTO;
+    }
+    else if (sscanf(packet, "AESDCHAR_READ:%u,%u,%zu", &command->seekto.write_cmd, &command->seekto.write_cmd_offset,
+                    &command->length) == 3)
+    {
+        command->kind = TEXT_READ;
+    }
+    else if ((client->shared->subscriptions != NULL) &&
+             ((strcmp(packet, "SUBSCRIBE") == 0) || (sscanf(packet, "SUBSCRIBE:%" SCNu64, &command->from_sequence) == 1)))
+    {
+        command->kind = TEXT_SUBSCRIBE;
     }
+    else if (strcmp(packet, COMPRESS_HANDSHAKE) == 0)
+    {
+        command->kind = TEXT_COMPRESS;
+    }
+    packet[packet_size - 1] = '\n'; // restore the newline
+    return command->kind;
 }
 
-void *process_client_thread(void *const arg)
+/// Returns the current size of the store (or -1 on failure).
+///
+/// Must be called with the store lock held, so that it matches `snapshot` (if there is one).
+///
+static off_t store_size(struct client_info *const client, const struct store_snapshot *const snapshot)
 {
+    if (snapshot != NULL)
+    {
+        return snapshot->size;
+    }
 
-    struct client_info *const client = arg;
-    if (client == NULL)
+#if USE_AESD_CHAR_DEVICE
+    // The device size is only known by seeking to the end; the client's position is restored.
+    const off_t position = lseek(client->file_fd, 0, SEEK_CUR);
+    const off_t size = lseek(client->file_fd, 0, SEEK_END);
+    if ((position < 0) || (size < 0))
     {
-        syslog(LOG_ERR, "process_client_thread: NULL argument");
-        return NULL;
+        syslog(LOG_ERR, "lseek: %s", strerror(errno));
+        return -1;
     }
-    syslog(LOG_DEBUG, "Started client thread (peer_fd=%d, thread=%p).", //
-           client->peer_fd, (const void *)pthread_self());
+    lseek(client->file_fd, position, SEEK_SET);
+    return size;
+#else
+    // Nothing could be published yet.
+    (void)client;
+    return 0;
+#endif
+}
 
-    process_client(client);
+/// Resolves the seek command against the store: `write_cmd_offset` bytes into the record `write_cmd`
+/// (counted among the records still kept). The offset is the device one, or the log one for the file backend.
+/// Returns false if there is no such byte.
+///
+/// Must be called with the store lock held.
+///
+static bool find_seekto(struct client_info *const client, const struct aesd_seekto *const seekto,
+                        uint64_t *const offset)
+{
+#if USE_AESD_CHAR_DEVICE
+    // The driver resolves it (by `aesd_circular_buffer_offset_at`) into the file position,
+    // which is restored afterwards.
+    const off_t position = lseek(client->file_fd, 0, SEEK_CUR);
+    if ((position < 0) || (ioctl(client->file_fd, AESDCHAR_IOCSEEKTO, seekto) == -1))
+    {
+        return false;
+    }
+    const off_t found = lseek(client->file_fd, 0, SEEK_CUR);
+    lseek(client->file_fd, position, SEEK_SET);
+    if (found < 0)
+    {
+        return false;
+    }
+    *offset = found;
+    return true;
+#else
+    uint64_t record_offset = 0;
+    size_t record_length = 0;
+    if (!segment_log_find_record(client->shared->commits.log, seekto->write_cmd, &record_offset, &record_length) ||
+        (seekto->write_cmd_offset >= record_length))
+    {
+        return false;
+    }
+
+    *offset = record_offset + seekto->write_cmd_offset;
+    return true;
+#endif
+}
+
+/// Executes the seek command, and (optionally) prepares the reply right after it.
+///
+/// The device moves the client's file position. The log has no position to move, so the seek
+/// only makes the reply start at the found byte (the reply covers the whole log otherwise).
+///
+static void execute_seekto(struct client_info *const client, struct aesd_seekto *const seekto, const bool reply)
+{
+    stats_count(STATS_SEEKTO, 1);
+    stats_rwlock_wrlock(&client->shared->rw_file_lock);
+    {
+        async_log(LOG_DEBUG, "AESDCHAR_IOCSEEKTO:%u,%u", //
+                  seekto->write_cmd, seekto->write_cmd_offset);
+
+#if USE_AESD_CHAR_DEVICE
+        ioctl(client->file_fd, AESDCHAR_IOCSEEKTO, seekto);
+
+        if (reply)
+        {
+            start_reply(client);
+        }
+#else
+        uint64_t offset = 0;
+        const bool found = find_seekto(client, seekto, &offset);
+        if (reply)
+        {
+            start_reply(client);
+
+            const struct store_snapshot *const snapshot = client->reply_snapshot;
+            if (found && client->reply_pending && (snapshot != NULL) && (offset >= snapshot->base))
+            {
+                client->reply_offset = offset - snapshot->base;
+                client->reply_begin = client->reply_offset;
+            }
+        }
+#endif
+    }
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+}
+
+/// Sets the reply up to cover up to `length` bytes of the store from the byte the seek command resolves to
+/// (clipped to the store end). `offset` receives the store offset of the first byte.
+/// Returns false (with no reply data) if there is no such byte.
+///
+static bool prepare_range(struct client_info *const client, const struct aesd_seekto *const seekto,
+                          const uint64_t length, uint64_t *const offset)
+{
+    assert(client->reply_snapshot == NULL);
+
+    struct store_snapshot *snapshot;
+    off_t size;
+    bool found;
+    stats_rwlock_rdlock(&client->shared->rw_file_lock);
+    {
+        snapshot = snapshot_cache_acquire(&client->shared->snapshots);
+        size = store_size(client, snapshot);
+        found = (size >= 0) && find_seekto(client, seekto, offset);
+    }
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
 
-    syslog(LOG_DEBUG, "Finished client thread (peer_fd=%d, thread=%p).", //
-           client->peer_fd, (const void *)pthread_self());
+    // The snapshot was taken under the same lock, so it has the found byte (unless it's missing altogether).
+    const uint64_t base = (snapshot != NULL) ? snapshot->base : 0;
+    found = found && (*offset >= base) && ((*offset - base) < (uint64_t)size);
 
-    close(client->peer_fd);
+    client->reply_snapshot = snapshot;
+    client->reply_offset = 0;
+    client->reply_end = 0;
+    if (found)
+    {
+        const uint64_t available = (uint64_t)size - (*offset - base);
+        client->reply_offset = *offset - base;
+        client->reply_end = client->reply_offset + ((length < available) ? length : available);
+    }
+    return found;
+}
+
+/// Prepares the reply with just the requested range (empty if there is no such record or byte).
+static void execute_read(struct client_info *const client, const struct text_command *const command)
+{
+    stats_count(STATS_RANGE_READS, 1);
+    async_log(LOG_DEBUG, "AESDCHAR_READ:%u,%u,%zu", //
+              command->seekto.write_cmd, command->seekto.write_cmd_offset, command->length);
+
+    uint64_t offset = 0;
+    prepare_range(client, &command->seekto, command->length, &offset);
+    begin_reply(client, true);
+}
+
+/// Resolves the cursor of the subscription. The connection is handed off once the state machine gets to it
+/// (there is no reply to the command itself).
+///
+static void execute_subscribe(struct client_info *const client, const struct text_command *const command)
+{
+    client->subscribing = true;
+    client->subscription_cursor = subscription_hub_cursor(client->shared->subscriptions, command->from_sequence);
+    async_log(LOG_DEBUG, "Subscribing from packet %" PRIu64 " (peer_fd=%d).", command->from_sequence,
+              client->peer_fd);
+}
+
+/// Switches the connection to compressed replies. The acknowledgement is the handshake itself
+/// (not compressed, so that the peer could tell whether the server supports it at all).
+///
+static void execute_compress(struct client_info *const client, const bool reply)
+{
+    async_log(LOG_DEBUG, "Compressing replies (peer_fd=%d).", client->peer_fd);
+    client->compressing = true;
+    if (reply)
+    {
+        client->reply_offset = 0;
+        client->reply_end = 0;
+        begin_reply(client, true);
+        client->reply_header_size = strlen(COMPRESS_HANDSHAKE "\n");
+        memcpy(client->reply_header, COMPRESS_HANDSHAKE "\n", client->reply_header_size);
+    }
+}
+
+/// Executes the command, and (optionally) prepares the reply right after it.
+/// A read without the reply has no effect at all.
+///
+static void execute_command(struct client_info *const client, struct text_command *const command, const bool reply)
+{
+    if (command->kind == TEXT_SUBSCRIBE)
+    {
+        execute_subscribe(client, command);
+    }
+    else if (command->kind == TEXT_COMPRESS)
+    {
+        execute_compress(client, reply);
+    }
+    else if (command->kind == TEXT_SEEKTO)
+    {
+        execute_seekto(client, &command->seekto, reply);
+    }
+    else if (command->kind == TEXT_READ)
+    {
+        if (reply)
+        {
+            execute_read(client, command);
+        }
+        else
+        {
+            stats_count(STATS_RANGE_READS, 1);
+        }
+    }
+}
+
+/// Result of `append_packets`.
+enum append_result
+{
+    APPEND_DONE,
+    APPEND_FAILED,
+    APPEND_PENDING, // see `client_complete_commit`
+};
+
+/// Appends the packets (right from the receive buffer) as a part of the group commit.
+///
+/// Blocking engines wait for the commit. Event engines only submit the packets, and the client is parked
+/// (not touching the packets, and not processing anything else) until the engine completes it: `then` follows.
+///
+static enum append_result append_packets(struct client_info *const client, const struct iovec *const packets,
+                                         const size_t count, const enum commit_continuation then)
+{
+    // Concurrent writers are coalesced into a single append.
+    if (client->notifier == NULL)
+    {
+        const uint64_t append_started = stats_now();
+        const bool appended =
+            group_commit_append_batch(&client->shared->commits, packets, count, &client->committed);
+        stats_record_since(STATS_STAGE_APPEND, append_started);
+        return appended ? APPEND_DONE : APPEND_FAILED;
+    }
+
+    if (client->commit_requests == NULL)
+    {
+        client->commit_requests = malloc(GROUP_COMMIT_MAX_BATCH * sizeof(struct commit_request));
+        if (client->commit_requests == NULL)
+        {
+            syslog(LOG_ERR, "malloc commit requests: %s", strerror(errno));
+            return APPEND_FAILED;
+        }
+    }
+    client->commit_started = stats_now();
+    client->commit_count = count;
+    client->commit_then = then;
+    group_commit_submit(&client->shared->commits, client->commit_requests, packets, count, client->notifier,
+                        client->commit_owner);
+    return APPEND_PENDING;
+}
+
+/// The reply reflects the store right after the batch which contained the last packet (or even later).
+static void start_reply_after_append(struct client_info *const client)
+{
+    stats_rwlock_rdlock(&client->shared->rw_file_lock);
+    start_reply(client);
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+}
+
+/// Gives up on the connection (when a spilled packet is lost, or a text packet could not be stored - the text
+/// protocol has no error reply), dropping whatever is received: the engine sees the end of the peer's data
+/// on the next receive, and closes the connection as usual.
+///
+static void abort_connection(struct client_info *const client)
+{
+    packet_spill_release(&client->spill);
+    recv_buffer_release(&client->received);
+    if (shutdown(client->peer_fd, SHUT_RDWR) == -1)
+    {
+        syslog(LOG_ERR, "shutdown: %s", strerror(errno));
+    }
+}
+
+/// Appends the text packets. Returns false unless the processing goes on right away: the append is pending,
+/// or it failed, and the connection is aborted.
+///
+static bool append_text_packets(struct client_info *const client, const struct iovec *const packets,
+                                const size_t count, const enum commit_continuation then)
+{
+    const enum append_result result = append_packets(client, packets, count, then);
+    if (result == APPEND_FAILED)
+    {
+        abort_connection(client);
+    }
+    return result == APPEND_DONE;
+}
+
+/// Finds the next complete text packet (see `recv_buffer_next_line`).
+///
+/// The first packet terminated while spilling is completed in its spill file, and returned mapped from there
+/// (valid until `packet_spill_release`); the packets after it (pipelining) are returned from the receive buffer
+/// as usual. Returns NULL if there is no complete packet, or if the spilled one could not be completed
+/// (the connection is aborted then).
+///
+static char *next_text_packet(struct client_info *const client, size_t *const size)
+{
+    const uint64_t scan_started = stats_now();
+    char *const packet = recv_buffer_next_line(&client->received, size);
+    stats_record_since(STATS_STAGE_SCAN, scan_started);
+    if ((packet == NULL) || !packet_spill_active(&client->spill) || packet_spill_mapped(&client->spill))
+    {
+        return packet;
+    }
+
+    char *spilled = NULL;
+    if (packet_spill_append(&client->spill, packet, *size))
+    {
+        spilled = packet_spill_map(&client->spill, size);
+    }
+    if (spilled == NULL)
+    {
+        abort_connection(client);
+    }
+    return spilled;
+}
+
+/// Moves the unterminated packet (all the pending data, as there is no complete line) to the spill file
+/// once it's over the memory budget; while spilling, the rest of it follows in `PACKET_SPILL_CHUNK`s.
+///
+/// Under the global budget pressure, every grown buffer is spilled (and trimmed back to a base block).
+///
+static void spill_unterminated(struct client_info *const client)
+{
+    struct recv_buffer *const received = &client->received;
+    const size_t pending = recv_buffer_pending(received);
+    const bool spilling = packet_spill_active(&client->spill);
+
+    size_t threshold = client->shared->spill_threshold;
+    if (spilling && (threshold > PACKET_SPILL_CHUNK))
+    {
+        threshold = PACKET_SPILL_CHUNK;
+    }
+    const bool over_budget =
+        (received->capacity > BUFFER_SIZE) && (recv_buffer_grown_bytes() > client->shared->buffer_budget);
+    if ((pending == 0) || ((pending <= threshold) && !over_budget))
+    {
+        return;
+    }
+
+    if (!spilling)
+    {
+        async_log(LOG_DEBUG, "Spilling an unterminated packet of %zu bytes (peer_fd=%d).", pending, client->peer_fd);
+        stats_count(STATS_SPILLED_PACKETS, 1);
+    }
+    if (!packet_spill_append(&client->spill, recv_buffer_head(received), pending))
+    {
+        abort_connection(client);
+        return;
+    }
+
+    // Everything pending is in the file now, and the rest of the packet starts in a base block again.
+    recv_buffer_release(received);
+}
+
+/// Atomically writes the packet to the file (or executes the command), and prepares the reply.
+///
+/// The packet (including its terminating newline) is written right from the receive buffer
+/// (or from the mapped spill file, which is released once it's appended).
+///
+static void write_new_packet(struct client_info *const client, char *const packet, const size_t packet_size)
+{
+    assert(client != NULL);
+    assert(packet != NULL);
+    assert(packet_size > 0);
+    assert(packet[packet_size - 1] == '\n');
+
+    stats_count(STATS_PACKETS, 1);
+
+    struct text_command command;
+    if (parse_command(client, packet, packet_size, &command) != TEXT_DATA)
+    {
+        execute_command(client, &command, true);
+        packet_spill_release(&client->spill);
+        return;
+    }
+
+    const struct iovec iov = {.iov_base = packet, .iov_len = packet_size};
+    if (append_text_packets(client, &iov, 1, COMMIT_THEN_REPLY))
+    {
+        start_reply_after_append(client);
+        packet_spill_release(&client->spill);
+    }
+}
+
+/// Pipelining: processes all complete packets already received, and prepares a single reply
+/// reflecting the store after the last one of them.
+///
+/// Consecutive packets are appended by a single group commit (as long as they fit into one batch);
+/// a command in between is executed once the packets before it are appended (a range read only matters
+/// as the last packet, since only the last one gets the reply). A subscription ends the processing:
+/// there is no reply, and the packets after it are ignored. So does a failed append: the connection is aborted
+/// (no later packet is appended, and no reply is sent).
+///
+/// An asynchronous append stops the processing, and `client_complete_commit` resumes it: `resumed` is set then,
+/// along with `command_pending` if `pipelined_command` (after the appended packets) is still to be executed.
+/// Returns false if there was no complete packet.
+///
+static bool write_new_packets(struct client_info *const client, const bool resumed, bool command_pending)
+{
+    struct iovec packets[GROUP_COMMIT_MAX_BATCH];
+    size_t count = 0;
+    bool any = resumed;
+
+    // The command is executed once it's known whether it's the last one (which prepares the reply).
+    struct text_command *const command = &client->pipelined_command;
+
+    for (;;)
+    {
+        size_t packet_size = 0;
+        char *const packet = next_text_packet(client, &packet_size);
+        if (packet == NULL)
+        {
+            break;
+        }
+        any = true;
+        stats_count(STATS_PACKETS, 1);
+
+        if (command_pending)
+        {
+            execute_command(client, command, false);
+            command_pending = false;
+        }
+        if (parse_command(client, packet, packet_size, command) != TEXT_DATA)
+        {
+            if ((count > 0) && !append_text_packets(client, packets, count, COMMIT_THEN_COMMAND))
+            {
+                return true;
+            }
+            count = 0;
+            if (command->kind == TEXT_SUBSCRIBE)
+            {
+                execute_subscribe(client, command);
+                packet_spill_release(&client->spill);
+                return true;
+            }
+            command_pending = true;
+            continue;
+        }
+
+        packets[count].iov_base = packet;
+        packets[count].iov_len = packet_size;
+        count++;
+        if (count == GROUP_COMMIT_MAX_BATCH)
+        {
+            if (!append_text_packets(client, packets, count, COMMIT_THEN_PIPELINE))
+            {
+                return true;
+            }
+            count = 0;
+        }
+    }
+    if (!any)
+    {
+        return false;
+    }
+
+    if (command_pending)
+    {
+        execute_command(client, command, true);
+    }
+    else
+    {
+        if ((count > 0) && !append_text_packets(client, packets, count, COMMIT_THEN_REPLY))
+        {
+            return true;
+        }
+        start_reply_after_append(client);
+    }
+    packet_spill_release(&client->spill); // a spilled packet (always the first one) is appended already
+    return true;
+}
+
+/// Prepares a binary response: the header with the fixed part of the payload (if any),
+/// followed by the store data from `reply_offset` up to `reply_end` (both already set, along with `reply_snapshot`).
+///
+static void start_binary_reply(struct client_info *const client, const struct binary_header *const request,
+                               const enum binary_status status, const char *const fixed, const size_t fixed_size)
+{
+    assert(!client->reply_pending);
+    assert(fixed_size <= BINARY_MAX_FIXED_PAYLOAD);
+    assert((client->reply_offset >= 0) && (client->reply_offset <= client->reply_end));
+
+    const struct binary_header header = {
+        .opcode = request->opcode,
+        .status = status,
+        .length = fixed_size + (client->reply_end - client->reply_offset),
+    };
+    binary_header_encode(client->reply_header, &header);
+    if (fixed_size > 0)
+    {
+        memcpy(client->reply_header + BINARY_HEADER_SIZE, fixed, fixed_size);
+    }
+    client->reply_header_size = BINARY_HEADER_SIZE + fixed_size;
+    client->reply_header_sent = 0;
+
+    client->reply_ranged = true;
+    client->reply_pending = true;
+    client->reply_started = stats_now();
+    client->reply_begin = client->reply_offset;
+}
+
+/// Prepares a binary response which carries no store data.
+static void binary_respond(struct client_info *const client, const struct binary_header *const request,
+                           const enum binary_status status, const char *const fixed, const size_t fixed_size)
+{
+    client->reply_offset = 0;
+    client->reply_end = 0;
+    start_binary_reply(client, request, status, fixed, fixed_size);
+}
+
+/// Responds to the binary append with the position of the committed record.
+static void respond_appended(struct client_info *const client, const struct binary_header *const request,
+                             const bool appended)
+{
+    if (!appended)
+    {
+        binary_respond(client, request, BINARY_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    char fixed[16];
+    binary_put_u64(fixed, client->committed.sequence);
+    binary_put_u64(fixed + 8, client->committed.end_offset);
+    binary_respond(client, request, BINARY_STATUS_OK, fixed, sizeof(fixed));
+}
+
+static void execute_binary_append(struct client_info *const client, const struct binary_header *const request,
+                                  char *const payload)
+{
+    // Exactly one record: the store (and its index) delimits the records by newlines.
+    const size_t size = request->length;
+    if ((size == 0) || (payload[size - 1] != '\n') || (memchr(payload, '\n', size - 1) != NULL))
+    {
+        binary_respond(client, request, BINARY_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    stats_count(STATS_PACKETS, 1);
+    client->commit_frame = *request;
+    const struct iovec record = {.iov_base = payload, .iov_len = request->length};
+    const enum append_result result = append_packets(client, &record, 1, COMMIT_THEN_RESPOND);
+    if (result != APPEND_PENDING)
+    {
+        respond_appended(client, request, result == APPEND_DONE);
+    }
+}
+
+static void execute_binary_seekto(struct client_info *const client, const struct binary_header *const request,
+                                  const char *const payload)
+{
+    if (request->length != 8)
+    {
+        binary_respond(client, request, BINARY_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    struct aesd_seekto seekto;
+    seekto.write_cmd = binary_get_u32(payload);
+    seekto.write_cmd_offset = binary_get_u32(payload + 4);
+
+    stats_count(STATS_SEEKTO, 1);
+    int result;
+    off_t position;
+    stats_rwlock_wrlock(&client->shared->rw_file_lock);
+    {
+        async_log(LOG_DEBUG, "Binary seek to %u,%u (peer_fd=%d).", //
+                  seekto.write_cmd, seekto.write_cmd_offset, client->peer_fd);
+
+#if USE_AESD_CHAR_DEVICE
+        // Unlike the range read, the seek moves the position for good.
+        result = ioctl(client->file_fd, AESDCHAR_IOCSEEKTO, &seekto);
+        position = lseek(client->file_fd, 0, SEEK_CUR);
+#else
+        // The position is the log offset (see `BINARY_OP_READ`).
+        uint64_t offset = 0;
+        result = find_seekto(client, &seekto, &offset) ? 0 : -1;
+        position = offset;
+#endif
+    }
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+
+    if ((result == -1) || (position < 0))
+    {
+        binary_respond(client, request, BINARY_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    char fixed[8];
+    binary_put_u64(fixed, position);
+    binary_respond(client, request, BINARY_STATUS_OK, fixed, sizeof(fixed));
+}
+
+static void execute_binary_read(struct client_info *const client, const struct binary_header *const request,
+                                const char *const payload)
+{
+    if (request->length != 16)
+    {
+        binary_respond(client, request, BINARY_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    const uint64_t offset = binary_get_u64(payload);
+    const uint64_t length = binary_get_u64(payload + 8);
+
+    struct store_snapshot *snapshot;
+    off_t size;
+    stats_rwlock_rdlock(&client->shared->rw_file_lock);
+    {
+        snapshot = snapshot_cache_acquire(&client->shared->snapshots);
+        size = store_size(client, snapshot);
+    }
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+
+    if (size < 0)
+    {
+        if (snapshot != NULL)
+        {
+            store_snapshot_release(snapshot);
+        }
+        binary_respond(client, request, BINARY_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    // The range is clipped to the store (so the response length is known up front).
+    // The log offsets start at the oldest retained byte (the device ones are always from 0).
+    const uint64_t base = (snapshot != NULL) ? snapshot->base : 0;
+    const uint64_t end = base + size;
+    const uint64_t first = (offset < base) ? base : offset;
+    const uint64_t begin = ((first < end) ? first : end) - base;
+    const uint64_t available = (uint64_t)size - begin;
+    client->reply_snapshot = snapshot;
+    client->reply_offset = begin;
+    client->reply_end = begin + ((length < available) ? length : available);
+    start_binary_reply(client, request, BINARY_STATUS_OK, NULL, 0);
+}
+
+static void execute_binary_read_record(struct client_info *const client, const struct binary_header *const request,
+                                       const char *const payload)
+{
+    if (request->length != 16)
+    {
+        binary_respond(client, request, BINARY_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    struct aesd_seekto seekto;
+    seekto.write_cmd = binary_get_u32(payload);
+    seekto.write_cmd_offset = binary_get_u32(payload + 4);
+    const uint64_t length = binary_get_u64(payload + 8);
+
+    stats_count(STATS_RANGE_READS, 1);
+    uint64_t offset = 0;
+    if (!prepare_range(client, &seekto, length, &offset))
+    {
+        release_reply_snapshot(client);
+        binary_respond(client, request, BINARY_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    char fixed[8];
+    binary_put_u64(fixed, offset);
+    start_binary_reply(client, request, BINARY_STATUS_OK, fixed, sizeof(fixed));
+}
+
+static void execute_binary_stat(struct client_info *const client, const struct binary_header *const request)
+{
+    if (request->length != 0)
+    {
+        binary_respond(client, request, BINARY_STATUS_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    struct store_snapshot *snapshot;
+    off_t size;
+    struct commit_position position;
+    stats_rwlock_rdlock(&client->shared->rw_file_lock);
+    {
+        snapshot = snapshot_cache_acquire(&client->shared->snapshots);
+        size = store_size(client, snapshot);
+        position = group_commit_position(&client->shared->commits);
+    }
+    pthread_rwlock_unlock(&client->shared->rw_file_lock);
+
+    const uint64_t generation = (snapshot != NULL) ? snapshot->generation : 0;
+    const uint64_t base = (snapshot != NULL) ? snapshot->base : 0;
+    if (snapshot != NULL)
+    {
+        store_snapshot_release(snapshot);
+    }
+    if (size < 0)
+    {
+        binary_respond(client, request, BINARY_STATUS_FAILED, NULL, 0);
+        return;
+    }
+
+    char fixed[24];
+    binary_put_u64(fixed, base + size);
+    binary_put_u64(fixed + 8, generation);
+    binary_put_u64(fixed + 16, position.sequence);
+    binary_respond(client, request, BINARY_STATUS_OK, fixed, sizeof(fixed));
+}
+
+/// Binary framing: processes the next complete frame already received.
+///
+/// The frame length is known from its header, so nothing is scanned, and the receive buffer
+/// is sized for the whole frame as soon as the header arrives.
+/// Returns true if a frame was processed, so its response is pending now.
+///
+static bool process_frame(struct client_info *const client)
+{
+    struct recv_buffer *const received = &client->received;
+
+    // The payload of a rejected frame is skipped as it arrives.
+    if (client->discard > 0)
+    {
+        const size_t pending = recv_buffer_pending(received);
+        const size_t skipped = (client->discard < pending) ? client->discard : pending;
+        recv_buffer_consume(received, skipped);
+        client->discard -= skipped;
+        if (client->discard > 0)
+        {
+            return false;
+        }
+    }
+
+    const size_t pending = recv_buffer_pending(received);
+    if (pending < BINARY_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    struct binary_header request;
+    binary_header_decode(recv_buffer_head(received), &request);
+    const size_t frame_size = BINARY_HEADER_SIZE + request.length;
+
+    // A frame is received into memory as a whole, so it's bound by the memory budget of the text packets
+    // (which are spilled instead): longer than the spill threshold, or growing the buffer beyond the global budget.
+    //
+    enum binary_status rejected = BINARY_STATUS_OK;
+    if ((request.length > BINARY_MAX_PAYLOAD) || (request.length > client->shared->spill_threshold))
+    {
+        rejected = BINARY_STATUS_TOO_LARGE;
+    }
+    else if ((frame_size > received->capacity) && (frame_size > BUFFER_SIZE) &&
+             (recv_buffer_grown_bytes() + frame_size > client->shared->buffer_budget))
+    {
+        rejected = BINARY_STATUS_BUSY;
+    }
+    if (rejected != BINARY_STATUS_OK)
+    {
+        async_log(LOG_DEBUG, "Binary frame of %u bytes rejected with status %d (peer_fd=%d).", request.length,
+                  rejected, client->peer_fd);
+        recv_buffer_consume(received, BINARY_HEADER_SIZE);
+        client->discard = request.length;
+        binary_respond(client, &request, rejected, NULL, 0);
+        return true;
+    }
+
+    if (pending < frame_size)
+    {
+        // A failure to grow is reported by the next receive anyway.
+        recv_buffer_reserve(received, frame_size - pending);
+        return false;
+    }
+
+    // The payload stays valid until the next receive, and it's fully processed by then.
+    char *const payload = recv_buffer_head(received) + BINARY_HEADER_SIZE;
+    recv_buffer_consume(received, frame_size);
+
+    switch (request.opcode)
+    {
+    case BINARY_OP_APPEND:
+        execute_binary_append(client, &request, payload);
+        break;
+    case BINARY_OP_SEEKTO:
+        execute_binary_seekto(client, &request, payload);
+        break;
+    case BINARY_OP_READ:
+        execute_binary_read(client, &request, payload);
+        break;
+    case BINARY_OP_STAT:
+        execute_binary_stat(client, &request);
+        break;
+    case BINARY_OP_READ_RECORD:
+        execute_binary_read_record(client, &request, payload);
+        break;
+    default:
+        binary_respond(client, &request, BINARY_STATUS_UNSUPPORTED, NULL, 0);
+        break;
+    }
+    return true;
+}
+
+/// Copies the data to the end of the buffer. Returns false if the buffer can't grow.
+static bool store_data(struct recv_buffer *const buffer, const char *const data, const size_t size)
+{
+    size_t stored = 0;
+    while (stored < size)
+    {
+        if (!recv_buffer_reserve(buffer, RECV_BUFFER_MIN_FREE))
+        {
+            syslog(LOG_ERR, "malloc receive buffer: %s", strerror(errno));
+            return false;
+        }
+
+        size_t chunk = recv_buffer_space(buffer);
+        if (chunk > (size - stored))
+        {
+            chunk = size - stored;
+        }
+        memcpy(recv_buffer_tail(buffer), data + stored, chunk);
+        recv_buffer_commit(buffer, chunk);
+        stored += chunk;
+    }
+    return true;
+}
+
+bool client_store_received(struct client_info *const client, const char *const data, const size_t size)
+{
+    assert(client != NULL);
+    assert(data != NULL);
+
+    // The packets of an append in flight are still in the receive buffer (which could be moved by growing).
+    struct recv_buffer *const buffer = client_commit_pending(client) ? &client->held : &client->received;
+    if (!store_data(buffer, data, size))
+    {
+        return false;
+    }
+    received_data(client, data, size);
+    return true;
+}
+
+/// Replaces the data of the pending text reply with its compressed stream.
+///
+/// Whole-store replies come from the shared cache, so the store is compressed once per generation
+/// rather than once per client; partial ones (after a seek, range reads) are compressed on their own.
+/// Without any snapshot (see `start_reply`) the reply is an empty stream.
+///
+static void compress_reply(struct client_info *const client)
+{
+    struct store_snapshot *const snapshot = client->reply_snapshot;
+    const off_t end = ((snapshot != NULL) && (client->reply_end >= 0)) ? client->reply_end : 0;
+    const off_t offset = (client->reply_offset < end) ? client->reply_offset : end;
+
+    struct store_snapshot *compressed = NULL;
+    if ((snapshot != NULL) && (offset == 0) && (end == (off_t)snapshot->size))
+    {
+        compressed = compressed_reply_acquire(&client->shared->compressed_replies, snapshot);
+    }
+    else
+    {
+        compressed = compressed_reply_build(snapshot, offset, end);
+    }
+
+    client->reply_raw_end = (client->reply_offset < end) ? end : client->reply_offset;
+    release_reply_snapshot(client);
+    client->reply_compressed = true;
+    client->reply_snapshot = compressed;
+    client->reply_offset = 0;
+    client->reply_begin = 0;
+    client->reply_end = 0;
+    if (compressed != NULL)
+    {
+        client->reply_end = compressed->size;
+    }
+    else
+    {
+        // The peer still gets a well-formed (empty) stream.
+        memset(client->reply_header, 0, 4);
+        client->reply_header_size = 4;
+    }
+}
+
+/// Processes the next complete text packet (or all of them when pipelining).
+static bool process_text(struct client_info *const client)
+{
+    if (client->shared->pipelining)
+    {
+        return write_new_packets(client, false, false);
+    }
+
+    size_t packet_size = 0;
+    char *const packet = next_text_packet(client, &packet_size);
+    if (packet == NULL)
+    {
+        return false;
+    }
+
+    write_new_packet(client, packet, packet_size);
+    return true;
+}
+
+/// Compresses the text reply just prepared (if the connection asked for it).
+static void finish_text_reply(struct client_info *const client)
+{
+    // The handshake acknowledgement (the only text reply made of a header) is never compressed.
+    if (client->compressing && client->reply_pending && (client->reply_header_size == 0))
+    {
+        compress_reply(client);
+    }
+}
+
+bool client_process_packet(struct client_info *const client)
+{
+    assert(client != NULL);
+
+    if (client->reply_pending || client->subscribing || client_commit_pending(client))
+    {
+        return false;
+    }
+
+    // The very first byte of the connection selects the framing.
+    //
+    if (client->framing == CLIENT_FRAMING_UNKNOWN)
+    {
+        if (recv_buffer_pending(&client->received) == 0)
+        {
+            return false;
+        }
+        if (*recv_buffer_head(&client->received) == BINARY_PROTOCOL_MAGIC)
+        {
+            async_log(LOG_DEBUG, "Binary framing (peer_fd=%d).", client->peer_fd);
+            recv_buffer_consume(&client->received, 1);
+            client->framing = CLIENT_FRAMING_BINARY;
+        }
+        else
+        {
+            client->framing = CLIENT_FRAMING_TEXT;
+        }
+    }
+    if (client->framing == CLIENT_FRAMING_BINARY)
+    {
+        return process_frame(client);
+    }
+
+    if (!process_text(client))
+    {
+        spill_unterminated(client);
+        return false;
+    }
+    finish_text_reply(client);
+    return true;
+}
+
+void client_complete_commit(struct client_info *const client)
+{
+    assert(client != NULL);
+    assert(client_commit_pending(client));
+
+    const bool appended = group_commit_result(client->commit_requests, client->commit_count, &client->committed);
+    stats_record_since(STATS_STAGE_APPEND, client->commit_started);
+    client->commit_count = 0;
+
+    // The packets are not needed any more, so what was received meanwhile can follow them.
+    //
+    if (recv_buffer_pending(&client->held) > 0)
+    {
+        const bool stored =
+            store_data(&client->received, recv_buffer_head(&client->held), recv_buffer_pending(&client->held));
+        recv_buffer_release(&client->held);
+        if (!stored)
+        {
+            abort_connection(client);
+            return;
+        }
+    }
+
+    if (!appended && (client->commit_then != COMMIT_THEN_RESPOND))
+    {
+        abort_connection(client);
+        return;
+    }
+
+    switch (client->commit_then)
+    {
+    case COMMIT_THEN_RESPOND:
+        respond_appended(client, &client->commit_frame, appended);
+        return;
+    case COMMIT_THEN_REPLY:
+        start_reply_after_append(client);
+        packet_spill_release(&client->spill);
+        break;
+    case COMMIT_THEN_PIPELINE:
+        write_new_packets(client, true, false);
+        break;
+    case COMMIT_THEN_COMMAND:
+        if (client->pipelined_command.kind == TEXT_SUBSCRIBE)
+        {
+            execute_subscribe(client, &client->pipelined_command);
+            packet_spill_release(&client->spill);
+            break;
+        }
+        write_new_packets(client, true, true);
+        break;
+    }
+    finish_text_reply(client);
+}
+
+enum client_state client_advance(struct client_info *const client)
+{
+    assert(client != NULL);
+    assert(client->peer_fd >= 0);
+    assert(client->shared != NULL);
+
+    for (;;)
+    {
+        // Previous reply (if any) has to be fully sent before the next packet is processed.
+        //
+        if (client->reply_pending)
+        {
+            const enum client_state state = reply_to_client(client);
+            if (state != CLIENT_WANTS_READ)
+            {
+                return state;
+            }
+        }
+        if (client->subscribing)
+        {
+            return CLIENT_HANDOFF;
+        }
+
+        // Scan already received data for the next packet.
+        //
+        if (client_process_packet(client))
+        {
+            continue;
+        }
+
+        // Nothing is received until the append is completed, as its packets are still in the receive buffer.
+        if (client_commit_pending(client))
+        {
+            return CLIENT_WANTS_COMMIT;
+        }
+
+        if (!recv_buffer_reserve(&client->received, RECV_BUFFER_MIN_FREE))
+        {
+            syslog(LOG_ERR, "malloc receive buffer: %s", strerror(errno));
+            return CLIENT_DONE;
+        }
+
+        const uint64_t recv_started = stats_now();
+        const ssize_t bytes_read = recv(client->peer_fd, recv_buffer_tail(&client->received),
+                                        recv_buffer_space(&client->received), 0);
+        stats_record_since(STATS_STAGE_RECV, recv_started);
+        if (bytes_read > 0)
+        {
+            received_data(client, recv_buffer_tail(&client->received), bytes_read);
+            recv_buffer_commit(&client->received, bytes_read);
+            continue;
+        }
+        if (bytes_read == 0)
+        {
+            return CLIENT_DONE;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            // Idle connections don't need to hold any buffers (unless there is an unterminated packet).
+            if (recv_buffer_pending(&client->received) == 0)
+            {
+                recv_buffer_release(&client->received);
+            }
+            return CLIENT_WANTS_READ;
+        }
+
+        syslog(LOG_ERR, "recv: %s", strerror(errno));
+        return CLIENT_DONE;
+    }
+}
+
+void client_hand_off(struct client_info *const client)
+{
+    assert(client != NULL);
+    assert(client->subscribing);
+    assert(client->peer_fd >= 0);
+
+    end_session(client);
+    recv_buffer_release(&client->received);
+    packet_spill_release(&client->spill);
+    subscription_hub_add(client->shared->subscriptions, client->peer_fd, client->subscription_cursor);
+    client->peer_fd = -1;
+}
+
+void process_client(struct client_info *const client)
+{
+    assert(client != NULL);
+    assert(client->peer_fd >= 0);
+    assert(client->shared != NULL);
+    assert(recv_buffer_pending(&client->received) == 0);
+
+    // The peer socket is a blocking one, so the state machine runs until the peer is gone (or subscribes).
+    const enum client_state state = client_advance(client);
+    assert((state == CLIENT_DONE) || (state == CLIENT_HANDOFF));
+    if (state == CLIENT_HANDOFF)
+    {
+        client_hand_off(client);
+    }
+
+    // All done so we can free the receive buffer (instead of postponing it to the thread join).
+    recv_buffer_release(&client->received);
+    packet_spill_release(&client->spill);
+    end_session(client);
+}
+
+void *process_client_thread(void *const arg)
+{
+
+    struct client_info *const client = arg;
+    if (client == NULL)
+    {
+        syslog(LOG_ERR, "process_client_thread: NULL argument");
+        return NULL;
+    }
+    async_log(LOG_DEBUG, "Started client thread (peer_fd=%d, thread=%p).", //
+              client->peer_fd, (const void *)pthread_self());
+
+    process_client(client);
+
+    async_log(LOG_DEBUG, "Finished client thread (peer_fd=%d, thread=%p).", //
+              client->peer_fd, (const void *)pthread_self());
+
+    if (client->peer_fd >= 0)
+    {
+        close(client->peer_fd);
+    }
     client->peer_fd = -1; // this marks the client as done
 
     return client;
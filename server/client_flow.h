@@ -1,12 +1,23 @@
 #ifndef AESDSOCKET_CLIENT_FLOW_H
 #define AESDSOCKET_CLIENT_FLOW_H
 
-#include "packet_fragment.h"
+#include "aesd_ioctl.h"
+#include "binary_protocol.h"
+#include "compressed_reply.h"
+#include "group_commit.h"
+#include "latency_profile.h"
+#include "packet_spill.h"
 #include "queue.h"
+#include "recv_buffer.h"
+#include "session_trace.h"
+#include "store_snapshot.h"
+#include "subscription.h"
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -18,22 +29,228 @@
 #define SOCKET_DATA_FILE "/var/tmp/aesdsocketdata"
 #endif
 
+/// Values of the `running` flag the engines loop on.
+enum server_run_state
+{
+    SERVER_STOPPED = 0,  // close all clients and return
+    SERVER_RUNNING = 1,
+    SERVER_DRAINING = 2, // keep serving (and accepting), but return as soon as there is no client (`clients_idle`)
+};
+
 struct shared_info
 {
     pthread_rwlock_t rw_file_lock;
+    struct snapshot_cache snapshots;
+    struct compressed_reply_cache compressed_replies;
+    struct group_commit commits;
+    struct session_recorder *recorder;      // NULL unless the sessions are recorded
+    struct subscription_hub *subscriptions; // NULL unless the connections can subscribe to new records
+    bool pipelining;                        // all complete lines of a receive are appended together, with one reply
+
+    // Memory budget of unterminated packets (see `packet_spill`): a connection spills its packet once it's longer
+    // than `spill_threshold`, or once all grown receive buffers together exceed `buffer_budget`.
+    //
+    size_t spill_threshold;
+    size_t buffer_budget;
+
+    bool low_latency;          // the peer sockets are tuned, and the replies corked (see `latency_profile.h`)
+    struct cpu_rotation *cpus; // where the engine threads are pinned (NULL if they are not)
+
+    size_t connected; // sessions in progress in all the engines (updated atomically, see `clients_idle`)
+};
+
+/// Whether no engine is serving any client: with several listeners, a draining engine keeps accepting until
+/// all of them are idle, so that no listener is left unserved while the others drain.
+///
+static inline bool clients_idle(struct shared_info *const shared)
+{
+    return __atomic_load_n(&shared->connected, __ATOMIC_ACQUIRE) == 0;
+}
+
+/// How the packets of a connection are delimited.
+enum client_framing
+{
+    CLIENT_FRAMING_UNKNOWN, // nothing received yet
+    CLIENT_FRAMING_TEXT,    // newline terminated packets
+    CLIENT_FRAMING_BINARY,  // length-prefixed frames (see `binary_protocol.h`)
 };
 
+/// Text packet which is a command rather than data to append.
+enum text_command_kind
+{
+    TEXT_DATA,
+    TEXT_SEEKTO,    // `AESDCHAR_IOCSEEKTO:<cmd>,<offset>`
+    TEXT_READ,      // `AESDCHAR_READ:<cmd>,<offset>,<length>`
+    TEXT_SUBSCRIBE, // `SUBSCRIBE` (new records only), or `SUBSCRIBE:<sequence>` (from that packet on)
+    TEXT_COMPRESS,  // `COMPRESS:lz4`
+};
+
+struct text_command
+{
+    enum text_command_kind kind;
+    struct aesd_seekto seekto; // where the seek goes (or the read starts)
+    size_t length;             // of the read
+    uint64_t from_sequence;    // of the subscription (0 - new records only)
+};
+
+/// What follows an asynchronous append once it's committed (see `client_complete_commit`).
+enum commit_continuation
+{
+    COMMIT_THEN_REPLY,    // the reply to the appended text packets
+    COMMIT_THEN_PIPELINE, // the rest of the pipelined packets
+    COMMIT_THEN_COMMAND,  // the pipelined command after the appended packets, then the rest of them
+    COMMIT_THEN_RESPOND,  // the binary response with the commit position
+};
+
+struct client_completions;
+
 struct client_info
 {
     int peer_fd;
     pthread_t thread;
+    struct client_completions *completions; // where the client thread posts itself once done (thread engine)
     struct shared_info *shared;
-    struct packet_fragment *fragments;
-    FILE *file;
+    int file_fd;
+    uint32_t session_id; // the recorded session (0 if not recorded, or already closed)
+    bool connected;      // counted in `shared->connected`
+
+    // Framing state: the current (not yet terminated) packet and the data received after it.
+    // `discard` is the number of bytes of a rejected binary frame still to be skipped.
+    // `spill` holds the head of a text packet over the memory budget (`received` starts with its tail then).
+    //
+    enum client_framing framing;
+    struct recv_buffer received;
+    size_t discard;
+    struct packet_spill spill;
+
+    // Position of the last packet committed by the client.
+    struct commit_position committed;
+
+    // Asynchronous appends (event engines): `notifier` is where the storage thread hands the committed packets
+    // back (with `commit_owner`, which is up to the engine), NULL if the appends wait for the commit instead.
+    // While the `commit_count` requests (lazily allocated for a whole batch) are in flight, the packets stay
+    // where they are, so whatever the engine receives meanwhile waits in `held`. `commit_then` is what follows
+    // (the pipelined command is kept in `pipelined_command`, the binary request in `commit_frame`).
+    //
+    struct commit_notifier *notifier;
+    void *commit_owner;
+    struct commit_request *commit_requests;
+    size_t commit_count;
+    enum commit_continuation commit_then;
+    struct text_command pipelined_command;
+    struct binary_header commit_frame;
+    uint64_t commit_started;
+    struct recv_buffer held;
+
+    // Set by the `SUBSCRIBE` command: the connection goes to the subscription hub (streaming from the cursor)
+    // once the replies before it are sent.
+    //
+    bool subscribing;
+    uint64_t subscription_cursor;
+
+    // Set by the `COMPRESS:lz4` handshake: the text replies go as compressed streams (see `compressed_reply`).
+    bool compressing;
+
+    // Reply state.
+    // `reply_snapshot` is the store content being sent (NULL if there was no snapshot to use),
+    // `reply_end` is negative when the reply goes until the end of file.
+    // `reply_pipe` is used (lazily created) to splice the device content to the peer socket,
+    // `reply_piped` being the number of bytes already in the pipe but not yet sent.
+    // `zero_copy` is reset once the file turned out to support neither `sendfile` nor `splice`.
+    // `reply_ranged` is set for explicitly positioned replies (range reads, binary responses),
+    // which don't move the device position.
+    // `reply_compressed` is set once `reply_snapshot` is the compressed stream of the reply, `reply_raw_end`
+    // being the device position the uncompressed reply would end at.
+    // `reply_started` and `reply_begin` (the initial offset) are for the statistics.
+    // Binary responses start with `reply_header` (the frame header and the fixed part of the payload),
+    // sent before the store data.
+    //
+    bool reply_pending;
+    bool reply_corked; // the low-latency profile corks the replies longer than a single send
+    bool reply_ranged;
+    bool reply_compressed;
+    off_t reply_raw_end;
+    struct store_snapshot *reply_snapshot;
+    uint64_t reply_started;
+    off_t reply_begin;
+    off_t reply_offset;
+    off_t reply_end;
+    int reply_pipe[2];
+    size_t reply_piped;
+    bool zero_copy;
+    char reply_header[BINARY_HEADER_SIZE + BINARY_MAX_FIXED_PAYLOAD];
+    size_t reply_header_size;
+    size_t reply_header_sent;
 
     TAILQ_ENTRY(client_info) nodes;
+    SLIST_ENTRY(client_info) completed;
 };
 
+/// What the client state machine is waiting for.
+enum client_state
+{
+    CLIENT_WANTS_READ,   // the peer socket has no more data to receive
+    CLIENT_WANTS_WRITE,  // the peer socket can't accept more reply data
+    CLIENT_WANTS_COMMIT, // an asynchronous append is in flight (see `client_complete_commit`)
+    CLIENT_DONE,         // the peer has closed the connection (or failed)
+    CLIENT_HANDOFF,      // the peer has subscribed, so the connection goes to `client_hand_off`
+};
+
+/// Allocates a new client and opens its data file.
+/// Returns NULL on failure; `peer_fd` is NOT closed in this case.
+///
+struct client_info *client_info_create(struct shared_info *shared, int peer_fd);
+
+/// Prepares already finished client (with its data file still open) to serve a new peer.
+void client_info_recycle(struct client_info *client, int peer_fd);
+
+/// Closes the client's descriptors (if any left) and deallocates it.
+void client_info_destroy(struct client_info *client);
+
+/// Advances the client state machine as far as its peer socket allows.
+///
+/// For a blocking socket this runs until the peer closes the connection;
+/// for a non-blocking socket it returns as soon as the socket would block.
+///
+enum client_state client_advance(struct client_info *client);
+
+/// Stores data received by an engine into its own buffers (rather than by `client_advance`).
+/// Returns false if the receive buffer can't grow.
+///
+bool client_store_received(struct client_info *client, const char *data, size_t size);
+
+/// Processes the next complete packet already received (unless the previous reply or append is still pending).
+/// Returns true if a packet was processed, so its reply (or its asynchronous append) is pending now.
+///
+bool client_process_packet(struct client_info *client);
+
+/// Returns true while an asynchronous append of the client is in flight.
+static inline bool client_commit_pending(const struct client_info *const client)
+{
+    return client->commit_count > 0;
+}
+
+/// Completes the asynchronous append once the engine took its last request from the notifier
+/// (see `commit_notifier_take`): prepares the reply, or goes on with the pipelined packets.
+/// The engine advances the client afterwards.
+///
+void client_complete_commit(struct client_info *client);
+
+/// Completes the pending reply once an engine has sent all of it (from `reply_offset` up to `reply_end`).
+void client_finish_reply(struct client_info *client);
+
+/// Passes the peer socket of a subscribed client to the subscription hub, and finishes the session.
+///
+/// The client is left without the peer socket (`peer_fd` is -1).
+///
+void client_hand_off(struct client_info *client);
+
+/// Serves the client with blocking peer socket until the peer closes the connection (or subscribes).
+///
+/// The peer socket is left open (it's up to the caller to close it), unless it was handed off.
+///
+void process_client(struct client_info *client);
+
 void *process_client_thread(void *);
 
 #endif // AESDSOCKET_CLIENT_FLOW_H
@@ -0,0 +1,244 @@
+#include "compressed_reply.h"
+#include "async_log.h"
+#include "lz4_block.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+/// Size of the block size field in the stream.
+#define COMPRESSED_SIZE_FIELD 4
+
+void compressed_reply_cache_init(struct compressed_reply_cache *const cache, const bool append_only)
+{
+    assert(cache != NULL);
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->append_only = append_only;
+    cache->current = NULL;
+}
+
+void compressed_reply_cache_destroy(struct compressed_reply_cache *const cache)
+{
+    assert(cache != NULL);
+
+    if (cache->current != NULL)
+    {
+        store_snapshot_release(&cache->current->snapshot);
+        cache->current = NULL;
+    }
+    pthread_mutex_destroy(&cache->lock);
+}
+
+static void put_size(char *const p, const uint32_t size)
+{
+    p[0] = size & 0xFF;
+    p[1] = (size >> 8) & 0xFF;
+    p[2] = (size >> 16) & 0xFF;
+    p[3] = (size >> 24) & 0xFF;
+}
+
+/// Returns the bytes `[offset, offset + size)` of the snapshot in one piece: right from the snapshot if they are
+/// contiguous there, or copied to `*scratch` (allocated on the first use) if they span log segments.
+///
+static const char *raw_block(const struct store_snapshot *const snapshot, const size_t offset, const size_t size,
+                             char **const scratch)
+{
+    struct snapshot_chunk chunk;
+    store_snapshot_chunk(snapshot, offset, &chunk);
+    if (chunk.size >= size)
+    {
+        return chunk.data;
+    }
+
+    if (*scratch == NULL)
+    {
+        *scratch = malloc(COMPRESSED_BLOCK_SIZE);
+        if (*scratch == NULL)
+        {
+            syslog(LOG_ERR, "malloc compression scratch: %s", strerror(errno));
+            return NULL;
+        }
+    }
+    size_t copied = 0;
+    while (copied < size)
+    {
+        store_snapshot_chunk(snapshot, offset + copied, &chunk);
+        const size_t piece = (chunk.size < (size - copied)) ? chunk.size : (size - copied);
+        memcpy(*scratch + copied, chunk.data, piece);
+        copied += piece;
+    }
+    return *scratch;
+}
+
+/// Finds the block of `previous` with exactly the same raw bytes (the log is append-only, so the same log range
+/// has the same content in every generation). `cursor` walks the blocks, as they are looked up in order.
+///
+static const struct compressed_block *find_reusable(const struct compressed_reply *const previous,
+                                                    const struct compressed_block *const block, size_t *const cursor)
+{
+    if (previous == NULL)
+    {
+        return NULL;
+    }
+    while ((*cursor < previous->block_count) && (previous->blocks[*cursor].raw_begin < block->raw_begin))
+    {
+        (*cursor)++;
+    }
+    if ((*cursor < previous->block_count) && (previous->blocks[*cursor].raw_begin == block->raw_begin) &&
+        (previous->blocks[*cursor].raw_size == block->raw_size))
+    {
+        return &previous->blocks[*cursor];
+    }
+    return NULL;
+}
+
+/// Compresses the range of the snapshot, copying the unchanged blocks from `previous` (unless NULL).
+static struct compressed_reply *build_reply(const struct store_snapshot *const snapshot, const size_t offset,
+                                            const size_t end, const struct compressed_reply *const previous)
+{
+    assert((snapshot != NULL) || (end == 0));
+    assert(offset <= end);
+
+    // Blocks are aligned on the log offsets (rather than the snapshot ones), so they stay the same
+    // after the retention drops the log head.
+    //
+    const uint64_t base = (snapshot != NULL) ? snapshot->base : 0;
+    const uint64_t raw_begin = base + offset;
+    const uint64_t raw_end = base + end;
+    const size_t block_count = (raw_begin == raw_end)
+                                   ? 0
+                                   : (((raw_end - 1) / COMPRESSED_BLOCK_SIZE) - (raw_begin / COMPRESSED_BLOCK_SIZE) + 1);
+
+    // The worst case is every block stored as is, so it's allocated up front (and trimmed once done).
+    const size_t stream_capacity = (block_count * COMPRESSED_SIZE_FIELD) + (end - offset) + COMPRESSED_SIZE_FIELD;
+    const size_t header_size = sizeof(struct compressed_reply) + (block_count * sizeof(struct compressed_block));
+    struct compressed_reply *reply = malloc(header_size + stream_capacity);
+    if (reply == NULL)
+    {
+        syslog(LOG_ERR, "malloc `compressed_reply`: %s", strerror(errno));
+        return NULL;
+    }
+    struct compressed_block *blocks = (struct compressed_block *)(reply + 1);
+    char *stream = (char *)(blocks + block_count);
+
+    char *scratch = NULL;
+    size_t reused = 0;
+    size_t cursor = 0;
+    size_t stream_size = 0;
+    uint64_t block_begin = raw_begin;
+    for (size_t i = 0; i < block_count; ++i)
+    {
+        struct compressed_block *const block = &blocks[i];
+        const uint64_t boundary = ((block_begin / COMPRESSED_BLOCK_SIZE) + 1) * COMPRESSED_BLOCK_SIZE;
+        block->raw_begin = block_begin;
+        block->raw_size = ((boundary < raw_end) ? boundary : raw_end) - block_begin;
+        block->stream_offset = stream_size;
+        block_begin += block->raw_size;
+
+        const struct compressed_block *const same = find_reusable(previous, block, &cursor);
+        if (same != NULL)
+        {
+            memcpy(stream + stream_size, previous->snapshot.data + same->stream_offset, same->stream_size);
+            block->stream_size = same->stream_size;
+            stream_size += same->stream_size;
+            reused++;
+            continue;
+        }
+
+        const char *const raw = raw_block(snapshot, block->raw_begin - base, block->raw_size, &scratch);
+        if (raw == NULL)
+        {
+            free(reply);
+            return NULL;
+        }
+        char *const payload = stream + stream_size + COMPRESSED_SIZE_FIELD;
+        size_t payload_size = lz4_compress_block(raw, block->raw_size, payload, block->raw_size - 1);
+        if (payload_size == 0)
+        {
+            memcpy(payload, raw, block->raw_size);
+            payload_size = block->raw_size;
+            put_size(stream + stream_size, payload_size | COMPRESSED_BLOCK_UNCOMPRESSED);
+        }
+        else
+        {
+            put_size(stream + stream_size, payload_size);
+        }
+        block->stream_size = COMPRESSED_SIZE_FIELD + payload_size;
+        stream_size += block->stream_size;
+    }
+    free(scratch);
+    put_size(stream + stream_size, 0); // the end mark
+    stream_size += COMPRESSED_SIZE_FIELD;
+
+    struct compressed_reply *const trimmed = realloc(reply, header_size + stream_size);
+    if (trimmed != NULL)
+    {
+        reply = trimmed;
+        blocks = (struct compressed_block *)(reply + 1);
+        stream = (char *)(blocks + block_count);
+    }
+
+    reply->snapshot.refs = 1;
+    reply->snapshot.generation = (snapshot != NULL) ? snapshot->generation : 0;
+    reply->snapshot.size = stream_size;
+    reply->snapshot.data = stream;
+    reply->snapshot.base = 0;
+    reply->snapshot.segment_count = 0;
+    reply->snapshot.segments = NULL;
+    reply->source_generation = reply->snapshot.generation;
+    reply->block_count = block_count;
+    reply->blocks = blocks;
+
+    async_log(LOG_DEBUG, "Compressed %zu bytes to %zu (%zu of %zu blocks reused).", end - offset, stream_size,
+              reused, block_count);
+    return reply;
+}
+
+struct store_snapshot *compressed_reply_acquire(struct compressed_reply_cache *const cache,
+                                                struct store_snapshot *const snapshot)
+{
+    assert(cache != NULL);
+
+    if (snapshot == NULL)
+    {
+        return compressed_reply_build(NULL, 0, 0);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct compressed_reply *reply = cache->current;
+    if ((reply != NULL) && (reply->source_generation == snapshot->generation))
+    {
+        __atomic_add_fetch(&reply->snapshot.refs, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        reply = build_reply(snapshot, 0, snapshot->size, cache->append_only ? cache->current : NULL);
+
+        // A client could still be behind with an older snapshot, whose reply must not replace the newer one
+        // (the caller's reference is the only one then).
+        //
+        if ((reply != NULL) &&
+            ((cache->current == NULL) || (cache->current->source_generation < snapshot->generation)))
+        {
+            if (cache->current != NULL)
+            {
+                store_snapshot_release(&cache->current->snapshot);
+            }
+            cache->current = reply;
+            __atomic_add_fetch(&reply->snapshot.refs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return (reply != NULL) ? &reply->snapshot : NULL;
+}
+
+struct store_snapshot *compressed_reply_build(const struct store_snapshot *const snapshot, const size_t offset,
+                                              const size_t end)
+{
+    struct compressed_reply *const reply = build_reply(snapshot, offset, end, NULL);
+    return (reply != NULL) ? &reply->snapshot : NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef AESDSOCKET_COMPRESSED_REPLY_H
+#define AESDSOCKET_COMPRESSED_REPLY_H
+
+#include "store_snapshot.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Raw size of a compressed block; blocks are aligned on multiples of it (of the log offsets).
+#define COMPRESSED_BLOCK_SIZE (64 * 1024)
+
+/// Set in the block size of a block stored as is (it didn't shrink).
+#define COMPRESSED_BLOCK_UNCOMPRESSED 0x80000000U
+
+/// One block of a compressed reply.
+struct compressed_block
+{
+    uint64_t raw_begin;   // log offset of its first byte
+    size_t raw_size;
+    size_t stream_offset; // of its size field in the stream
+    size_t stream_size;   // including the size field
+};
+
+/// A range of a store snapshot as a stream of independent LZ4 blocks.
+///
+/// The stream has the layout of the data blocks of an LZ4 frame: each block is a 32-bit little-endian size
+/// (with `COMPRESSED_BLOCK_UNCOMPRESSED` set if it's stored as is) followed by that many bytes,
+/// and a zero size ends the stream. There is no frame header, nor any checksum.
+///
+/// The stream itself is a snapshot (with `data` set), so it's sent just like the device snapshots;
+/// it's allocated together with its block list, so releasing the snapshot frees everything.
+///
+struct compressed_reply
+{
+    struct store_snapshot snapshot; // must be the first member
+    uint64_t source_generation;
+    size_t block_count;
+    struct compressed_block *blocks;
+};
+
+/// The compressed form of the most recent whole-store reply.
+///
+/// It's built by the first client which needs it (the others wait for it under `lock`, rather than compressing
+/// the same content again). For an append-only store (the file backend log), the blocks which didn't change
+/// since the previous generation are copied over from it, so each write only gets its new bytes compressed.
+///
+struct compressed_reply_cache
+{
+    pthread_mutex_t lock;
+    bool append_only;
+    struct compressed_reply *current;
+};
+
+void compressed_reply_cache_init(struct compressed_reply_cache *cache, bool append_only);
+
+void compressed_reply_cache_destroy(struct compressed_reply_cache *cache);
+
+/// Returns the compressed snapshot (the whole of it, with an extra reference), building it unless cached.
+/// A NULL `snapshot` is taken as an empty store. Returns NULL on failure.
+///
+struct store_snapshot *compressed_reply_acquire(struct compressed_reply_cache *cache,
+                                                struct store_snapshot *snapshot);
+
+/// Compresses the range `[offset, end)` of the snapshot (bypassing the cache). Returns NULL on failure.
+struct store_snapshot *compressed_reply_build(const struct store_snapshot *snapshot, size_t offset, size_t end);
+
+#endif // AESDSOCKET_COMPRESSED_REPLY_H
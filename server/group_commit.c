@@ -0,0 +1,656 @@
+#define _GNU_SOURCE // SYS_futex
+
+#include "group_commit.h"
+#include "background_thread.h"
+#include "client_flow.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static void futex_wait(uint32_t *const word, const uint32_t expected)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *const word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/// Links the request at the queue tail (wait-free: a single exchange).
+static void queue_push(struct group_commit *const commits, struct commit_request *const request)
+{
+    __atomic_store_n(&request->next, NULL, __ATOMIC_RELAXED);
+    struct commit_request *const prev = __atomic_exchange_n(&commits->tail, request, __ATOMIC_SEQ_CST);
+
+    // Until this store the request is not reachable by the storage thread (it waits for the link then).
+    __atomic_store_n(&prev->next, request, __ATOMIC_RELEASE);
+}
+
+/// Result of an attempt to take a request off the queue.
+enum queue_pop_result
+{
+    QUEUE_POPPED,
+    QUEUE_EMPTY,
+    QUEUE_PUSH_IN_PROGRESS, // a writer has exchanged the tail, but not linked its request yet
+};
+
+/// Takes the oldest request off the queue (storage thread only).
+///
+/// Once popped, the request is no longer referenced by the queue, so it can be completed
+/// (and its memory reused by the writer) at any time.
+///
+static enum queue_pop_result queue_pop(struct group_commit *const commits, struct commit_request **const request)
+{
+    struct commit_request *head = commits->head;
+    struct commit_request *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &commits->stub)
+    {
+        if (next == NULL)
+        {
+            return (__atomic_load_n(&commits->tail, __ATOMIC_SEQ_CST) == head) ? QUEUE_EMPTY
+                                                                               : QUEUE_PUSH_IN_PROGRESS;
+        }
+        commits->head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL)
+    {
+        commits->head = next;
+        *request = head;
+        return QUEUE_POPPED;
+    }
+
+    // `head` is the last request: push the stub behind it, so it could be unlinked.
+    //
+    if (__atomic_load_n(&commits->tail, __ATOMIC_SEQ_CST) != head)
+    {
+        return QUEUE_PUSH_IN_PROGRESS;
+    }
+    queue_push(commits, &commits->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+    {
+        return QUEUE_PUSH_IN_PROGRESS; // another writer got in between, and it's still linking
+    }
+    commits->head = next;
+    *request = head;
+    return QUEUE_POPPED;
+}
+
+static bool queue_empty(struct group_commit *const commits)
+{
+    return (commits->head == &commits->stub) &&
+           (__atomic_load_n(&commits->tail, __ATOMIC_SEQ_CST) == &commits->stub);
+}
+
+#if USE_AESD_CHAR_DEVICE
+
+/// Writes all the vectors, continuing after partial writes.
+static bool writev_all(const int file_fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0)
+    {
+        ssize_t bytes_written = writev(file_fd, iov, iov_count);
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "writev: %s", strerror(errno));
+            return false;
+        }
+
+        while ((iov_count > 0) && ((size_t)bytes_written >= iov->iov_len))
+        {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    return true;
+}
+
+#endif // USE_AESD_CHAR_DEVICE
+
+/// Publishes the snapshot of the store right after a change (with the store write lock held).
+static void publish_snapshot(struct group_commit *const commits)
+{
+#if USE_AESD_CHAR_DEVICE
+    snapshot_cache_publish(commits->snapshots, store_snapshot_read(commits->file_fd));
+#else
+    snapshot_cache_publish(commits->snapshots, segment_log_snapshot(commits->log));
+#endif
+}
+
+static void apply_fsync_policy(struct group_commit *const commits, const size_t packets)
+{
+#if USE_AESD_CHAR_DEVICE
+    // Nothing to flush - the device keeps everything in memory.
+    (void)commits;
+    (void)packets;
+#else
+    commits->packets_since_sync += packets;
+
+    bool need_sync = false;
+    switch (commits->fsync_policy)
+    {
+    case FSYNC_NONE:
+        break;
+    case FSYNC_EVERY_PACKETS:
+        need_sync = (commits->packets_since_sync >= commits->fsync_interval);
+        break;
+    case FSYNC_EVERY_MS:
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long long elapsed_ms = ((now.tv_sec - commits->last_sync.tv_sec) * 1000LL) +
+                                     ((now.tv_nsec - commits->last_sync.tv_nsec) / 1000000LL);
+        need_sync = (elapsed_ms >= (long long)commits->fsync_interval);
+        break;
+    }
+    }
+
+    if (need_sync)
+    {
+        segment_log_sync(commits->log);
+        commits->packets_since_sync = 0;
+        clock_gettime(CLOCK_MONOTONIC, &commits->last_sync);
+    }
+#endif
+}
+
+static void batch_vectors(struct commit_request *const *const batch, const size_t batch_size,
+                          struct iovec *const iov)
+{
+    for (size_t i = 0; i < batch_size; ++i)
+    {
+        iov[i].iov_base = (void *)batch[i]->data;
+        iov[i].iov_len = batch[i]->size;
+    }
+}
+
+/// Appends the batch taken from the queue by the storage thread, and hands it to the subscribers (if any).
+static void commit_batch(struct group_commit *const commits, struct commit_request *const *const batch,
+                         const size_t batch_size)
+{
+    struct iovec iov[GROUP_COMMIT_MAX_BATCH];
+    batch_vectors(batch, batch_size, iov);
+
+    stats_rwlock_wrlock(commits->store_lock);
+    {
+#if USE_AESD_CHAR_DEVICE
+        const bool written = writev_all(commits->file_fd, iov, batch_size);
+#else
+        const bool written = segment_log_append(commits->log, iov, batch_size);
+#endif
+        if (written)
+        {
+            // One snapshot for the whole batch.
+            publish_snapshot(commits);
+            apply_fsync_policy(commits, batch_size);
+        }
+
+        // The position is only advanced by the storage thread.
+        //
+        for (size_t i = 0; i < batch_size; ++i)
+        {
+            batch[i]->failed = !written;
+            if (written)
+            {
+                commits->position.sequence++;
+                commits->position.end_offset += batch[i]->size;
+            }
+            batch[i]->position = commits->position;
+        }
+    }
+    pthread_rwlock_unlock(commits->store_lock);
+
+    // The packets are still there (their writers wait for `complete_request`), while `iov`
+    // could have been advanced by the write.
+    //
+    if ((commits->subscriptions != NULL) && !batch[0]->failed)
+    {
+        batch_vectors(batch, batch_size, iov);
+        subscription_hub_publish(commits->subscriptions, iov, batch_size,
+                                 commits->position.sequence - batch_size + 1);
+    }
+}
+
+/// Marks the request committed, and wakes up its writer if it sleeps (or hands it to its notifier).
+///
+/// The request must not be touched afterwards: its writer could have returned already.
+///
+static void complete_request(struct commit_request *const request)
+{
+    struct commit_notifier *const notifier = request->notifier;
+    if (notifier != NULL)
+    {
+        struct commit_request *head = __atomic_load_n(&notifier->completed, __ATOMIC_RELAXED);
+        do
+        {
+            request->completed_next = head;
+        } while (!__atomic_compare_exchange_n(&notifier->completed, &head, request, true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+        return;
+    }
+
+    if (__atomic_exchange_n(&request->done, 1, __ATOMIC_RELEASE) == 2)
+    {
+        futex_wake(&request->done);
+    }
+}
+
+/// Tells the event loop about `count` requests just handed to its notifier (if any).
+static void signal_notifier(struct commit_notifier *const notifier, const uint64_t count)
+{
+    if ((notifier != NULL) && (count > 0) && (write(notifier->event_fd, &count, sizeof(count)) == -1))
+    {
+        syslog(LOG_ERR, "write eventfd: %s", strerror(errno));
+    }
+}
+
+/// Completes the committed batch; each notifier is signalled once for its run of requests.
+static void complete_batch(struct commit_request *const *const batch, const size_t batch_size)
+{
+    struct commit_notifier *notifier = NULL;
+    uint64_t notified = 0;
+    for (size_t i = 0; i < batch_size; ++i)
+    {
+        struct commit_notifier *const request_notifier = batch[i]->notifier;
+        complete_request(batch[i]);
+        if (request_notifier != NULL)
+        {
+            if (request_notifier != notifier)
+            {
+                signal_notifier(notifier, notified);
+                notifier = request_notifier;
+                notified = 0;
+            }
+            notified++;
+        }
+    }
+    signal_notifier(notifier, notified);
+}
+
+/// Sleeps until a writer pushes something (or the stop is requested).
+static void wait_for_requests(struct group_commit *const commits)
+{
+    const uint32_t wakeups = __atomic_load_n(&commits->wakeups, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&commits->writer_sleeping, true, __ATOMIC_SEQ_CST);
+
+    // A writer which pushed before seeing the flag is found by this check.
+    if (queue_empty(commits) && !__atomic_load_n(&commits->stopping, __ATOMIC_SEQ_CST))
+    {
+        futex_wait(&commits->wakeups, wakeups);
+    }
+    __atomic_store_n(&commits->writer_sleeping, false, __ATOMIC_SEQ_CST);
+}
+
+static void *storage_thread(void *const arg)
+{
+    struct group_commit *const commits = arg;
+
+    for (;;)
+    {
+        struct commit_request *batch[GROUP_COMMIT_MAX_BATCH];
+        size_t batch_size = 0;
+        enum queue_pop_result result = QUEUE_EMPTY;
+        while (batch_size < GROUP_COMMIT_MAX_BATCH)
+        {
+            result = queue_pop(commits, &batch[batch_size]);
+            if (result != QUEUE_POPPED)
+            {
+                break;
+            }
+            batch_size++;
+        }
+
+        if (batch_size > 0)
+        {
+            commit_batch(commits, batch, batch_size);
+            complete_batch(batch, batch_size);
+        }
+        else if (result == QUEUE_PUSH_IN_PROGRESS)
+        {
+            sched_yield(); // the writer is just one store away from linking its request
+        }
+        else if (__atomic_load_n(&commits->stopping, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+        else
+        {
+            wait_for_requests(commits);
+        }
+    }
+    return NULL;
+}
+
+static void close_store(struct group_commit *const commits)
+{
+#if USE_AESD_CHAR_DEVICE
+    close(commits->file_fd);
+#else
+    segment_log_destroy(commits->log);
+#endif
+}
+
+/// Layout of the state passed from `group_commit_hand_over` to `group_commit_init`: the position,
+/// followed by the log state (see `segment_log_detach`).
+///
+struct store_state
+{
+    struct commit_position position;
+    char log[];
+};
+
+#if !USE_AESD_CHAR_DEVICE
+/// Adopts the log of the predecessor process, or creates an empty one if there is none (or it can't be adopted).
+static struct segment_log *open_log(struct group_commit *const commits,
+                                    const struct segment_log_config *const log_config, const void *const inherited,
+                                    const size_t inherited_size)
+{
+    if ((inherited != NULL) && (inherited_size >= sizeof(struct store_state)))
+    {
+        const struct store_state *const state = inherited;
+        struct segment_log *const log = segment_log_adopt(SOCKET_DATA_FILE, log_config, state->log,
+                                                          inherited_size - sizeof(struct store_state));
+        if (log != NULL)
+        {
+            commits->position = state->position;
+            return log;
+        }
+        syslog(LOG_ERR, "Could not adopt the predecessor's log, starting with an empty one.");
+    }
+    return segment_log_create(SOCKET_DATA_FILE, log_config);
+}
+#endif
+
+bool group_commit_init(struct group_commit *const commits, pthread_rwlock_t *const store_lock,
+                       struct snapshot_cache *const snapshots, const enum fsync_policy fsync_policy,
+                       const unsigned long fsync_interval, const struct segment_log_config *const log_config,
+                       struct subscription_hub *const subscriptions, const void *const inherited,
+                       const size_t inherited_size)
+{
+    assert(commits != NULL);
+    assert(store_lock != NULL);
+    assert(snapshots != NULL);
+
+    commits->store_lock = store_lock;
+    commits->snapshots = snapshots;
+    commits->subscriptions = subscriptions;
+    commits->stub.next = NULL;
+    commits->head = &commits->stub;
+    commits->tail = &commits->stub;
+    commits->wakeups = 0;
+    commits->writer_sleeping = false;
+    commits->stopping = false;
+    commits->position.sequence = 0;
+    commits->position.end_offset = 0;
+
+    commits->fsync_policy = fsync_policy;
+    commits->fsync_interval = fsync_interval;
+    commits->packets_since_sync = 0;
+    clock_gettime(CLOCK_MONOTONIC, &commits->last_sync);
+
+    // The storage thread is the only writer of the store. The device descriptor is readable as well
+    // (the device snapshots are read through it).
+    //
+#if USE_AESD_CHAR_DEVICE
+    (void)log_config;
+    (void)inherited; // the device outlives the process anyway
+    (void)inherited_size;
+    commits->log = NULL;
+    commits->file_fd = open(SOCKET_DATA_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (commits->file_fd == -1)
+    {
+        syslog(LOG_ERR, "open '%s': %s", SOCKET_DATA_FILE, strerror(errno));
+        return false;
+    }
+#else
+    assert(log_config != NULL);
+    commits->file_fd = -1;
+    commits->log = open_log(commits, log_config, inherited, inherited_size);
+    if (commits->log == NULL)
+    {
+        return false;
+    }
+#endif
+
+    // Publish the initial snapshot of the store (the device could have something already).
+    publish_snapshot(commits);
+
+    if (!create_unsignalled_thread(&commits->writer, storage_thread, commits))
+    {
+        close_store(commits);
+        return false;
+    }
+    return true;
+}
+
+static void stop_storage_thread(struct group_commit *const commits)
+{
+    __atomic_store_n(&commits->stopping, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&commits->wakeups, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&commits->wakeups);
+    pthread_join(commits->writer, NULL);
+
+    assert(queue_empty(commits));
+}
+
+void group_commit_destroy(struct group_commit *const commits)
+{
+    assert(commits != NULL);
+
+    stop_storage_thread(commits);
+    close_store(commits);
+}
+
+void *group_commit_hand_over(struct group_commit *const commits, size_t *const size)
+{
+    assert(commits != NULL);
+    assert(size != NULL);
+
+    stop_storage_thread(commits);
+    *size = 0;
+#if USE_AESD_CHAR_DEVICE
+    close_store(commits);
+    return NULL;
+#else
+    size_t log_size = 0;
+    void *const log_state = segment_log_detach(commits->log, &log_size);
+    if (log_state == NULL)
+    {
+        return NULL;
+    }
+    struct store_state *const state = malloc(sizeof(struct store_state) + log_size);
+    if (state == NULL)
+    {
+        syslog(LOG_ERR, "malloc store state: %s", strerror(errno));
+        free(log_state);
+        return NULL;
+    }
+    state->position = commits->position;
+    memcpy(state->log, log_state, log_size);
+    free(log_state);
+
+    *size = sizeof(struct store_state) + log_size;
+    return state;
+#endif
+}
+
+bool group_commit_append(struct group_commit *const commits, const char *const data, const size_t size,
+                         struct commit_position *const position)
+{
+    assert(data != NULL);
+
+    const struct iovec packet = {.iov_base = (void *)data, .iov_len = size};
+    return group_commit_append_batch(commits, &packet, 1, position);
+}
+
+/// Queues the packets (in order), and wakes the storage thread up if it sleeps.
+/// The last request is handed to `notifier` once committed (unless it's NULL, for a waiting writer).
+///
+static void push_requests(struct group_commit *const commits, struct commit_request *const requests,
+                          const struct iovec *const packets, const size_t count,
+                          struct commit_notifier *const notifier, void *const owner)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const bool last = (i == (count - 1));
+        requests[i].data = packets[i].iov_base;
+        requests[i].size = packets[i].iov_len;
+        requests[i].done = 0;
+        requests[i].failed = false;
+        requests[i].notifier = last ? notifier : NULL;
+        requests[i].owner = last ? owner : NULL;
+        queue_push(commits, &requests[i]);
+    }
+
+    if (__atomic_load_n(&commits->writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&commits->wakeups, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&commits->wakeups);
+    }
+}
+
+bool group_commit_append_batch(struct group_commit *const commits, const struct iovec *const packets,
+                               const size_t count, struct commit_position *const position)
+{
+    assert(commits != NULL);
+    assert(packets != NULL);
+    assert((count > 0) && (count <= GROUP_COMMIT_MAX_BATCH));
+
+    struct commit_request requests[GROUP_COMMIT_MAX_BATCH];
+    push_requests(commits, requests, packets, count, NULL, NULL);
+
+    // Requests are completed in the queue order, so the last one is done only after all others.
+    //
+    struct commit_request *const last = &requests[count - 1];
+    for (;;)
+    {
+        uint32_t state = __atomic_load_n(&last->done, __ATOMIC_ACQUIRE);
+        if (state == 1)
+        {
+            break;
+        }
+        if ((state == 2) || __atomic_compare_exchange_n(&last->done, &state, 2, false, __ATOMIC_ACQUIRE,
+                                                        __ATOMIC_ACQUIRE))
+        {
+            futex_wait(&last->done, 2);
+        }
+    }
+
+    return group_commit_result(requests, count, position);
+}
+
+void group_commit_submit(struct group_commit *const commits, struct commit_request *const requests,
+                         const struct iovec *const packets, const size_t count,
+                         struct commit_notifier *const notifier, void *const owner)
+{
+    assert(commits != NULL);
+    assert(requests != NULL);
+    assert(packets != NULL);
+    assert((count > 0) && (count <= GROUP_COMMIT_MAX_BATCH));
+    assert(notifier != NULL);
+
+    // The last request is completed after all others, so only that one is reported.
+    notifier->submitted++;
+    push_requests(commits, requests, packets, count, notifier, owner);
+}
+
+bool group_commit_result(const struct commit_request *const requests, const size_t count,
+                         struct commit_position *const position)
+{
+    assert(requests != NULL);
+    assert(count > 0);
+
+    bool failed = false;
+    for (size_t i = 0; i < count; ++i)
+    {
+        failed = failed || requests[i].failed;
+    }
+    if (position != NULL)
+    {
+        *position = requests[count - 1].position;
+    }
+    return !failed;
+}
+
+bool commit_notifier_init(struct commit_notifier *const notifier)
+{
+    assert(notifier != NULL);
+
+    notifier->completed = NULL;
+    notifier->submitted = 0;
+    notifier->signalled = 0;
+    notifier->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notifier->event_fd == -1)
+    {
+        syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void commit_notifier_destroy(struct commit_notifier *const notifier)
+{
+    assert(notifier != NULL);
+
+    // The storage thread signals after pushing, so it's done with the notifier once every append is signalled.
+    while (notifier->signalled < notifier->submitted)
+    {
+        commit_notifier_take(notifier, true);
+    }
+    close(notifier->event_fd);
+}
+
+struct commit_request *commit_notifier_take(struct commit_notifier *const notifier, const bool wait)
+{
+    assert(notifier != NULL);
+
+    for (;;)
+    {
+        uint64_t count = 0;
+        if (read(notifier->event_fd, &count, sizeof(count)) == sizeof(count))
+        {
+            notifier->signalled += count;
+        }
+
+        struct commit_request *const completed = __atomic_exchange_n(&notifier->completed, NULL, __ATOMIC_ACQUIRE);
+        if ((completed != NULL) || !wait || (notifier->signalled >= notifier->submitted))
+        {
+            return completed;
+        }
+
+        struct pollfd event = {.fd = notifier->event_fd, .events = POLLIN};
+        poll(&event, 1, -1);
+    }
+}
+
+struct commit_position group_commit_position(struct group_commit *const commits)
+{
+    assert(commits != NULL);
+
+    return commits->position;
+}
@@ -0,0 +1,184 @@
+#ifndef AESDSOCKET_GROUP_COMMIT_H
+#define AESDSOCKET_GROUP_COMMIT_H
+
+#include "segment_log.h"
+#include "store_snapshot.h"
+#include "subscription.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/// Maximum number of packets appended by a single `writev`.
+#define GROUP_COMMIT_MAX_BATCH 64
+
+/// When the file backend is flushed to the disk (`fdatasync`) after an append.
+enum fsync_policy
+{
+    FSYNC_NONE,         // leave it to the kernel
+    FSYNC_EVERY_PACKETS, // once at least `fsync_interval` packets were appended since the last sync
+    FSYNC_EVERY_MS,      // once at least `fsync_interval` milliseconds passed since the last sync
+};
+
+/// Position of a committed packet in the store.
+struct commit_position
+{
+    // Both count from the start of this server (or of its first predecessor, when the file backend log
+    // is inherited on a hot upgrade).
+    //
+    uint64_t sequence;   // 1-based number of the packet among all packets appended by this server
+    uint64_t end_offset; // number of bytes appended by this server up to (and including) the packet
+};
+
+struct commit_notifier;
+
+/// A packet waiting in the group commit queue (lives on the stack of its writer, or in its client
+/// when the append is asynchronous).
+struct commit_request
+{
+    const char *data;
+    size_t size;
+
+    uint32_t done; // futex word: 0 - queued, 1 - committed, 2 - queued and its writer sleeps
+    bool failed;
+    struct commit_position position;
+
+    struct commit_request *next;
+
+    // Set for the last request of an asynchronous append only: it's handed to `notifier` once committed
+    // (linked by `completed_next` there), rather than marked `done`.
+    //
+    struct commit_notifier *notifier;
+    void *owner;
+    struct commit_request *completed_next;
+};
+
+/// Where the storage thread reports the asynchronous appends of an event loop (see `group_commit_submit`).
+///
+/// The last request of each committed append is pushed to the lock-free `completed` stack, and `event_fd`
+/// (an eventfd, to be watched by the event loop) is signalled once per batch with the number of pushed requests.
+///
+struct commit_notifier
+{
+    int event_fd;
+    struct commit_request *completed;
+
+    // Only touched by the event loop: once `signalled` catches up with `submitted`, the storage thread
+    // is done with every append (and with the notifier).
+    //
+    uint64_t submitted;
+    uint64_t signalled;
+};
+
+/// Group commit of concurrent writers through a single storage thread.
+///
+/// Writers push their packets to a lock-free multi-producer/single-consumer queue, and wait for them
+/// (event loops get notified instead, see `commit_notifier`).
+/// The storage thread owns the store (the device, or the segmented log of the file backend): it takes the queued packets (up to `GROUP_COMMIT_MAX_BATCH`),
+/// appends them at once under the store write lock, publishes one snapshot for the whole batch,
+/// applies the fsync policy, and completes the packets in the queue order with their commit positions.
+/// So writers never touch the store write lock, and the append order is the queue order.
+///
+struct group_commit
+{
+    pthread_rwlock_t *store_lock;
+    struct snapshot_cache *snapshots;
+    struct subscription_hub *subscriptions; // NULL unless the committed packets are streamed
+
+    // Intrusive MPSC queue: writers exchange `tail`, the storage thread pops from `head`
+    // (`stub` keeps the queue non-empty, so pushing never needs a lock).
+    //
+    struct commit_request *tail;
+    struct commit_request *head;
+    struct commit_request stub;
+
+    // The storage thread sleeps on `wakeups` (a futex word bumped by writers) when the queue is empty.
+    //
+    uint32_t wakeups;
+    bool writer_sleeping;
+    bool stopping;
+    pthread_t writer;
+
+    // These are only touched by the storage thread.
+    //
+    int file_fd;             // the char device
+    struct segment_log *log; // the file backend
+    struct commit_position position; // also read by others under the store lock
+    enum fsync_policy fsync_policy;
+    unsigned long fsync_interval;
+    unsigned long packets_since_sync;
+    struct timespec last_sync;
+};
+
+/// Opens the store (the file backend log is set up by `log_config`), publishes its initial snapshot,
+/// and starts the storage thread. Every committed batch is also published to `subscriptions` (unless NULL).
+///
+/// `inherited` (unless NULL) is the state handed over by the predecessor process (see `group_commit_hand_over`):
+/// its file backend log is adopted then, rather than started empty. Returns false on failure.
+///
+bool group_commit_init(struct group_commit *commits, pthread_rwlock_t *store_lock, struct snapshot_cache *snapshots,
+                       enum fsync_policy fsync_policy, unsigned long fsync_interval,
+                       const struct segment_log_config *log_config, struct subscription_hub *subscriptions,
+                       const void *inherited, size_t inherited_size);
+
+/// Stops the storage thread (once no writer is left), and closes the store (the file backend log is removed).
+void group_commit_destroy(struct group_commit *commits);
+
+/// Stops the storage thread like `group_commit_destroy`, but keeps the file backend log for the successor process.
+/// Returns the state to pass to its `group_commit_init` (allocated with `malloc`, `*size` bytes), or NULL
+/// if there is nothing to hand over (the device backend) or on failure.
+///
+void *group_commit_hand_over(struct group_commit *commits, size_t *size);
+
+/// Appends the packet to the store, and waits until it is committed.
+///
+/// The packet memory must stay valid until the call returns.
+/// Returns false if the packet could not be written.
+///
+bool group_commit_append(struct group_commit *commits, const char *data, size_t size,
+                         struct commit_position *position);
+
+/// Appends several packets (up to `GROUP_COMMIT_MAX_BATCH`) one after another, and waits until all are committed.
+///
+/// The packets are queued together, so they go to the same batch unless the batch is already full.
+/// `position` is the one of the last packet. Returns false if any packet could not be written.
+///
+bool group_commit_append_batch(struct group_commit *commits, const struct iovec *packets, size_t count,
+                               struct commit_position *position);
+
+/// Appends several packets like `group_commit_append_batch`, but returns right away (for event loops).
+///
+/// Once all are committed, the last request (with `owner`) is handed to `notifier` (see `commit_notifier_take`),
+/// and `group_commit_result` tells how it went. Until then, the `count` requests and the packet memory
+/// must stay valid.
+///
+void group_commit_submit(struct group_commit *commits, struct commit_request *requests, const struct iovec *packets,
+                         size_t count, struct commit_notifier *notifier, void *owner);
+
+/// Returns false if any of the committed requests has failed; `position` (unless NULL) receives
+/// the one of the last request.
+///
+bool group_commit_result(const struct commit_request *requests, size_t count, struct commit_position *position);
+
+/// Creates the notifier (with a non-blocking eventfd). Returns false on failure.
+bool commit_notifier_init(struct commit_notifier *notifier);
+
+/// Waits for the appends still in flight (their completions are dropped), and closes the eventfd.
+void commit_notifier_destroy(struct commit_notifier *notifier);
+
+/// Takes the last requests of the appends completed so far (in no particular order, linked by `completed_next`),
+/// once `event_fd` got readable. With `wait`, blocks until there is any (unless nothing is in flight).
+/// Returns NULL if there is none.
+///
+struct commit_request *commit_notifier_take(struct commit_notifier *notifier, bool wait);
+
+/// Returns the position after the last committed batch.
+///
+/// Must be called with the store lock held (the leader advances the position under the write lock).
+///
+struct commit_position group_commit_position(struct group_commit *commits);
+
+#endif // AESDSOCKET_GROUP_COMMIT_H
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, sched_getaffinity
+
+#include "latency_profile.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+// Not in older C library headers.
+//
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static void set_option(const int fd, const int level, const int name, const int value, const char *const what)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+    {
+        syslog(LOG_WARNING, "setsockopt %s: %s", what, strerror(errno));
+    }
+}
+
+void latency_profile_tune_listener(const int sock_fd)
+{
+    assert(sock_fd >= 0);
+
+    // Raising the busy polling budget over `net.core.busy_read` takes CAP_NET_ADMIN.
+    set_option(sock_fd, SOL_SOCKET, SO_BUSY_POLL, LATENCY_PROFILE_BUSY_POLL_US, "SO_BUSY_POLL");
+    set_option(sock_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL");
+}
+
+void latency_profile_tune_peer(const int peer_fd)
+{
+    assert(peer_fd >= 0);
+
+    set_option(peer_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    set_option(peer_fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+}
+
+void latency_profile_quickack(const int peer_fd)
+{
+    set_option(peer_fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+}
+
+void latency_profile_cork(const int peer_fd, const bool cork)
+{
+    set_option(peer_fd, IPPROTO_TCP, TCP_CORK, cork ? 1 : 0, "TCP_CORK");
+}
+
+/// Adds the CPU to the rotation, unless the process may not run on it.
+static void add_cpu(struct cpu_rotation *const rotation, const cpu_set_t *const allowed, const long cpu)
+{
+    if ((cpu >= 0) && (cpu < CPU_SETSIZE) && (rotation->count < CPU_ROTATION_MAX_CPUS) && CPU_ISSET(cpu, allowed))
+    {
+        rotation->cpus[rotation->count++] = (int)cpu;
+    }
+}
+
+bool cpu_rotation_parse(struct cpu_rotation *const rotation, const char *const list)
+{
+    assert(rotation != NULL);
+    assert(list != NULL);
+
+    rotation->count = 0;
+    rotation->next = 0;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        syslog(LOG_ERR, "sched_getaffinity: %s", strerror(errno));
+        return false;
+    }
+
+    const char *p = list;
+    while (*p != '\0')
+    {
+        char *end = NULL;
+        const long first = strtol(p, &end, 10);
+        if ((end == p) || (first < 0))
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if ((end == (p + 1)) || (last < first))
+            {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); ++cpu)
+        {
+            add_cpu(rotation, &allowed, cpu);
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+        else if (*p != '\0')
+        {
+            return false;
+        }
+    }
+    return rotation->count > 0;
+}
+
+void cpu_rotation_allowed(struct cpu_rotation *const rotation)
+{
+    assert(rotation != NULL);
+
+    rotation->count = 0;
+    rotation->next = 0;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            add_cpu(rotation, &allowed, cpu);
+        }
+    }
+}
+
+int cpu_rotation_next(struct cpu_rotation *const rotation)
+{
+    assert(rotation != NULL);
+
+    if (rotation->count == 0)
+    {
+        return -1;
+    }
+    const size_t index = __atomic_fetch_add(&rotation->next, 1, __ATOMIC_RELAXED);
+    return rotation->cpus[index % rotation->count];
+}
+
+void pin_thread(const int cpu)
+{
+    if (cpu < 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (err != 0)
+    {
+        syslog(LOG_WARNING, "pthread_setaffinity_np: %s", strerror(err));
+    }
+}
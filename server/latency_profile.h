@@ -0,0 +1,63 @@
+#ifndef AESDSOCKET_LATENCY_PROFILE_H
+#define AESDSOCKET_LATENCY_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Busy polling budget of the sockets (microseconds) in the low-latency profile.
+#define LATENCY_PROFILE_BUSY_POLL_US 50
+
+/// Number of attempts to take the store lock by spinning, before blocking, in the low-latency profile.
+#define LATENCY_PROFILE_LOCK_SPIN 1000
+
+/// The low-latency profile trades CPU time for the tail latency on dedicated hosts:
+///
+/// - the sockets busy-poll the device queue for a while (`SO_BUSY_POLL`, `SO_PREFER_BUSY_POLL`)
+///   rather than sleeping until the interrupt;
+/// - the peer sockets send small replies right away (`TCP_NODELAY`), and acknowledge the received
+///   packets at once (`TCP_QUICKACK`, re-armed after every receive, as the kernel resets it);
+/// - replies longer than a single send are corked until complete (`TCP_CORK`), so the chunk boundaries
+///   don't push out partial segments;
+/// - a contended store lock is spun on before blocking (see `stats_rwlock_set_spin`).
+///
+/// Pinning of the engine threads (see `cpu_rotation`) is configured on its own, though it's usually part of it.
+///
+
+/// Sets up busy polling on the listening socket (the accepted sockets inherit it).
+void latency_profile_tune_listener(int sock_fd);
+
+/// Sets up an accepted socket.
+void latency_profile_tune_peer(int peer_fd);
+
+/// Re-arms the immediate acknowledgements after a receive.
+void latency_profile_quickack(int peer_fd);
+
+/// Corks (or uncorks, pushing out whatever is queued) the socket.
+void latency_profile_cork(int peer_fd, bool cork);
+
+/// Maximum number of CPUs in a rotation (the size of `cpu_set_t`).
+#define CPU_ROTATION_MAX_CPUS 1024
+
+/// CPUs the engine threads are pinned to, one after another (round robin).
+struct cpu_rotation
+{
+    int cpus[CPU_ROTATION_MAX_CPUS];
+    size_t count;
+    size_t next; // updated atomically
+};
+
+/// Parses a CPU list like `0,2-3` (only the CPUs the process may run on are taken). Returns false if it's not
+/// valid, or if none of its CPUs is available.
+///
+bool cpu_rotation_parse(struct cpu_rotation *rotation, const char *list);
+
+/// Takes all the CPUs the process may run on.
+void cpu_rotation_allowed(struct cpu_rotation *rotation);
+
+/// The CPU for the next thread (or -1 if there are none).
+int cpu_rotation_next(struct cpu_rotation *rotation);
+
+/// Pins the calling thread to the CPU (unless it's negative). Failures are only logged.
+void pin_thread(int cpu);
+
+#endif // AESDSOCKET_LATENCY_PROFILE_H
@@ -0,0 +1,149 @@
+#include "lz4_block.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+
+/// The last match must start at least this many bytes before the end of the block...
+#define LZ4_MF_LIMIT 12
+
+/// ...and the last bytes of the block are always literals.
+#define LZ4_LAST_LITERALS 5
+
+#define LZ4_HASH_BITS 12
+
+static inline uint32_t read32(const uint8_t *const p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(const uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/// Writes the continuation bytes of a length which didn't fit into its token nibble.
+static uint8_t *put_length(uint8_t *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/// Writes one sequence: the literals followed by the match (none for the last sequence of the block).
+/// Returns false if it doesn't fit.
+///
+static bool put_sequence(uint8_t **const op_ptr, const uint8_t *const oend, const uint8_t *const literals,
+                         const size_t literal_length, const size_t offset, const size_t match_length)
+{
+    uint8_t *op = *op_ptr;
+    size_t needed = 1 + ((literal_length / 255) + 1) + literal_length;
+    if (match_length > 0)
+    {
+        needed += 2 + ((match_length / 255) + 1);
+    }
+    if (needed > (size_t)(oend - op))
+    {
+        return false;
+    }
+
+    uint8_t *const token = op++;
+    *token = ((literal_length >= 15) ? 15 : literal_length) << 4;
+    if (literal_length >= 15)
+    {
+        op = put_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length > 0)
+    {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        const size_t extra = match_length - LZ4_MIN_MATCH;
+        *token |= (extra >= 15) ? 15 : extra;
+        if (extra >= 15)
+        {
+            op = put_length(op, extra - 15);
+        }
+    }
+
+    *op_ptr = op;
+    return true;
+}
+
+size_t lz4_compress_block(const char *const src, const size_t size, char *const dst, const size_t capacity)
+{
+    assert((src != NULL) || (size == 0));
+    assert(dst != NULL);
+
+    const uint8_t *const base = (const uint8_t *)src;
+    const uint8_t *const end = base + size;
+    const uint8_t *anchor = base;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *const oend = op + capacity;
+
+    if (size > LZ4_MF_LIMIT)
+    {
+        // Positions (from `base`) of the last 4-byte sequences seen, by their hash.
+        uint32_t table[1 << LZ4_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t *const match_start_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *const match_end_limit = end - LZ4_LAST_LITERALS;
+        const uint8_t *ip = base + 1;
+        while (ip <= match_start_limit)
+        {
+            const uint32_t sequence = read32(ip);
+            const uint32_t hash = hash32(sequence);
+            const uint8_t *ref = base + table[hash];
+            table[hash] = ip - base;
+            if ((ref >= ip) || ((ip - ref) > LZ4_MAX_OFFSET) || (read32(ref) != sequence))
+            {
+                // The longer nothing matches, the faster the scan skips ahead (over incompressible data).
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Extend the match backwards over the pending literals, and forwards as far as allowed.
+            //
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1]))
+            {
+                ip--;
+                ref--;
+            }
+            size_t match_length = LZ4_MIN_MATCH;
+            while (((ip + match_length) < match_end_limit) && (ip[match_length] == ref[match_length]))
+            {
+                match_length++;
+            }
+
+            if (!put_sequence(&op, oend, anchor, ip - anchor, ip - ref, match_length))
+            {
+                return 0;
+            }
+            ip += match_length;
+            anchor = ip;
+            if (ip <= match_start_limit)
+            {
+                table[hash32(read32(ip - 2))] = (ip - 2) - base;
+            }
+        }
+    }
+
+    if (!put_sequence(&op, oend, anchor, end - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,15 @@
+#ifndef AESDSOCKET_LZ4_BLOCK_H
+#define AESDSOCKET_LZ4_BLOCK_H
+
+#include <stddef.h>
+
+/// Compresses `size` bytes into a single LZ4 block (the raw block format, decodable by `LZ4_decompress_safe`).
+///
+/// A greedy single-pass matcher with a small hash table (the fast level of the reference implementation,
+/// without its acceleration tricks): repetitive text still shrinks several times, at a few hundred MB/s.
+/// Returns the compressed size, or 0 if it would not fit into `capacity` (the data is not compressible then,
+/// if `capacity` is below `size`).
+///
+size_t lz4_compress_block(const char *src, size_t size, char *dst, size_t capacity);
+
+#endif // AESDSOCKET_LZ4_BLOCK_H
@@ -0,0 +1,163 @@
+#include "newline_scan.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+typedef size_t (*newline_scan_fn)(const char *data, size_t size, size_t *offsets, size_t max_count,
+                                  size_t *scanned);
+
+static pthread_once_t g_select_once = PTHREAD_ONCE_INIT;
+static newline_scan_fn g_scan;
+static const char *g_scan_name;
+
+/// Fallback: `memchr` from one newline to the next.
+static size_t scan_scalar(const char *const data, const size_t size, size_t *const offsets, const size_t max_count,
+                          size_t *const scanned)
+{
+    size_t count = 0;
+    size_t position = 0;
+    while (position < size)
+    {
+        const char *const newline = memchr(data + position, '\n', size - position);
+        if (newline == NULL)
+        {
+            break;
+        }
+        offsets[count++] = newline - data;
+        position = (newline - data) + 1;
+        if (count == max_count)
+        {
+            *scanned = position;
+            return count;
+        }
+    }
+
+    *scanned = size;
+    return count;
+}
+
+#if HAVE_X86_SIMD
+
+/// Stores the offsets of the bits set in `mask` (the newlines of the block at `base`).
+/// Returns false once the offsets run out (`scanned` is set then).
+///
+static inline bool take_mask(uint32_t mask, const size_t base, size_t *const offsets, size_t *const count,
+                             const size_t max_count, size_t *const scanned)
+{
+    while (mask != 0)
+    {
+        const size_t offset = base + __builtin_ctz(mask);
+        offsets[(*count)++] = offset;
+        mask &= mask - 1;
+        if (*count == max_count)
+        {
+            *scanned = offset + 1;
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Compares 16 bytes at a time; the tail is left to the scalar scan.
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *const data, const size_t size,
+                                                        size_t *const offsets, const size_t max_count,
+                                                        size_t *const scanned)
+{
+    const __m128i newlines = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t position = 0;
+    for (; (position + 16) <= size; position += 16)
+    {
+        const __m128i block = _mm_loadu_si128((const __m128i *)(data + position));
+        const uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+        if (!take_mask(mask, position, offsets, &count, max_count, scanned))
+        {
+            return count;
+        }
+    }
+
+    const size_t tail_count =
+        scan_scalar(data + position, size - position, offsets + count, max_count - count, scanned);
+    for (size_t i = count; i < (count + tail_count); ++i)
+    {
+        offsets[i] += position;
+    }
+    *scanned += position;
+    return count + tail_count;
+}
+
+/// Compares 32 bytes at a time; the tail is left to the SSE2 scan.
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *const data, const size_t size,
+                                                        size_t *const offsets, const size_t max_count,
+                                                        size_t *const scanned)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t position = 0;
+    for (; (position + 32) <= size; position += 32)
+    {
+        const __m256i block = _mm256_loadu_si256((const __m256i *)(data + position));
+        const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newlines));
+        if (!take_mask(mask, position, offsets, &count, max_count, scanned))
+        {
+            return count;
+        }
+    }
+
+    const size_t tail_count = scan_sse2(data + position, size - position, offsets + count, max_count - count, scanned);
+    for (size_t i = count; i < (count + tail_count); ++i)
+    {
+        offsets[i] += position;
+    }
+    *scanned += position;
+    return count + tail_count;
+}
+
+#endif // HAVE_X86_SIMD
+
+static void select_scan(void)
+{
+    g_scan = scan_scalar;
+    g_scan_name = "scalar";
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        g_scan = scan_avx2;
+        g_scan_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        g_scan = scan_sse2;
+        g_scan_name = "sse2";
+    }
+#endif
+}
+
+size_t newline_scan(const char *const data, const size_t size, size_t *const offsets, const size_t max_count,
+                    size_t *const scanned)
+{
+    assert((data != NULL) || (size == 0));
+    assert(offsets != NULL);
+    assert(max_count > 0);
+    assert(scanned != NULL);
+
+    pthread_once(&g_select_once, select_scan);
+    return g_scan(data, size, offsets, max_count, scanned);
+}
+
+const char *newline_scan_implementation(void)
+{
+    pthread_once(&g_select_once, select_scan);
+    return g_scan_name;
+}
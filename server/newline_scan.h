@@ -0,0 +1,18 @@
+#ifndef AESDSOCKET_NEWLINE_SCAN_H
+#define AESDSOCKET_NEWLINE_SCAN_H
+
+#include <stddef.h>
+
+/// Finds the newlines in `data[0, size)` in a single pass, and stores their offsets (in order).
+///
+/// Stops early once `max_count` offsets are found; `scanned` receives the number of leading bytes
+/// whose newlines are all reported (`size`, unless the offsets ran out). Returns the number of offsets.
+///
+/// The implementation (AVX2, SSE2, or scalar) is selected by the CPU features on the first call.
+///
+size_t newline_scan(const char *data, size_t size, size_t *offsets, size_t max_count, size_t *scanned);
+
+/// Name of the selected implementation (for the logs).
+const char *newline_scan_implementation(void);
+
+#endif // AESDSOCKET_NEWLINE_SCAN_H
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE // O_TMPFILE
+
+#include "packet_spill.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void packet_spill_init(struct packet_spill *const spill)
+{
+    assert(spill != NULL);
+
+    spill->fd = -1;
+    spill->size = 0;
+    spill->map = NULL;
+}
+
+/// Creates an anonymous file in `PACKET_SPILL_DIR`: unnamed from the start if the file system supports it,
+/// or unlinked right after creation otherwise. Returns -1 on failure.
+///
+static int create_file()
+{
+    int fd = open(PACKET_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+
+    char path[] = PACKET_SPILL_DIR "/aesdsocket-spill.XXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "mkostemp '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+bool packet_spill_append(struct packet_spill *const spill, const char *data, size_t size)
+{
+    assert(spill != NULL);
+    assert(spill->map == NULL);
+
+    if (spill->fd < 0)
+    {
+        spill->fd = create_file();
+        if (spill->fd < 0)
+        {
+            return false;
+        }
+        spill->size = 0;
+    }
+
+    while (size > 0)
+    {
+        const ssize_t bytes_written = write(spill->fd, data, size);
+        if (bytes_written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "write spill file: %s", strerror(errno));
+            return false;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+        spill->size += bytes_written;
+    }
+    return true;
+}
+
+char *packet_spill_map(struct packet_spill *const spill, size_t *const size)
+{
+    assert(spill != NULL);
+    assert(packet_spill_active(spill));
+    assert(size != NULL);
+
+    if (spill->map == NULL)
+    {
+        // Private mapping: the packet is parsed in place (see `parse_command`), which must not touch the file.
+        void *const map = mmap(NULL, spill->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, spill->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            syslog(LOG_ERR, "mmap spill file: %s", strerror(errno));
+            return NULL;
+        }
+        spill->map = map;
+    }
+    *size = spill->size;
+    return spill->map;
+}
+
+void packet_spill_release(struct packet_spill *const spill)
+{
+    assert(spill != NULL);
+
+    if (spill->map != NULL)
+    {
+        munmap(spill->map, spill->size);
+    }
+    if (spill->fd >= 0)
+    {
+        close(spill->fd);
+    }
+    packet_spill_init(spill);
+}
@@ -0,0 +1,60 @@
+#ifndef AESDSOCKET_PACKET_SPILL_H
+#define AESDSOCKET_PACKET_SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Where the spill files are created (they are unlinked right away, so nothing is left behind).
+#define PACKET_SPILL_DIR "/var/tmp"
+
+/// Received bytes of a spilled packet are moved to its file in chunks of at least this size.
+#define PACKET_SPILL_CHUNK (64 * 1024)
+
+/// Default length of an unterminated packet a connection could keep in memory.
+#define PACKET_SPILL_DEFAULT_THRESHOLD (1024 * 1024)
+
+/// Default size of the grown receive buffers of all connections together, beyond which every unterminated
+/// packet longer than the base block is spilled.
+///
+#define PACKET_SPILL_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+/// An unterminated text packet too long to be kept in memory.
+///
+/// Its head is moved from the receive buffer to an anonymous temporary file, and the rest follows as it's
+/// received, so the connection only keeps a bounded tail in memory. Once the terminating newline arrives,
+/// the whole packet is mapped from the file (page cache rather than heap) and appended to the store from there.
+///
+struct packet_spill
+{
+    int fd; // -1 unless spilling
+    size_t size;
+    char *map; // the mapped packet (NULL unless mapped)
+};
+
+void packet_spill_init(struct packet_spill *spill);
+
+static inline bool packet_spill_active(const struct packet_spill *const spill)
+{
+    return spill->fd >= 0;
+}
+
+/// Whether the spilled packet is complete (and mapped), so nothing more may be appended to it.
+static inline bool packet_spill_mapped(const struct packet_spill *const spill)
+{
+    return spill->map != NULL;
+}
+
+/// Appends the data to the spilled packet (creating its file first, unless spilling already).
+/// Returns false on failure.
+///
+bool packet_spill_append(struct packet_spill *spill, const char *data, size_t size);
+
+/// Maps the whole spilled packet; it stays valid (and writable, privately) until `packet_spill_release`.
+/// Returns NULL on failure.
+///
+char *packet_spill_map(struct packet_spill *spill, size_t *size);
+
+/// Unmaps and closes the file (if any), so the spill is inactive again.
+void packet_spill_release(struct packet_spill *spill);
+
+#endif // AESDSOCKET_PACKET_SPILL_H
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE // accept4
+
+#include "reactor.h"
+#include "async_log.h"
+#include "client_flow.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REACTOR_MAX_EVENTS 256
+
+TAILQ_HEAD(reactor_clients_s, client_info);
+
+struct reactor
+{
+    int epoll_fd;
+    int server_sock_fd;
+    struct shared_info *shared;
+    struct commit_notifier notifier; // the appends are asynchronous, so the loop never waits for the storage
+    struct reactor_clients_s clients;
+};
+
+static void close_client(struct reactor *const reactor, struct client_info *const client)
+{
+    assert(reactor != NULL);
+    assert(client != NULL);
+
+    async_log(LOG_DEBUG, "Closing client (peer_fd=%d).", client->peer_fd);
+
+    // Closing the descriptor also removes it from the epoll set.
+    TAILQ_REMOVE(&reactor->clients, client, nodes);
+    client_info_destroy(client);
+}
+
+static void advance_client(struct reactor *const reactor, struct client_info *const client)
+{
+    assert(reactor != NULL);
+    assert(client != NULL);
+
+    const enum client_state state = client_advance(client);
+    if (state == CLIENT_HANDOFF)
+    {
+        // The descriptor stays open (in the hub), so it has to leave the epoll set explicitly.
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->peer_fd, NULL) == -1)
+        {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+        }
+        client_hand_off(client);
+        close_client(reactor, client);
+    }
+    else if (state == CLIENT_DONE)
+    {
+        close_client(reactor, client);
+    }
+}
+
+/// Resumes the clients whose appends the storage thread has committed.
+static void complete_commits(struct reactor *const reactor)
+{
+    struct commit_request *request = commit_notifier_take(&reactor->notifier, false);
+    while (request != NULL)
+    {
+        // The next append of the client could reuse the request.
+        struct commit_request *const next = request->completed_next;
+        struct client_info *const client = request->owner;
+        client_complete_commit(client);
+        advance_client(reactor, client);
+        request = next;
+    }
+}
+
+static void accept_clients(struct reactor *const reactor)
+{
+    assert(reactor != NULL);
+
+    // Edge-triggered listening socket has to be drained until it would block.
+    //
+    for (;;)
+    {
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addrlen = sizeof(peer_addr);
+        const int peer_fd = accept4(reactor->server_sock_fd, (struct sockaddr *)&peer_addr, &peer_addrlen,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (peer_fd == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                syslog(LOG_WARNING, "accept4: %s", strerror(errno));
+            }
+            return;
+        }
+
+        async_log_peer(LOG_INFO, "Accepted connection from", (struct sockaddr *)&peer_addr, peer_addrlen, peer_fd);
+
+        struct client_info *const client = client_info_create(reactor->shared, peer_fd);
+        if (client == NULL)
+        {
+            close(peer_fd);
+            continue;
+        }
+        client->notifier = &reactor->notifier;
+
+        // Both directions are registered once, so no `EPOLL_CTL_MOD` is ever needed:
+        // the client state machine itself knows which direction it is waiting for.
+        //
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = client;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, peer_fd, &event) == -1)
+        {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+            client_info_destroy(client);
+            continue;
+        }
+        TAILQ_INSERT_TAIL(&reactor->clients, client, nodes);
+
+        // There might be data already, and we won't get an edge for it.
+        advance_client(reactor, client);
+    }
+}
+
+void reactor_run(const int server_sock_fd, struct shared_info *const shared, volatile sig_atomic_t *const running)
+{
+    assert(server_sock_fd >= 0);
+    assert(shared != NULL);
+    assert(running != NULL);
+
+    struct reactor reactor;
+    reactor.server_sock_fd = server_sock_fd;
+    reactor.shared = shared;
+    TAILQ_INIT(&reactor.clients);
+
+    const int flags = fcntl(server_sock_fd, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(server_sock_fd, F_SETFL, flags | O_NONBLOCK) == -1))
+    {
+        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+        return;
+    }
+
+    reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epoll_fd == -1)
+    {
+        syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+        return;
+    }
+
+    if (!commit_notifier_init(&reactor.notifier))
+    {
+        close(reactor.epoll_fd);
+        return;
+    }
+
+    // The listening socket is the only one registered with NULL pointer, and the notifier with its own.
+    //
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    struct epoll_event notifier_event;
+    memset(&notifier_event, 0, sizeof(notifier_event));
+    notifier_event.events = EPOLLIN | EPOLLET;
+    notifier_event.data.ptr = &reactor.notifier;
+    if ((epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, server_sock_fd, &event) == -1) ||
+        (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.notifier.event_fd, &notifier_event) == -1))
+    {
+        syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+        commit_notifier_destroy(&reactor.notifier);
+        close(reactor.epoll_fd);
+        return;
+    }
+
+    // The main loop.
+    //
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (*running != SERVER_STOPPED)
+    {
+        // While draining it keeps accepting, until it's idle (what is left in the backlog is the successor's).
+        if ((*running == SERVER_DRAINING) && TAILQ_EMPTY(&reactor.clients) && clients_idle(shared))
+        {
+            break;
+        }
+
+        const int events_count = epoll_wait(reactor.epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (events_count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        // The committed clients are resumed after the batch, as resuming could close a client
+        // which still has an event in it.
+        //
+        bool committed = false;
+        for (int i = 0; i < events_count; ++i)
+        {
+            struct client_info *const client = events[i].data.ptr;
+            if (client == NULL)
+            {
+                accept_clients(&reactor);
+            }
+            else if (events[i].data.ptr == &reactor.notifier)
+            {
+                committed = true;
+            }
+            else
+            {
+                advance_client(&reactor, client);
+            }
+        }
+        if (committed)
+        {
+            complete_commits(&reactor);
+        }
+    }
+
+    // The requests of the appends still in flight live in their clients.
+    commit_notifier_destroy(&reactor.notifier);
+
+    struct client_info *client = NULL;
+    struct client_info *next = NULL;
+    TAILQ_FOREACH_SAFE(client, &reactor.clients, nodes, next)
+    {
+        close_client(&reactor, client);
+    }
+    assert(TAILQ_EMPTY(&reactor.clients));
+
+    close(reactor.epoll_fd);
+}
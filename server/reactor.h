@@ -0,0 +1,19 @@
+#ifndef AESDSOCKET_REACTOR_H
+#define AESDSOCKET_REACTOR_H
+
+#include "client_flow.h"
+
+#include <signal.h>
+
+/// Serves all clients of the listening socket from the calling thread.
+///
+/// The listening socket and all peer sockets are non-blocking and registered
+/// in a single edge-triggered epoll set. Each peer is driven by `client_advance`
+/// whenever its socket becomes readable or writable, or once its append is committed
+/// (the storage thread signals the eventfd of a `commit_notifier`, which is in the same set).
+/// Returns when `running` is reset (by a signal), once no client is served any more (see `clients_idle`)
+/// after it turned `SERVER_DRAINING`, or on a fatal epoll error.
+///
+void reactor_run(int server_sock_fd, struct shared_info *shared, volatile sig_atomic_t *running);
+
+#endif // AESDSOCKET_REACTOR_H
@@ -0,0 +1,379 @@
+#include "recv_buffer.h"
+#include "newline_scan.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Free block in a thread cache.
+struct free_block
+{
+    struct free_block *next;
+};
+
+/// Per-thread cache of free `BUFFER_SIZE` blocks.
+struct block_pool
+{
+    struct free_block *free_list;
+    struct recv_buffer_pool_stats stats;
+
+    LIST_ENTRY(block_pool) nodes;
+};
+
+static __thread struct block_pool *tls_pool = NULL;
+
+static pthread_key_t g_pool_key;
+static pthread_once_t g_pool_key_once = PTHREAD_ONCE_INIT;
+
+// All live pools (for the statistics), and the statistics of pools of already finished threads.
+//
+static pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(block_pools_s, block_pool) g_pools = LIST_HEAD_INITIALIZER(g_pools);
+static struct recv_buffer_pool_stats g_retired_stats;
+
+// Blocks left by the finished threads to the new ones, so that short-lived threads (e.g. the thread-per-client
+// engine runs every connection on a new one) don't start with an empty cache every time.
+//
+static struct free_block *g_shared_blocks = NULL; // under `g_pools_lock`
+static size_t g_shared_cached = 0;                // written under `g_pools_lock`
+
+// Storage of the buffers grown beyond the base block, of all threads (the base blocks are bounded
+// by the number of connections anyway).
+//
+static size_t g_grown_bytes = 0;
+
+static void add_stats(struct recv_buffer_pool_stats *const total, const struct recv_buffer_pool_stats *const stats)
+{
+    total->hits += stats->hits;
+    total->misses += stats->misses;
+    total->trimmed += stats->trimmed;
+    total->cached += stats->cached;
+    if (total->high_water < stats->high_water)
+    {
+        total->high_water = stats->high_water;
+    }
+}
+
+/// Called on thread exit to leave its cached blocks to the new threads (or return them to the heap).
+static void destroy_pool(void *const arg)
+{
+    struct block_pool *const pool = arg;
+
+    struct free_block *block = pool->free_list;
+    pthread_mutex_lock(&g_pools_lock);
+    {
+        size_t shared = g_shared_cached;
+        while ((block != NULL) && (shared < RECV_BUFFER_SHARED_MAX_CACHED))
+        {
+            struct free_block *next = block->next;
+            block->next = g_shared_blocks;
+            g_shared_blocks = block;
+            shared++;
+            pool->stats.cached--;
+            block = next;
+        }
+        __atomic_store_n(&g_shared_cached, shared, __ATOMIC_RELAXED);
+
+        LIST_REMOVE(pool, nodes);
+        pool->stats.trimmed += pool->stats.cached;
+        pool->stats.cached = 0;
+        add_stats(&g_retired_stats, &pool->stats);
+    }
+    pthread_mutex_unlock(&g_pools_lock);
+
+    while (block != NULL)
+    {
+        struct free_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(pool);
+}
+
+static void create_pool_key()
+{
+    pthread_key_create(&g_pool_key, destroy_pool);
+}
+
+/// Gets (lazily creating) the pool of the calling thread. Returns NULL if it can't be allocated.
+static struct block_pool *get_pool()
+{
+    struct block_pool *pool = tls_pool;
+    if (pool == NULL)
+    {
+        pthread_once(&g_pool_key_once, create_pool_key);
+
+        pool = malloc(sizeof(struct block_pool));
+        if (pool != NULL)
+        {
+            memset(pool, 0, sizeof(struct block_pool));
+            pool->free_list = NULL;
+
+            pthread_mutex_lock(&g_pools_lock);
+            LIST_INSERT_HEAD(&g_pools, pool, nodes);
+            pthread_mutex_unlock(&g_pools_lock);
+
+            pthread_setspecific(g_pool_key, pool);
+            tls_pool = pool;
+        }
+    }
+    return pool;
+}
+
+/// Takes a block left by a finished thread, or returns NULL.
+static char *take_shared_block()
+{
+    if (__atomic_load_n(&g_shared_cached, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL; // the common case of long-lived threads, without the lock
+    }
+
+    struct free_block *block = NULL;
+    pthread_mutex_lock(&g_pools_lock);
+    if (g_shared_blocks != NULL)
+    {
+        block = g_shared_blocks;
+        g_shared_blocks = block->next;
+        __atomic_store_n(&g_shared_cached, g_shared_cached - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&g_pools_lock);
+    return (char *)block;
+}
+
+static char *block_alloc()
+{
+    struct block_pool *const pool = get_pool();
+    if ((pool != NULL) && (pool->free_list != NULL))
+    {
+        struct free_block *const block = pool->free_list;
+        pool->free_list = block->next;
+        pool->stats.cached--;
+        pool->stats.hits++;
+        return (char *)block;
+    }
+
+    if (pool != NULL)
+    {
+        char *const shared = take_shared_block();
+        if (shared != NULL)
+        {
+            pool->stats.hits++;
+            return shared;
+        }
+        pool->stats.misses++;
+    }
+    return malloc(BUFFER_SIZE);
+}
+
+static void block_free(char *const data)
+{
+    struct block_pool *const pool = get_pool();
+    if ((pool != NULL) && (pool->stats.cached < RECV_BUFFER_POOL_MAX_CACHED))
+    {
+        struct free_block *const block = (struct free_block *)data;
+        block->next = pool->free_list;
+        pool->free_list = block;
+        pool->stats.cached++;
+        if (pool->stats.high_water < pool->stats.cached)
+        {
+            pool->stats.high_water = pool->stats.cached;
+        }
+    }
+    else
+    {
+        free(data);
+        if (pool != NULL)
+        {
+            pool->stats.trimmed++;
+        }
+    }
+}
+
+void recv_buffer_init(struct recv_buffer *const buffer)
+{
+    assert(buffer != NULL);
+
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->begin = 0;
+    buffer->scanned = 0;
+    buffer->end = 0;
+    buffer->newline_first = 0;
+    buffer->newline_count = 0;
+}
+
+void recv_buffer_release(struct recv_buffer *const buffer)
+{
+    assert(buffer != NULL);
+
+    if (buffer->data != NULL)
+    {
+        if (buffer->capacity == BUFFER_SIZE)
+        {
+            block_free(buffer->data);
+        }
+        else
+        {
+            free(buffer->data);
+            __atomic_sub_fetch(&g_grown_bytes, buffer->capacity, __ATOMIC_RELAXED);
+        }
+    }
+    recv_buffer_init(buffer);
+}
+
+bool recv_buffer_reserve(struct recv_buffer *const buffer, const size_t min_free)
+{
+    assert(buffer != NULL);
+
+    if (buffer->data == NULL)
+    {
+        buffer->data = block_alloc();
+        if (buffer->data == NULL)
+        {
+            return false;
+        }
+        buffer->capacity = BUFFER_SIZE;
+    }
+
+    if ((buffer->capacity - buffer->end) >= min_free)
+    {
+        return true;
+    }
+
+    // Lazy compaction: the consumed head is reclaimed only now, when the space is really needed.
+    //
+    const size_t pending = buffer->end - buffer->begin;
+    if (buffer->begin > 0)
+    {
+        for (size_t i = buffer->newline_first; i < (buffer->newline_first + buffer->newline_count); ++i)
+        {
+            buffer->newlines[i] -= buffer->begin;
+        }
+        memmove(buffer->data, buffer->data + buffer->begin, pending);
+        buffer->begin = 0;
+        buffer->end = pending;
+        if ((buffer->capacity - buffer->end) >= min_free)
+        {
+            return true;
+        }
+    }
+
+    // Still not enough - the packet is longer than the buffer, so grow it geometrically.
+    //
+    size_t new_capacity = buffer->capacity * 2;
+    while ((new_capacity - pending) < min_free)
+    {
+        new_capacity *= 2;
+    }
+    char *new_data;
+    if (buffer->capacity == BUFFER_SIZE)
+    {
+        new_data = malloc(new_capacity);
+        if (new_data != NULL)
+        {
+            memcpy(new_data, buffer->data, pending);
+            block_free(buffer->data);
+        }
+    }
+    else
+    {
+        new_data = realloc(buffer->data, new_capacity);
+    }
+    if (new_data == NULL)
+    {
+        return false;
+    }
+
+    __atomic_add_fetch(&g_grown_bytes, new_capacity - ((buffer->capacity == BUFFER_SIZE) ? 0 : buffer->capacity),
+                       __ATOMIC_RELAXED);
+    buffer->data = new_data;
+    buffer->capacity = new_capacity;
+    return true;
+}
+
+char *recv_buffer_next_line(struct recv_buffer *const buffer, size_t *const size)
+{
+    assert(buffer != NULL);
+    assert(size != NULL);
+    assert(buffer->begin + buffer->scanned <= buffer->end);
+
+    if (buffer->data == NULL)
+    {
+        return NULL;
+    }
+
+    if (buffer->newline_count == 0)
+    {
+        // Index all the lines received so far in one pass (the bytes already scanned are not scanned again).
+        //
+        const size_t scan_begin = buffer->begin + buffer->scanned;
+        size_t scanned = 0;
+        buffer->newline_first = 0;
+        buffer->newline_count = newline_scan(buffer->data + scan_begin, buffer->end - scan_begin, buffer->newlines,
+                                             RECV_BUFFER_MAX_NEWLINES, &scanned);
+        for (size_t i = 0; i < buffer->newline_count; ++i)
+        {
+            buffer->newlines[i] += scan_begin;
+        }
+        buffer->scanned += scanned;
+        if (buffer->newline_count == 0)
+        {
+            return NULL;
+        }
+    }
+
+    char *const packet = buffer->data + buffer->begin;
+    *size = buffer->newlines[buffer->newline_first] - buffer->begin + 1; // including \n
+    recv_buffer_consume(buffer, *size);
+    return packet;
+}
+
+void recv_buffer_consume(struct recv_buffer *const buffer, const size_t size)
+{
+    assert(buffer != NULL);
+    assert(size <= (buffer->end - buffer->begin));
+
+    buffer->begin += size;
+    buffer->scanned = (buffer->scanned > size) ? (buffer->scanned - size) : 0;
+    while ((buffer->newline_count > 0) && (buffer->newlines[buffer->newline_first] < buffer->begin))
+    {
+        buffer->newline_first++;
+        buffer->newline_count--;
+    }
+    if (buffer->begin == buffer->end)
+    {
+        // Everything is consumed, so the buffer is "compacted" for free.
+        buffer->begin = 0;
+        buffer->end = 0;
+        buffer->newline_count = 0;
+    }
+}
+
+size_t recv_buffer_grown_bytes()
+{
+    return __atomic_load_n(&g_grown_bytes, __ATOMIC_RELAXED);
+}
+
+void recv_buffer_pool_stats(struct recv_buffer_pool_stats *const stats)
+{
+    memset(stats, 0, sizeof(struct recv_buffer_pool_stats));
+
+    pthread_mutex_lock(&g_pools_lock);
+    {
+        // Counters of live pools are read without their threads' cooperation,
+        // so they could be slightly behind - good enough for statistics.
+        //
+        add_stats(stats, &g_retired_stats);
+        stats->cached += g_shared_cached;
+
+        struct block_pool *pool;
+        LIST_FOREACH(pool, &g_pools, nodes)
+        {
+            add_stats(stats, &pool->stats);
+        }
+    }
+    pthread_mutex_unlock(&g_pools_lock);
+    stats->grown_bytes = recv_buffer_grown_bytes();
+}
@@ -0,0 +1,118 @@
+#ifndef AESDSOCKET_RECV_BUFFER_H
+#define AESDSOCKET_RECV_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUFFER_SIZE 4096
+
+/// The minimum free space worth passing to `recv`.
+#define RECV_BUFFER_MIN_FREE (BUFFER_SIZE / 4)
+
+/// Maximum number of free `BUFFER_SIZE` blocks cached by a thread (the rest goes back to the heap).
+#define RECV_BUFFER_POOL_MAX_CACHED 64
+
+/// Maximum number of free blocks which finished threads leave to the new ones (the rest goes back to the heap).
+#define RECV_BUFFER_SHARED_MAX_CACHED 256
+
+/// Maximum number of line boundaries found by a single scan.
+#define RECV_BUFFER_MAX_NEWLINES 64
+
+/// Contiguous per-connection receive buffer.
+///
+/// Received bytes are appended at `end`; complete lines are consumed from `begin` in place
+/// (no copying), so the buffer only holds the current (not yet terminated) packet plus whatever
+/// was received after it. The storage starts with a pooled `BUFFER_SIZE` block, grows geometrically
+/// for long packets, and is compacted (moved to the front) only when there is not enough free space at the end.
+///
+/// Newlines are found by scanning all the received data at once (see `newline_scan`), and the found
+/// line boundaries are then consumed one by one without scanning again.
+///
+struct recv_buffer
+{
+    char *data;
+    size_t capacity;
+    size_t begin;   // start of the current packet
+    size_t scanned; // bytes after `begin` whose newlines are all in `newlines` already
+    size_t end;     // end of the received data
+
+    // Offsets (from `data`) of the newlines found but not consumed yet.
+    //
+    size_t newlines[RECV_BUFFER_MAX_NEWLINES];
+    size_t newline_first;
+    size_t newline_count;
+};
+
+/// Statistics of the block pools (summed over all threads, including already finished ones).
+struct recv_buffer_pool_stats
+{
+    size_t hits;        // blocks served from a thread cache (or the one left by finished threads)
+    size_t misses;      // blocks which had to be allocated from the heap
+    size_t trimmed;     // blocks freed to the heap b/c the thread cache (or the shared one) was full
+    size_t cached;      // blocks currently sitting in thread caches and the shared one
+    size_t high_water;  // the maximum number of blocks ever cached by a single thread
+    size_t grown_bytes; // currently held by the buffers grown beyond the base block (see `recv_buffer_grown_bytes`)
+};
+
+void recv_buffer_init(struct recv_buffer *buffer);
+
+/// Releases the storage (the base block goes back to the calling thread's cache). Pending data is dropped.
+void recv_buffer_release(struct recv_buffer *buffer);
+
+/// Makes sure there are at least `min_free` bytes of free space after `end`.
+///
+/// `min_free` could exceed `BUFFER_SIZE` when the size of the rest of the packet is known up front
+/// (binary frames), so the storage grows at once rather than step by step while receiving.
+/// Returns false if the storage can't be allocated.
+///
+bool recv_buffer_reserve(struct recv_buffer *buffer, size_t min_free);
+
+/// Finds the next complete (newline terminated) packet, and consumes it.
+///
+/// Returns a pointer to the packet inside the buffer (valid until the next `recv_buffer_reserve`),
+/// or NULL if there is no complete packet yet.
+///
+char *recv_buffer_next_line(struct recv_buffer *buffer, size_t *size);
+
+/// Consumes `size` bytes at the head (which must be already received).
+///
+/// Same as for `recv_buffer_next_line`, the consumed bytes stay valid until the next `recv_buffer_reserve`.
+///
+void recv_buffer_consume(struct recv_buffer *buffer, size_t size);
+
+/// The first received byte which is not consumed yet.
+static inline char *recv_buffer_head(const struct recv_buffer *const buffer)
+{
+    return buffer->data + buffer->begin;
+}
+
+/// Free space where the next `recv` should store the data.
+static inline char *recv_buffer_tail(const struct recv_buffer *const buffer)
+{
+    return buffer->data + buffer->end;
+}
+
+static inline size_t recv_buffer_space(const struct recv_buffer *const buffer)
+{
+    return buffer->capacity - buffer->end;
+}
+
+/// Accounts `size` bytes just received into the tail.
+static inline void recv_buffer_commit(struct recv_buffer *const buffer, const size_t size)
+{
+    buffer->end += size;
+}
+
+/// Number of received bytes which are not consumed yet.
+static inline size_t recv_buffer_pending(const struct recv_buffer *const buffer)
+{
+    return buffer->end - buffer->begin;
+}
+
+/// Total storage currently held by the buffers grown beyond the base block (by long packets), of all threads.
+size_t recv_buffer_grown_bytes(void);
+
+/// Collects the statistics of all block pools.
+void recv_buffer_pool_stats(struct recv_buffer_pool_stats *stats);
+
+#endif // AESDSOCKET_RECV_BUFFER_H
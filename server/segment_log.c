@@ -0,0 +1,749 @@
+#include "segment_log.h"
+#include "async_log.h"
+#include "newline_scan.h"
+#include "store_snapshot.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Maximum number of packets written by a single `pwritev`.
+#define SEGMENT_LOG_MAX_IOV 64
+
+/// Number of digits of the base offset in the segment file names.
+#define SEGMENT_NAME_DIGITS 20
+
+static char *segment_path(const char *const prefix, const uint64_t base)
+{
+    const size_t size = strlen(prefix) + 1 + SEGMENT_NAME_DIGITS + 1;
+    char *const path = malloc(size);
+    if (path == NULL)
+    {
+        syslog(LOG_ERR, "malloc segment path: %s", strerror(errno));
+        return NULL;
+    }
+    snprintf(path, size, "%s.%0*" PRIu64, prefix, SEGMENT_NAME_DIGITS, base);
+    return path;
+}
+
+/// Removes the segments left by a previous run (the server starts with an empty store).
+static void remove_stale_segments(const char *const prefix)
+{
+    const char *const slash = strrchr(prefix, '/');
+    const char *const name = (slash != NULL) ? (slash + 1) : prefix;
+    const size_t name_length = strlen(name);
+
+    char directory[4096];
+    if (slash == NULL)
+    {
+        strcpy(directory, ".");
+    }
+    else
+    {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - prefix), prefix);
+    }
+
+    DIR *const dir = opendir((directory[0] != '\0') ? directory : "/");
+    if (dir == NULL)
+    {
+        return;
+    }
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
+    {
+        const char *const suffix = entry->d_name + name_length;
+        if ((strncmp(entry->d_name, name, name_length) != 0) || (suffix[0] != '.') ||
+            (strlen(suffix + 1) != SEGMENT_NAME_DIGITS) || (strspn(suffix + 1, "0123456789") != SEGMENT_NAME_DIGITS))
+        {
+            continue;
+        }
+        if (unlinkat(dirfd(dir), entry->d_name, 0) == -1)
+        {
+            syslog(LOG_ERR, "unlink '%s': %s", entry->d_name, strerror(errno));
+        }
+    }
+    closedir(dir);
+}
+
+struct segment_log *segment_log_create(const char *const prefix, const struct segment_log_config *const config)
+{
+    assert(prefix != NULL);
+    assert(config != NULL);
+    assert(config->segment_size > 0);
+
+    struct segment_log *const log = calloc(1, sizeof(struct segment_log));
+    if (log == NULL)
+    {
+        syslog(LOG_ERR, "malloc `segment_log`: %s", strerror(errno));
+        return NULL;
+    }
+    log->prefix = strdup(prefix);
+    if (log->prefix == NULL)
+    {
+        syslog(LOG_ERR, "malloc segment prefix: %s", strerror(errno));
+        free(log);
+        return NULL;
+    }
+    log->config = *config;
+    pthread_mutex_init(&log->lock, NULL);
+    TAILQ_INIT(&log->segments);
+
+    remove_stale_segments(prefix);
+    return log;
+}
+
+void log_segment_release(struct log_segment *const segment)
+{
+    assert(segment != NULL);
+
+    if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        munmap(segment->map, segment->capacity);
+        close(segment->fd);
+        free(segment->path);
+        free(segment);
+    }
+}
+
+/// Takes the segment out of the log, and removes its file (snapshots still keep it mapped).
+static void drop_segment(struct segment_log *const log, struct log_segment *const segment)
+{
+    TAILQ_REMOVE(&log->segments, segment, nodes);
+    if (unlink(segment->path) == -1)
+    {
+        syslog(LOG_ERR, "unlink '%s': %s", segment->path, strerror(errno));
+    }
+    log_segment_release(segment);
+}
+
+void segment_log_destroy(struct segment_log *const log)
+{
+    if (log == NULL)
+    {
+        return;
+    }
+
+    while (!TAILQ_EMPTY(&log->segments))
+    {
+        drop_segment(log, TAILQ_FIRST(&log->segments));
+    }
+    free(log->index);
+    pthread_mutex_destroy(&log->lock);
+    free(log->prefix);
+    free(log);
+}
+
+/// Layout of the state passed from `segment_log_detach` to `segment_log_adopt`: the header, then
+/// `segment_count` segments (oldest first), then `index_count` index entries.
+///
+#define SEGMENT_LOG_STATE_MAGIC 0x4145534C4F470001ULL // "AESLOG" and the layout version
+
+struct log_state_header
+{
+    uint64_t magic;
+    uint64_t start;
+    uint64_t end;
+    uint64_t newlines;
+    uint64_t segment_count;
+    uint64_t index_count;
+};
+
+struct log_state_segment
+{
+    uint64_t base;
+    uint64_t newlines_before;
+    uint64_t size;
+    uint64_t capacity;
+    int64_t sealed_sec; // CLOCK_MONOTONIC is system-wide, so it means the same to the successor
+    int64_t sealed_nsec;
+};
+
+void *segment_log_detach(struct segment_log *const log, size_t *const size)
+{
+    assert(log != NULL);
+    assert(size != NULL);
+
+    size_t segment_count = 0;
+    struct log_segment *segment;
+    TAILQ_FOREACH(segment, &log->segments, nodes)
+    {
+        segment_count++;
+    }
+
+    *size = sizeof(struct log_state_header) + (segment_count * sizeof(struct log_state_segment)) +
+            (log->index_count * sizeof(struct log_index_entry));
+    struct log_state_header *const header = malloc(*size);
+    if (header == NULL)
+    {
+        syslog(LOG_ERR, "malloc log state: %s", strerror(errno));
+        segment_log_destroy(log);
+        *size = 0;
+        return NULL;
+    }
+    header->magic = SEGMENT_LOG_STATE_MAGIC;
+    header->start = log->start;
+    header->end = log->end;
+    header->newlines = log->newlines;
+    header->segment_count = segment_count;
+    header->index_count = log->index_count;
+
+    struct log_state_segment *const segments = (struct log_state_segment *)(header + 1);
+    size_t i = 0;
+    while (!TAILQ_EMPTY(&log->segments))
+    {
+        segment = TAILQ_FIRST(&log->segments);
+        segments[i].base = segment->base;
+        segments[i].newlines_before = segment->newlines_before;
+        segments[i].size = segment->size;
+        segments[i].capacity = segment->capacity;
+        segments[i].sealed_sec = segment->sealed.tv_sec;
+        segments[i].sealed_nsec = segment->sealed.tv_nsec;
+        i++;
+
+        // Unlike `drop_segment`, the file stays for the successor.
+        TAILQ_REMOVE(&log->segments, segment, nodes);
+        log_segment_release(segment);
+    }
+    memcpy(segments + segment_count, log->index + log->index_first,
+           log->index_count * sizeof(struct log_index_entry));
+
+    free(log->index);
+    pthread_mutex_destroy(&log->lock);
+    free(log->prefix);
+    free(log);
+    return header;
+}
+
+/// Opens and maps the file of an adopted segment.
+static struct log_segment *adopt_segment(const char *const prefix, const struct log_state_segment *const state)
+{
+    struct log_segment *const segment = calloc(1, sizeof(struct log_segment));
+    if (segment == NULL)
+    {
+        syslog(LOG_ERR, "malloc `log_segment`: %s", strerror(errno));
+        return NULL;
+    }
+    segment->path = segment_path(prefix, state->base);
+    if (segment->path == NULL)
+    {
+        free(segment);
+        return NULL;
+    }
+    segment->fd = open(segment->path, O_RDWR | O_CLOEXEC);
+    if (segment->fd == -1)
+    {
+        syslog(LOG_ERR, "open '%s': %s", segment->path, strerror(errno));
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    segment->map = mmap(NULL, state->capacity, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "mmap '%s': %s", segment->path, strerror(errno));
+        close(segment->fd);
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    segment->refs = 1;
+    segment->base = state->base;
+    segment->newlines_before = state->newlines_before;
+    segment->size = state->size;
+    segment->capacity = state->capacity;
+    segment->sealed.tv_sec = state->sealed_sec;
+    segment->sealed.tv_nsec = state->sealed_nsec;
+    return segment;
+}
+
+struct segment_log *segment_log_adopt(const char *const prefix, const struct segment_log_config *const config,
+                                      const void *const state, const size_t size)
+{
+    assert(prefix != NULL);
+    assert(config != NULL);
+    assert(config->segment_size > 0);
+    assert(state != NULL);
+
+    const struct log_state_header *const header = state;
+    if ((size < sizeof(struct log_state_header)) || (header->magic != SEGMENT_LOG_STATE_MAGIC) ||
+        (size != (sizeof(struct log_state_header) + (header->segment_count * sizeof(struct log_state_segment)) +
+                  (header->index_count * sizeof(struct log_index_entry)))))
+    {
+        syslog(LOG_ERR, "The inherited log state is not compatible (%zu bytes).", size);
+        return NULL;
+    }
+
+    struct segment_log *const log = calloc(1, sizeof(struct segment_log));
+    if (log == NULL)
+    {
+        syslog(LOG_ERR, "malloc `segment_log`: %s", strerror(errno));
+        return NULL;
+    }
+    log->prefix = strdup(prefix);
+    if (log->prefix == NULL)
+    {
+        syslog(LOG_ERR, "malloc segment prefix: %s", strerror(errno));
+        free(log);
+        return NULL;
+    }
+    log->config = *config;
+    pthread_mutex_init(&log->lock, NULL);
+    TAILQ_INIT(&log->segments);
+    log->start = header->start;
+    log->end = header->end;
+    log->newlines = header->newlines;
+
+    const struct log_state_segment *const segments = (const struct log_state_segment *)(header + 1);
+    for (uint64_t i = 0; i < header->segment_count; ++i)
+    {
+        struct log_segment *const segment = adopt_segment(prefix, &segments[i]);
+        if (segment == NULL)
+        {
+            segment_log_destroy(log);
+            return NULL;
+        }
+        TAILQ_INSERT_TAIL(&log->segments, segment, nodes);
+    }
+
+    if (header->index_count > 0)
+    {
+        log->index = malloc(header->index_count * sizeof(struct log_index_entry));
+        if (log->index == NULL)
+        {
+            syslog(LOG_ERR, "malloc log index: %s", strerror(errno));
+            segment_log_destroy(log);
+            return NULL;
+        }
+        memcpy(log->index, segments + header->segment_count, header->index_count * sizeof(struct log_index_entry));
+        log->index_capacity = header->index_count;
+        log->index_count = header->index_count;
+    }
+
+    async_log(LOG_DEBUG, "Adopted the log: %" PRIu64 " segments, %" PRIu64 " bytes, %" PRIu64 " records.",
+              header->segment_count, log->end - log->start, log->newlines);
+    return log;
+}
+
+/// Must be called with the log lock held.
+static void index_add(struct segment_log *const log, const uint64_t record, const uint64_t offset)
+{
+    if ((log->index_count > 0) && (log->index[log->index_first + log->index_count - 1].record >= record))
+    {
+        return;
+    }
+
+    if ((log->index_first + log->index_count) == log->index_capacity)
+    {
+        if (log->index_first > 0)
+        {
+            // The retention has dropped the head of the index, so its space is reused first.
+            memmove(log->index, log->index + log->index_first, log->index_count * sizeof(struct log_index_entry));
+            log->index_first = 0;
+        }
+        else
+        {
+            const size_t capacity = (log->index_capacity > 0) ? (log->index_capacity * 2) : 1024;
+            struct log_index_entry *const index = realloc(log->index, capacity * sizeof(struct log_index_entry));
+            if (index == NULL)
+            {
+                // Lookups just scan longer without the entry.
+                syslog(LOG_ERR, "malloc log index: %s", strerror(errno));
+                return;
+            }
+            log->index = index;
+            log->index_capacity = capacity;
+        }
+    }
+
+    struct log_index_entry *const entry = &log->index[log->index_first + log->index_count];
+    entry->record = record;
+    entry->offset = offset;
+    log->index_count++;
+}
+
+/// Starts a new segment (large enough for a packet of `packet_size`), sealing the active one.
+static struct log_segment *roll_segment(struct segment_log *const log, const size_t packet_size)
+{
+    struct log_segment *const active = TAILQ_LAST(&log->segments, log_segments_s);
+    const size_t capacity = (packet_size > log->config.segment_size) ? packet_size : log->config.segment_size;
+
+    struct log_segment *const segment = calloc(1, sizeof(struct log_segment));
+    if (segment == NULL)
+    {
+        syslog(LOG_ERR, "malloc `log_segment`: %s", strerror(errno));
+        return NULL;
+    }
+    segment->path = segment_path(log->prefix, log->end);
+    if (segment->path == NULL)
+    {
+        free(segment);
+        return NULL;
+    }
+
+    // The file is sized for the whole segment up front, so the mapping never has to grow with it.
+    //
+    segment->fd = open(segment->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (segment->fd == -1)
+    {
+        syslog(LOG_ERR, "open '%s': %s", segment->path, strerror(errno));
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    if (ftruncate(segment->fd, capacity) == -1)
+    {
+        syslog(LOG_ERR, "ftruncate '%s': %s", segment->path, strerror(errno));
+        close(segment->fd);
+        unlink(segment->path);
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    segment->map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "mmap '%s': %s", segment->path, strerror(errno));
+        close(segment->fd);
+        unlink(segment->path);
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    segment->refs = 1;
+    segment->capacity = capacity;
+
+    if (active != NULL)
+    {
+        // Nothing is going to be read past the written part, so the preallocated tail is given back.
+        if (ftruncate(active->fd, active->size) == -1)
+        {
+            syslog(LOG_ERR, "ftruncate '%s': %s", active->path, strerror(errno));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &active->sealed);
+    }
+    async_log(LOG_DEBUG, "New log segment '%s'.", segment->path);
+
+    pthread_mutex_lock(&log->lock);
+    {
+        segment->base = log->end;
+        segment->newlines_before = log->newlines;
+        TAILQ_INSERT_TAIL(&log->segments, segment, nodes);
+        if (active == NULL)
+        {
+            log->start = segment->base;
+        }
+
+        // A segment starting right at a record gets an index entry, so no lookup scans across segments.
+        if ((active == NULL) || (active->size == 0) || (active->map[active->size - 1] == '\n'))
+        {
+            index_add(log, log->newlines, log->end);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return segment;
+}
+
+/// Counts the records completed by the just written bytes, and indexes every `SEGMENT_LOG_INDEX_INTERVAL`-th.
+/// Must be called with the log lock held.
+///
+static void index_records(struct segment_log *const log, const struct log_segment *const segment, const size_t from,
+                          const size_t size)
+{
+    const char *const data = segment->map + from;
+    size_t offsets[SEGMENT_LOG_INDEX_INTERVAL];
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t scanned = 0;
+        const size_t found = newline_scan(data + done, size - done, offsets, SEGMENT_LOG_INDEX_INTERVAL, &scanned);
+        for (size_t i = 0; i < found; ++i)
+        {
+            log->newlines++;
+            if ((log->newlines % SEGMENT_LOG_INDEX_INTERVAL) == 0)
+            {
+                index_add(log, log->newlines, segment->base + from + done + offsets[i] + 1);
+            }
+        }
+        done += scanned;
+    }
+}
+
+/// Writes all the vectors at `offset`, continuing after partial writes.
+static bool pwritev_all(const int fd, const struct iovec *const packets, const size_t count, off_t offset)
+{
+    struct iovec iov[SEGMENT_LOG_MAX_IOV];
+    memcpy(iov, packets, count * sizeof(struct iovec));
+
+    struct iovec *next = iov;
+    int left = count;
+    while (left > 0)
+    {
+        const ssize_t bytes_written = pwritev(fd, next, left, offset);
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "pwritev: %s", strerror(errno));
+            return false;
+        }
+
+        offset += bytes_written;
+        size_t rest = bytes_written;
+        while ((left > 0) && (rest >= next->iov_len))
+        {
+            rest -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0)
+        {
+            next->iov_base = (char *)next->iov_base + rest;
+            next->iov_len -= rest;
+        }
+    }
+    return true;
+}
+
+/// Drops the oldest segments (never the active one) which are beyond the retention limits.
+static void apply_retention(struct segment_log *const log)
+{
+    if ((log->config.retention_bytes == 0) && (log->config.retention_seconds == 0))
+    {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&log->lock);
+    for (;;)
+    {
+        struct log_segment *const oldest = TAILQ_FIRST(&log->segments);
+        if ((oldest == NULL) || (oldest == TAILQ_LAST(&log->segments, log_segments_s)))
+        {
+            break;
+        }
+
+        const bool too_large =
+            (log->config.retention_bytes > 0) && ((log->end - log->start) > log->config.retention_bytes);
+        const long long sealed_ms = ((now.tv_sec - oldest->sealed.tv_sec) * 1000LL) +
+                                    ((now.tv_nsec - oldest->sealed.tv_nsec) / 1000000LL);
+        const bool too_old = (log->config.retention_seconds > 0) &&
+                             (sealed_ms >= ((long long)log->config.retention_seconds * 1000LL));
+        if (!too_large && !too_old)
+        {
+            break;
+        }
+
+        async_log(LOG_DEBUG, "Retention drops log segment '%s'.", oldest->path);
+        drop_segment(log, oldest);
+        log->start = TAILQ_FIRST(&log->segments)->base;
+        while ((log->index_count > 0) && (log->index[log->index_first].offset < log->start))
+        {
+            log->index_first++;
+            log->index_count--;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+bool segment_log_append(struct segment_log *const log, const struct iovec *const packets, const size_t count)
+{
+    assert(log != NULL);
+    assert(packets != NULL);
+
+    size_t appended = 0;
+    while (appended < count)
+    {
+        struct log_segment *active = TAILQ_LAST(&log->segments, log_segments_s);
+        if ((active == NULL) || ((active->size + packets[appended].iov_len) > active->capacity))
+        {
+            active = roll_segment(log, packets[appended].iov_len);
+            if (active == NULL)
+            {
+                return false;
+            }
+        }
+
+        // A packet never spans segments, and the consecutive packets which fit are written at once.
+        //
+        size_t batch = 1;
+        size_t batch_size = packets[appended].iov_len;
+        while (((appended + batch) < count) && (batch < SEGMENT_LOG_MAX_IOV) &&
+               ((active->size + batch_size + packets[appended + batch].iov_len) <= active->capacity))
+        {
+            batch_size += packets[appended + batch].iov_len;
+            batch++;
+        }
+        if (!pwritev_all(active->fd, packets + appended, batch, active->size))
+        {
+            return false;
+        }
+
+        // The written bytes are already visible through the mapping.
+        pthread_mutex_lock(&log->lock);
+        {
+            index_records(log, active, active->size, batch_size);
+            active->size += batch_size;
+            active->dirty = true;
+            log->end += batch_size;
+        }
+        pthread_mutex_unlock(&log->lock);
+        appended += batch;
+    }
+
+    apply_retention(log);
+    return true;
+}
+
+void segment_log_sync(struct segment_log *const log)
+{
+    assert(log != NULL);
+
+    struct log_segment *segment;
+    TAILQ_FOREACH(segment, &log->segments, nodes)
+    {
+        if (segment->dirty)
+        {
+            if (fdatasync(segment->fd) == -1)
+            {
+                syslog(LOG_ERR, "fdatasync '%s': %s", segment->path, strerror(errno));
+            }
+            segment->dirty = false;
+        }
+    }
+}
+
+struct store_snapshot *segment_log_snapshot(struct segment_log *const log)
+{
+    assert(log != NULL);
+
+    pthread_mutex_lock(&log->lock);
+
+    size_t count = 0;
+    struct log_segment *segment;
+    TAILQ_FOREACH(segment, &log->segments, nodes)
+    {
+        count++;
+    }
+
+    struct store_snapshot *const snapshot =
+        malloc(sizeof(struct store_snapshot) + (count * sizeof(struct log_segment *)));
+    if (snapshot == NULL)
+    {
+        pthread_mutex_unlock(&log->lock);
+        syslog(LOG_ERR, "malloc `store_snapshot`: %s", strerror(errno));
+        return NULL;
+    }
+    snapshot->refs = 1; // the cache reference
+    snapshot->data = NULL;
+    snapshot->base = log->start;
+    snapshot->size = log->end - log->start;
+    snapshot->segment_count = count;
+    snapshot->segments = (struct log_segment **)(snapshot + 1);
+
+    size_t i = 0;
+    TAILQ_FOREACH(segment, &log->segments, nodes)
+    {
+        __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+        snapshot->segments[i++] = segment;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return snapshot;
+}
+
+/// Moves `offset` forward past newlines until the record `target` starts there (`current` being the record
+/// in progress at `offset`). Returns false if the log ends first. Must be called with the log lock held.
+///
+static bool skip_records(struct segment_log *const log, uint64_t *const offset, uint64_t *const current,
+                         const uint64_t target)
+{
+    struct log_segment *segment = TAILQ_FIRST(&log->segments);
+    while (*current < target)
+    {
+        while ((segment != NULL) && (*offset >= (segment->base + segment->size)))
+        {
+            segment = TAILQ_NEXT(segment, nodes);
+        }
+        if (segment == NULL)
+        {
+            return false;
+        }
+
+        size_t newlines[SEGMENT_LOG_INDEX_INTERVAL];
+        const uint64_t wanted = target - *current;
+        size_t scanned = 0;
+        const size_t found = newline_scan(segment->map + (*offset - segment->base),
+                                          (segment->base + segment->size) - *offset, newlines,
+                                          (wanted < SEGMENT_LOG_INDEX_INTERVAL) ? wanted : SEGMENT_LOG_INDEX_INTERVAL,
+                                          &scanned);
+        *current += found;
+        *offset += scanned;
+    }
+    return true;
+}
+
+bool segment_log_find_record(struct segment_log *const log, const uint64_t record, uint64_t *const offset,
+                             size_t *const length)
+{
+    assert(log != NULL);
+    assert(offset != NULL);
+    assert(length != NULL);
+
+    bool found = false;
+    pthread_mutex_lock(&log->lock);
+    const struct log_segment *const oldest = TAILQ_FIRST(&log->segments);
+    if (oldest != NULL)
+    {
+        // The retained log could start in the middle of a record, which counts as the first one then.
+        //
+        const uint64_t target = oldest->newlines_before + record;
+        uint64_t position = log->start;
+        uint64_t current = oldest->newlines_before;
+
+        // Binary search of the last index entry at or before the target record.
+        //
+        const struct log_index_entry *const index = log->index + log->index_first;
+        size_t low = 0;
+        size_t high = log->index_count;
+        while (low < high)
+        {
+            const size_t middle = low + ((high - low) / 2);
+            if (index[middle].record <= target)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        if ((low > 0) && (index[low - 1].record >= current))
+        {
+            position = index[low - 1].offset;
+            current = index[low - 1].record;
+        }
+
+        if (skip_records(log, &position, &current, target) && (position < log->end))
+        {
+            uint64_t next = position;
+            uint64_t next_current = current;
+            const bool terminated = skip_records(log, &next, &next_current, target + 1);
+            *offset = position;
+            *length = (terminated ? next : log->end) - position;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return found;
+}
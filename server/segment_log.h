@@ -0,0 +1,116 @@
+#ifndef AESDSOCKET_SEGMENT_LOG_H
+#define AESDSOCKET_SEGMENT_LOG_H
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/// Default size of a log segment (a packet larger than this gets a segment of its own size).
+#define SEGMENT_LOG_DEFAULT_SEGMENT_SIZE (64UL * 1024 * 1024)
+
+/// The sparse index has one entry per this many records.
+#define SEGMENT_LOG_INDEX_INTERVAL 64
+
+/// Segmentation and retention of the log.
+struct segment_log_config
+{
+    size_t segment_size;
+    uint64_t retention_bytes;        // 0 - keep everything, otherwise the oldest segments go above this size
+    unsigned long retention_seconds; // 0 - keep everything, otherwise segments go this long after they are full
+};
+
+/// One file of the log: `capacity` bytes preallocated and mapped for reading, the first `size` bytes written.
+struct log_segment
+{
+    unsigned refs;            // the log's reference (while retained) plus one per snapshot
+    uint64_t base;            // log offset of the first byte
+    uint64_t newlines_before; // number of records completed before `base`
+    size_t size;
+    size_t capacity;
+    int fd;
+    char *map;
+    bool dirty;             // written since the last sync
+    struct timespec sealed; // when it got full (for the time-based retention)
+    char *path;
+
+    TAILQ_ENTRY(log_segment) nodes;
+};
+
+/// Sparse index entry: the record `record` starts at the log offset `offset`.
+struct log_index_entry
+{
+    uint64_t record;
+    uint64_t offset;
+};
+
+/// Append-only log of newline terminated records, split into fixed-size segment files.
+///
+/// Only the storage thread appends (see `group_commit`); readers get the content through snapshots
+/// (see `segment_log_snapshot`), which keep their segments mapped even if the retention drops them meanwhile.
+/// Records are found through a sparse index (every `SEGMENT_LOG_INDEX_INTERVAL`-th record) and a short scan
+/// of the mapped data from the closest entry.
+///
+struct segment_log
+{
+    char *prefix; // segments are named `<prefix>.<base offset>`
+    struct segment_log_config config;
+
+    // The segment list, the bounds, and the index are changed by the storage thread under `lock`,
+    // so readers take it as well.
+    //
+    pthread_mutex_t lock;
+    TAILQ_HEAD(log_segments_s, log_segment) segments;
+    uint64_t start; // log offset of the oldest retained byte (the base of the first segment)
+    uint64_t end;   // log offset after the last appended byte
+    uint64_t newlines;
+    struct log_index_entry *index;
+    size_t index_first;
+    size_t index_count;
+    size_t index_capacity;
+};
+
+/// Creates an empty log (removing any segments left by a previous run). Returns NULL on failure.
+struct segment_log *segment_log_create(const char *prefix, const struct segment_log_config *config);
+
+/// Closes the log, and removes all its segments.
+void segment_log_destroy(struct segment_log *log);
+
+/// Closes the log like `segment_log_destroy`, but keeps its segment files for a successor process
+/// (see `upgrade.h`). Returns the state to pass to its `segment_log_adopt` (allocated with `malloc`, `*size` bytes),
+/// or NULL on failure (the segments are removed then).
+///
+void *segment_log_detach(struct segment_log *log, size_t *size);
+
+/// Opens the log detached by the predecessor process: its segment files are mapped as they are, and its bounds
+/// and index are taken from `state`, so nothing is scanned. Returns NULL on failure (e.g. an incompatible state).
+///
+struct segment_log *segment_log_adopt(const char *prefix, const struct segment_log_config *config, const void *state,
+                                      size_t size);
+
+/// Appends the packets (storage thread only), rolling to new segments as they fill up,
+/// and applies the retention. Returns false if the packets could not be written.
+///
+bool segment_log_append(struct segment_log *log, const struct iovec *packets, size_t count);
+
+/// Flushes the segments written since the last sync to the disk (storage thread only).
+void segment_log_sync(struct segment_log *log);
+
+/// Builds a snapshot of the whole retained log (see `store_snapshot`). Returns NULL on failure.
+struct store_snapshot *segment_log_snapshot(struct segment_log *log);
+
+/// Finds the record `record` (0-based among the retained records): its log offset and length.
+///
+/// Takes O(log n) for the index lookup plus a scan of at most `SEGMENT_LOG_INDEX_INTERVAL` records.
+/// Returns false if there is no such record yet.
+///
+bool segment_log_find_record(struct segment_log *log, uint64_t record, uint64_t *offset, size_t *length);
+
+/// Drops a reference to the segment, and unmaps it when it was the last one.
+void log_segment_release(struct log_segment *segment);
+
+#endif // AESDSOCKET_SEGMENT_LOG_H
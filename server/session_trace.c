@@ -0,0 +1,147 @@
+#include "session_trace.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+/// Records from all client threads go to the same buffered stream (under the lock),
+/// so that the trace is ordered by time.
+///
+struct session_recorder
+{
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start_ns;
+    uint32_t last_session_id;
+    bool failed; // stop recording (but keep serving) after the first write failure
+};
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/// Must be called with the lock held.
+static void write_record(struct session_recorder *const recorder, const enum session_trace_type type,
+                         const uint32_t session_id, const char *const payload, const size_t size,
+                         const uint64_t digest)
+{
+    if (recorder->failed)
+    {
+        return;
+    }
+
+    struct session_trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp_ns = monotonic_ns() - recorder->start_ns;
+    record.session_id = session_id;
+    record.size = (uint32_t)size;
+    record.type = (uint8_t)type;
+    record.digest = digest;
+    if ((fwrite(&record, sizeof(record), 1, recorder->file) != 1) ||
+        ((payload != NULL) && (size > 0) && (fwrite(payload, size, 1, recorder->file) != 1)))
+    {
+        syslog(LOG_ERR, "session trace write: %s (recording stopped)", strerror(errno));
+        recorder->failed = true;
+    }
+}
+
+struct session_recorder *session_recorder_create(const char *const path)
+{
+    assert(path != NULL);
+
+    struct session_recorder *const recorder = malloc(sizeof(struct session_recorder));
+    if (recorder == NULL)
+    {
+        syslog(LOG_ERR, "malloc `session_recorder`: %s", strerror(errno));
+        return NULL;
+    }
+
+    recorder->file = fopen(path, "wbe");
+    if (recorder->file == NULL)
+    {
+        syslog(LOG_ERR, "fopen '%s': %s", path, strerror(errno));
+        free(recorder);
+        return NULL;
+    }
+
+    struct session_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SESSION_TRACE_MAGIC, sizeof(SESSION_TRACE_MAGIC));
+    header.version = SESSION_TRACE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1)
+    {
+        syslog(LOG_ERR, "session trace write: %s", strerror(errno));
+        fclose(recorder->file);
+        free(recorder);
+        return NULL;
+    }
+
+    pthread_mutex_init(&recorder->lock, NULL);
+    recorder->start_ns = monotonic_ns();
+    recorder->last_session_id = 0;
+    recorder->failed = false;
+    return recorder;
+}
+
+void session_recorder_destroy(struct session_recorder *const recorder)
+{
+    if (recorder == NULL)
+    {
+        return;
+    }
+
+    if (fclose(recorder->file) != 0)
+    {
+        syslog(LOG_ERR, "session trace close: %s", strerror(errno));
+    }
+    pthread_mutex_destroy(&recorder->lock);
+    free(recorder);
+}
+
+uint32_t session_recorder_open(struct session_recorder *const recorder)
+{
+    assert(recorder != NULL);
+
+    pthread_mutex_lock(&recorder->lock);
+    const uint32_t session_id = ++recorder->last_session_id;
+    write_record(recorder, SESSION_TRACE_OPEN, session_id, NULL, 0, 0);
+    pthread_mutex_unlock(&recorder->lock);
+    return session_id;
+}
+
+void session_recorder_data(struct session_recorder *const recorder, const uint32_t session_id,
+                           const char *const data, const size_t size)
+{
+    assert(recorder != NULL);
+
+    pthread_mutex_lock(&recorder->lock);
+    write_record(recorder, SESSION_TRACE_DATA, session_id, data, size, 0);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void session_recorder_reply(struct session_recorder *const recorder, const uint32_t session_id, const size_t size,
+                            const uint64_t digest)
+{
+    assert(recorder != NULL);
+
+    pthread_mutex_lock(&recorder->lock);
+    write_record(recorder, SESSION_TRACE_REPLY, session_id, NULL, size, digest);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void session_recorder_close(struct session_recorder *const recorder, const uint32_t session_id)
+{
+    assert(recorder != NULL);
+
+    pthread_mutex_lock(&recorder->lock);
+    write_record(recorder, SESSION_TRACE_CLOSE, session_id, NULL, 0, 0);
+    pthread_mutex_unlock(&recorder->lock);
+}
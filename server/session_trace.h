@@ -0,0 +1,72 @@
+#ifndef AESDSOCKET_SESSION_TRACE_H
+#define AESDSOCKET_SESSION_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Binary trace of client sessions (as recorded by aesdsocket, and replayed by aesdreplay).
+///
+/// The file starts with `struct session_trace_header`, followed by records: `struct session_trace_record`
+/// immediately followed by `size` bytes of payload for `SESSION_TRACE_DATA` (no payload otherwise).
+/// All integers are in the host byte order (the header magic tells a foreign one).
+///
+#define SESSION_TRACE_MAGIC "AESDTRC"
+#define SESSION_TRACE_VERSION 2
+
+enum session_trace_type
+{
+    SESSION_TRACE_OPEN = 1,  // a connection was accepted
+    SESSION_TRACE_DATA = 2,  // bytes received from the peer (`size` bytes of payload)
+    SESSION_TRACE_REPLY = 3, // a reply of `size` bytes (with `digest`) was completely sent
+    SESSION_TRACE_CLOSE = 4, // the connection was closed
+};
+
+struct session_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct __attribute__((packed)) session_trace_record
+{
+    uint64_t timestamp_ns; // since the start of recording
+    uint32_t session_id;
+    uint32_t size;
+    uint8_t type;    // `enum session_trace_type`
+    uint64_t digest; // of the reply bytes for `SESSION_TRACE_REPLY` (see `session_trace_digest`), 0 otherwise
+};
+
+#define SESSION_TRACE_DIGEST_INIT 0xcbf29ce484222325ULL
+
+/// Continues the (FNV-1a) digest of a reply with its next `size` bytes.
+static inline uint64_t session_trace_digest(uint64_t digest, const void *const data, const size_t size)
+{
+    const unsigned char *const bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        digest ^= bytes[i];
+        digest *= 0x100000001b3ULL;
+    }
+    return digest;
+}
+
+struct session_recorder;
+
+/// Creates (truncating) the trace file. Returns NULL on failure.
+struct session_recorder *session_recorder_create(const char *path);
+
+/// Flushes and closes the trace file.
+void session_recorder_destroy(struct session_recorder *recorder);
+
+/// Records a new session, and returns its id.
+uint32_t session_recorder_open(struct session_recorder *recorder);
+
+/// Records received bytes, a sent reply (its size and digest) and the end of session respectively.
+///
+void session_recorder_data(struct session_recorder *recorder, uint32_t session_id, const char *data, size_t size);
+void session_recorder_reply(struct session_recorder *recorder, uint32_t session_id, size_t size, uint64_t digest);
+void session_recorder_close(struct session_recorder *recorder, uint32_t session_id);
+
+#endif // AESDSOCKET_SESSION_TRACE_H
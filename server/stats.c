@@ -0,0 +1,327 @@
+#include "stats.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Per-thread statistics.
+///
+/// Only the owning thread updates its shard (so no atomic read-modify-write is needed),
+/// while the reporting thread reads it concurrently; hence relaxed atomic loads and stores.
+///
+struct stats_shard
+{
+    uint64_t counters[STATS_COUNTERS_COUNT];
+    struct stats_histogram histograms[STATS_STAGES_COUNT];
+
+    LIST_ENTRY(stats_shard) nodes;
+};
+
+static __thread struct stats_shard *tls_shard = NULL;
+
+static pthread_key_t g_shard_key;
+static pthread_once_t g_shard_key_once = PTHREAD_ONCE_INIT;
+
+// All live shards, and the sum of shards of already finished threads.
+//
+static pthread_mutex_t g_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(stats_shards_s, stats_shard) g_shards = LIST_HEAD_INITIALIZER(g_shards);
+static struct stats_shard g_retired;
+
+static const char *const g_stage_names[STATS_STAGES_COUNT] = {"recv", "scan", "lock_wait", "append", "reply"};
+static const char *const g_counter_names[STATS_COUNTERS_COUNT] = {
+    "connections", "packets", "bytes_in", "bytes_out", "seekto", "range_reads", "subscriptions",
+    "subscriber_drops", "spilled_packets", "lock_contended"};
+
+static void relaxed_add(uint64_t *const value, const uint64_t delta)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static uint64_t relaxed_load(const uint64_t *const value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/// Adds the shard to the total (both the shard and the total may be concurrently read, but not updated).
+static void add_shard(struct stats_shard *const total, const struct stats_shard *const shard)
+{
+    for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+    {
+        relaxed_add(&total->counters[i], relaxed_load(&shard->counters[i]));
+    }
+    for (size_t i = 0; i < STATS_STAGES_COUNT; ++i)
+    {
+        struct stats_histogram *const total_histogram = &total->histograms[i];
+        const struct stats_histogram *const histogram = &shard->histograms[i];
+        relaxed_add(&total_histogram->count, relaxed_load(&histogram->count));
+        relaxed_add(&total_histogram->sum, relaxed_load(&histogram->sum));
+        const uint64_t max = relaxed_load(&histogram->max);
+        if (relaxed_load(&total_histogram->max) < max)
+        {
+            __atomic_store_n(&total_histogram->max, max, __ATOMIC_RELAXED);
+        }
+        for (size_t j = 0; j < STATS_BUCKETS; ++j)
+        {
+            relaxed_add(&total_histogram->buckets[j], relaxed_load(&histogram->buckets[j]));
+        }
+    }
+}
+
+/// Called on thread exit to fold its shard into the retired statistics.
+static void destroy_shard(void *const arg)
+{
+    struct stats_shard *const shard = arg;
+
+    pthread_mutex_lock(&g_shards_lock);
+    LIST_REMOVE(shard, nodes);
+    add_shard(&g_retired, shard);
+    pthread_mutex_unlock(&g_shards_lock);
+
+    free(shard);
+}
+
+static void create_shard_key()
+{
+    pthread_key_create(&g_shard_key, destroy_shard);
+}
+
+/// Gets (lazily creating) the shard of the calling thread. Returns NULL if it can't be allocated.
+static struct stats_shard *get_shard()
+{
+    struct stats_shard *shard = tls_shard;
+    if (shard == NULL)
+    {
+        pthread_once(&g_shard_key_once, create_shard_key);
+
+        shard = calloc(1, sizeof(struct stats_shard));
+        if (shard != NULL)
+        {
+            pthread_mutex_lock(&g_shards_lock);
+            LIST_INSERT_HEAD(&g_shards, shard, nodes);
+            pthread_mutex_unlock(&g_shards_lock);
+
+            pthread_setspecific(g_shard_key, shard);
+            tls_shard = shard;
+        }
+    }
+    return shard;
+}
+
+/// Values below `STATS_SUB_BUCKETS` have exact buckets; above it every power of 2
+/// is split into `STATS_SUB_BUCKETS` equal buckets.
+///
+static size_t bucket_index(const uint64_t value)
+{
+    if (value < STATS_SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    const unsigned magnitude = 63 - __builtin_clzll(value); // >= STATS_SUB_BUCKET_BITS
+    const unsigned shift = magnitude - STATS_SUB_BUCKET_BITS;
+    const size_t index = ((size_t)(shift + 1) * STATS_SUB_BUCKETS) + ((value >> shift) & (STATS_SUB_BUCKETS - 1));
+    return (index < STATS_BUCKETS) ? index : (STATS_BUCKETS - 1);
+}
+
+/// The highest value which falls into the bucket.
+static uint64_t bucket_upper_bound(const size_t index)
+{
+    if (index < STATS_SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    const unsigned shift = (index / STATS_SUB_BUCKETS) - 1;
+    const uint64_t sub_bucket = STATS_SUB_BUCKETS + (index % STATS_SUB_BUCKETS);
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void stats_count(const enum stats_counter counter, const uint64_t delta)
+{
+    assert(counter < STATS_COUNTERS_COUNT);
+
+    struct stats_shard *const shard = get_shard();
+    if (shard != NULL)
+    {
+        relaxed_add(&shard->counters[counter], delta);
+    }
+}
+
+void stats_record(const enum stats_stage stage, const uint64_t nanoseconds)
+{
+    assert(stage < STATS_STAGES_COUNT);
+
+    struct stats_shard *const shard = get_shard();
+    if (shard != NULL)
+    {
+        struct stats_histogram *const histogram = &shard->histograms[stage];
+        relaxed_add(&histogram->count, 1);
+        relaxed_add(&histogram->sum, nanoseconds);
+        relaxed_add(&histogram->buckets[bucket_index(nanoseconds)], 1);
+        if (histogram->max < nanoseconds)
+        {
+            __atomic_store_n(&histogram->max, nanoseconds, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/// Spinning budget of a contended lock acquisition (see `stats_rwlock_set_spin`).
+static unsigned g_rwlock_spin = 0;
+
+void stats_rwlock_set_spin(const unsigned iterations)
+{
+    g_rwlock_spin = iterations;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/// Retries `try_lock` for up to the spinning budget, and then takes the lock with `lock` (blocking).
+static void contended_lock(pthread_rwlock_t *const lock, int (*const try_lock)(pthread_rwlock_t *),
+                           int (*const block)(pthread_rwlock_t *))
+{
+    const uint64_t start = stats_now();
+    bool locked = false;
+    for (unsigned i = 0; (i < g_rwlock_spin) && !locked; ++i)
+    {
+        cpu_relax();
+        locked = (try_lock(lock) == 0);
+    }
+    if (!locked)
+    {
+        block(lock);
+    }
+    stats_record_since(STATS_STAGE_LOCK_WAIT, start);
+    stats_count(STATS_LOCK_CONTENDED, 1);
+}
+
+void stats_rwlock_rdlock(pthread_rwlock_t *const lock)
+{
+    if (pthread_rwlock_tryrdlock(lock) == 0)
+    {
+        stats_record(STATS_STAGE_LOCK_WAIT, 0);
+        return;
+    }
+    contended_lock(lock, pthread_rwlock_tryrdlock, pthread_rwlock_rdlock);
+}
+
+void stats_rwlock_wrlock(pthread_rwlock_t *const lock)
+{
+    if (pthread_rwlock_trywrlock(lock) == 0)
+    {
+        stats_record(STATS_STAGE_LOCK_WAIT, 0);
+        return;
+    }
+    contended_lock(lock, pthread_rwlock_trywrlock, pthread_rwlock_wrlock);
+}
+
+/// The smallest value such that at least `quantile` of all recorded values are not greater than it.
+static uint64_t histogram_percentile(const struct stats_histogram *const histogram, const double quantile)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)((quantile * (double)histogram->count) + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            const uint64_t upper = bucket_upper_bound(i);
+            return (upper < histogram->max) ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void stats_write_report(FILE *const out, const enum stats_format format)
+{
+    assert(out != NULL);
+
+    // Take a consistent enough sum of all shards.
+    //
+    struct stats_shard *const total = calloc(1, sizeof(struct stats_shard));
+    if (total == NULL)
+    {
+        fprintf(out, (format == STATS_FORMAT_JSON) ? "{}\n" : "out of memory\n");
+        return;
+    }
+    pthread_mutex_lock(&g_shards_lock);
+    add_shard(total, &g_retired);
+    struct stats_shard *shard = NULL;
+    LIST_FOREACH(shard, &g_shards, nodes)
+    {
+        add_shard(total, shard);
+    }
+    pthread_mutex_unlock(&g_shards_lock);
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *const quantile_names[] = {"p50", "p90", "p99", "p99_9"};
+    const size_t quantiles_count = sizeof(quantiles) / sizeof(quantiles[0]);
+
+    if (format == STATS_FORMAT_JSON)
+    {
+        fprintf(out, "{\"counters\":{");
+        for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+        {
+            fprintf(out, "%s\"%s\":%lu", (i > 0) ? "," : "", g_counter_names[i], (unsigned long)total->counters[i]);
+        }
+        fprintf(out, "},\"stages_ns\":{");
+        for (size_t i = 0; i < STATS_STAGES_COUNT; ++i)
+        {
+            const struct stats_histogram *const histogram = &total->histograms[i];
+            fprintf(out, "%s\"%s\":{\"count\":%lu,\"mean\":%lu", (i > 0) ? "," : "", g_stage_names[i],
+                    (unsigned long)histogram->count,
+                    (unsigned long)((histogram->count > 0) ? (histogram->sum / histogram->count) : 0));
+            for (size_t q = 0; q < quantiles_count; ++q)
+            {
+                fprintf(out, ",\"%s\":%lu", quantile_names[q],
+                        (unsigned long)histogram_percentile(histogram, quantiles[q]));
+            }
+            fprintf(out, ",\"max\":%lu}", (unsigned long)histogram->max);
+        }
+        fprintf(out, "}}\n");
+    }
+    else
+    {
+        for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+        {
+            fprintf(out, "%-16s %lu\n", g_counter_names[i], (unsigned long)total->counters[i]);
+        }
+        fprintf(out, "%-10s %12s %10s", "stage(ns)", "count", "mean");
+        for (size_t q = 0; q < quantiles_count; ++q)
+        {
+            fprintf(out, " %10s", quantile_names[q]);
+        }
+        fprintf(out, " %10s\n", "max");
+        for (size_t i = 0; i < STATS_STAGES_COUNT; ++i)
+        {
+            const struct stats_histogram *const histogram = &total->histograms[i];
+            fprintf(out, "%-10s %12lu %10lu", g_stage_names[i], (unsigned long)histogram->count,
+                    (unsigned long)((histogram->count > 0) ? (histogram->sum / histogram->count) : 0));
+            for (size_t q = 0; q < quantiles_count; ++q)
+            {
+                fprintf(out, " %10lu", (unsigned long)histogram_percentile(histogram, quantiles[q]));
+            }
+            fprintf(out, " %10lu\n", (unsigned long)histogram->max);
+        }
+    }
+
+    free(total);
+}
@@ -0,0 +1,93 @@
+#ifndef AESDSOCKET_STATS_H
+#define AESDSOCKET_STATS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/// Number of sub-buckets (as a power of 2) per power of 2 of a histogram; bounds the relative error (~6%).
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+
+/// Number of powers of 2 covered by a histogram (values above ~2^40ns, i.e. ~18 minutes, are clamped).
+#define STATS_MAGNITUDES 38
+
+#define STATS_BUCKETS (STATS_MAGNITUDES * STATS_SUB_BUCKETS)
+
+/// Stages of packet processing whose latencies are recorded.
+enum stats_stage
+{
+    STATS_STAGE_RECV,      // a `recv` call (blocking and non-blocking engines only)
+    STATS_STAGE_SCAN,      // looking for the next newline in the received data
+    STATS_STAGE_LOCK_WAIT, // acquiring `rw_file_lock`
+    STATS_STAGE_APPEND,    // committing a packet to the store (including waiting for the group commit)
+    STATS_STAGE_REPLY,     // from preparing a reply until it's completely sent
+    STATS_STAGES_COUNT,
+};
+
+enum stats_counter
+{
+    STATS_CONNECTIONS,      // accepted connections
+    STATS_PACKETS,          // processed packets (including seekto commands)
+    STATS_BYTES_IN,         // received bytes
+    STATS_BYTES_OUT,        // bytes of completely sent replies
+    STATS_SEEKTO,           // processed seekto commands
+    STATS_RANGE_READS,      // processed range read commands
+    STATS_SUBSCRIPTIONS,    // connections turned into subscribers
+    STATS_SUBSCRIBER_DROPS, // records skipped by subscribers which fell behind
+    STATS_SPILLED_PACKETS,  // unterminated packets moved to a file b/c of the memory budget
+    STATS_LOCK_CONTENDED,   // `rw_file_lock` acquisitions which had to wait
+    STATS_COUNTERS_COUNT,
+};
+
+enum stats_format
+{
+    STATS_FORMAT_TEXT,
+    STATS_FORMAT_JSON,
+};
+
+/// Log-linear (HDR-style) histogram of nanoseconds.
+struct stats_histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/// Monotonic timestamp in nanoseconds (not subject to NTP adjustments).
+static inline uint64_t stats_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/// Adds `delta` to the counter (of the calling thread's shard).
+void stats_count(enum stats_counter counter, uint64_t delta);
+
+/// Records a latency (of the calling thread's shard).
+void stats_record(enum stats_stage stage, uint64_t nanoseconds);
+
+static inline void stats_record_since(const enum stats_stage stage, const uint64_t start)
+{
+    stats_record(stage, stats_now() - start);
+}
+
+/// Acquire the lock for reading/writing, accounting the time spent waiting for it
+/// (and whether it had to wait at all).
+///
+void stats_rwlock_rdlock(pthread_rwlock_t *lock);
+void stats_rwlock_wrlock(pthread_rwlock_t *lock);
+
+/// Makes a contended `stats_rwlock_*` acquisition retry `iterations` times (spinning) before blocking
+/// (0 - block right away, the default). Set before any thread takes the locks.
+///
+void stats_rwlock_set_spin(unsigned iterations);
+
+/// Writes counters and per-stage percentiles (summed over all threads, including already finished ones).
+void stats_write_report(FILE *out, enum stats_format format);
+
+#endif // AESDSOCKET_STATS_H
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE // accept4, open_memstream
+
+#include "stats_server.h"
+#include "async_log.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// How long to wait for the report format request before falling back to text.
+#define STATS_REQUEST_TIMEOUT_MS 1000
+
+struct stats_server
+{
+    pthread_t thread;
+    int signal_fd;
+    int stop_fd;
+    int listen_fd; // -1 if there is no endpoint
+    char unix_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    ino_t unix_inode; // of the socket file, so that the one of a successor (see `upgrade.h`) isn't removed
+};
+
+static bool is_port_number(const char *const endpoint)
+{
+    if (*endpoint == '\0')
+    {
+        return false;
+    }
+    for (const char *c = endpoint; *c != '\0'; ++c)
+    {
+        if ((*c < '0') || (*c > '9'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int open_endpoint(struct stats_server *const server, const char *const endpoint)
+{
+    int sock_fd = -1;
+    if (is_port_number(endpoint))
+    {
+        sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock_fd == -1)
+        {
+            syslog(LOG_ERR, "socket: %s", strerror(errno));
+            return -1;
+        }
+        const int opt_val = 1;
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)strtoul(endpoint, NULL, 10));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            syslog(LOG_ERR, "bind stats port %s: %s", endpoint, strerror(errno));
+            close(sock_fd);
+            return -1;
+        }
+    }
+    else
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(endpoint) >= sizeof(addr.sun_path))
+        {
+            syslog(LOG_ERR, "stats socket path is too long: %s", endpoint);
+            return -1;
+        }
+        strcpy(addr.sun_path, endpoint);
+
+        sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock_fd == -1)
+        {
+            syslog(LOG_ERR, "socket: %s", strerror(errno));
+            return -1;
+        }
+        unlink(endpoint); // a leftover of a previous run
+        if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            syslog(LOG_ERR, "bind stats socket %s: %s", endpoint, strerror(errno));
+            close(sock_fd);
+            return -1;
+        }
+        strcpy(server->unix_path, endpoint);
+        struct stat st;
+        server->unix_inode = (stat(endpoint, &st) == 0) ? st.st_ino : 0;
+    }
+
+    if (listen(sock_fd, SOMAXCONN) == -1)
+    {
+        syslog(LOG_ERR, "listen: %s", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+static void dump_to_syslog()
+{
+    char *report = NULL;
+    size_t report_size = 0;
+    FILE *const out = open_memstream(&report, &report_size);
+    if (out == NULL)
+    {
+        syslog(LOG_ERR, "open_memstream: %s", strerror(errno));
+        return;
+    }
+    stats_write_report(out, STATS_FORMAT_TEXT);
+    fclose(out);
+
+    char *save_ptr = NULL;
+    for (const char *line = strtok_r(report, "\n", &save_ptr); line != NULL; line = strtok_r(NULL, "\n", &save_ptr))
+    {
+        syslog(LOG_INFO, "stats: %s", line);
+    }
+    free(report);
+}
+
+static void serve_request(const int listen_fd)
+{
+    const int peer_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (peer_fd == -1)
+    {
+        syslog(LOG_WARNING, "accept4: %s", strerror(errno));
+        return;
+    }
+
+    // The optional request line selects the format (or changes the log level).
+    //
+    enum stats_format format = STATS_FORMAT_TEXT;
+    struct pollfd pfd = {.fd = peer_fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, STATS_REQUEST_TIMEOUT_MS) == 1)
+    {
+        char request[32];
+        const ssize_t received = recv(peer_fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+        request[(received > 0) ? received : 0] = '\0';
+        request[strcspn(request, "\r\n")] = '\0';
+        if (strncmp(request, "json", 4) == 0)
+        {
+            format = STATS_FORMAT_JSON;
+        }
+        else if (strncmp(request, "level ", 6) == 0)
+        {
+            const int level = async_log_parse_level(request + 6);
+            if (level >= 0)
+            {
+                async_log_set_level(level);
+                syslog(LOG_INFO, "Log level changed to %s.", request + 6);
+            }
+            const char *const response = (level >= 0) ? "ok\n" : "unknown level\n";
+            send(peer_fd, response, strlen(response), MSG_NOSIGNAL);
+            close(peer_fd);
+            return;
+        }
+    }
+
+    char *report = NULL;
+    size_t report_size = 0;
+    FILE *const out = open_memstream(&report, &report_size);
+    if (out != NULL)
+    {
+        stats_write_report(out, format);
+        fclose(out);
+
+        size_t sent = 0;
+        while (sent < report_size)
+        {
+            const ssize_t res = send(peer_fd, report + sent, report_size - sent, MSG_NOSIGNAL);
+            if (res <= 0)
+            {
+                break;
+            }
+            sent += res;
+        }
+        free(report);
+    }
+    close(peer_fd);
+}
+
+static void *stats_server_thread(void *const arg)
+{
+    struct stats_server *const server = arg;
+    assert(server != NULL);
+
+    struct pollfd fds[3];
+    fds[0].fd = server->stop_fd;
+    fds[1].fd = server->signal_fd;
+    fds[2].fd = server->listen_fd; // ignored by `poll` when negative
+    for (size_t i = 0; i < 3; ++i)
+    {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+
+    for (;;)
+    {
+        if (poll(fds, 3, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "poll: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents != 0)
+        {
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            struct signalfd_siginfo info;
+            if (read(server->signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                dump_to_syslog();
+            }
+        }
+        if (fds[2].revents != 0)
+        {
+            serve_request(server->listen_fd);
+        }
+    }
+    return NULL;
+}
+
+static void close_server_fds(struct stats_server *const server)
+{
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+    }
+    struct stat st;
+    if ((server->unix_path[0] != '\0') && (stat(server->unix_path, &st) == 0) && (st.st_ino == server->unix_inode))
+    {
+        unlink(server->unix_path);
+    }
+    if (server->signal_fd >= 0)
+    {
+        close(server->signal_fd);
+    }
+    if (server->stop_fd >= 0)
+    {
+        close(server->stop_fd);
+    }
+}
+
+struct stats_server *stats_server_start(const char *const endpoint)
+{
+    struct stats_server *const server = malloc(sizeof(struct stats_server));
+    if (server == NULL)
+    {
+        syslog(LOG_ERR, "malloc `stats_server`: %s", strerror(errno));
+        return NULL;
+    }
+    server->signal_fd = -1;
+    server->stop_fd = -1;
+    server->listen_fd = -1;
+    server->unix_path[0] = '\0';
+
+    sigset_t dump_signals;
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump_signals, NULL);
+
+    server->signal_fd = signalfd(-1, &dump_signals, SFD_CLOEXEC);
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if ((server->signal_fd == -1) || (server->stop_fd == -1))
+    {
+        syslog(LOG_ERR, "signalfd/eventfd: %s", strerror(errno));
+        close_server_fds(server);
+        free(server);
+        return NULL;
+    }
+
+    if (endpoint != NULL)
+    {
+        server->listen_fd = open_endpoint(server, endpoint);
+        if (server->listen_fd == -1)
+        {
+            close_server_fds(server);
+            free(server);
+            return NULL;
+        }
+    }
+
+    const int err = pthread_create(&server->thread, NULL, stats_server_thread, server);
+    if (err != 0)
+    {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(err));
+        close_server_fds(server);
+        free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+void stats_server_stop(struct stats_server *const server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+
+    const uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        syslog(LOG_ERR, "write eventfd: %s", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+
+    close_server_fds(server);
+    free(server);
+}
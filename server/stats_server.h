@@ -0,0 +1,21 @@
+#ifndef AESDSOCKET_STATS_SERVER_H
+#define AESDSOCKET_STATS_SERVER_H
+
+struct stats_server;
+
+/// Starts the thread which reports the statistics (see `stats.h`):
+/// - to syslog (as text) on every SIGUSR1;
+/// - to every connection to `endpoint` (unless it's NULL) - a TCP port on the loopback interface
+///   if it's a number, or a Unix socket path otherwise. The report is JSON if the client sends
+///   a line starting with `json` first, and text otherwise (including when it sends nothing);
+///   a `level <name>` line changes the log level instead (see `async_log_set_level`).
+///
+/// SIGUSR1 is blocked in the calling thread, so this must be called before any other thread is started
+/// (for them to inherit the mask). Returns NULL on failure.
+///
+struct stats_server *stats_server_start(const char *endpoint);
+
+/// Stops and joins the reporting thread, and removes the Unix socket (if any, and not replaced by a successor's).
+void stats_server_stop(struct stats_server *server);
+
+#endif // AESDSOCKET_STATS_SERVER_H
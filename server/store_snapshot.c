@@ -0,0 +1,183 @@
+#include "store_snapshot.h"
+#include "segment_log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+void snapshot_cache_init(struct snapshot_cache *const cache)
+{
+    assert(cache != NULL);
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->current = NULL;
+    cache->generation = 0;
+}
+
+void snapshot_cache_destroy(struct snapshot_cache *const cache)
+{
+    assert(cache != NULL);
+
+    if (cache->current != NULL)
+    {
+        store_snapshot_release(cache->current);
+        cache->current = NULL;
+    }
+    pthread_mutex_destroy(&cache->lock);
+}
+
+struct store_snapshot *store_snapshot_read(const int file_fd)
+{
+    assert(file_fd >= 0);
+
+    // The device holds just a few most recent writes, so it's cheap to copy all of them.
+    //
+    // Seeking to the end is the only way to get the device size, but the file position
+    // belongs to the client (it could be moved by `AESDCHAR_IOCSEEKTO`), so it's restored.
+    //
+    const off_t position = lseek(file_fd, 0, SEEK_CUR);
+    const off_t device_size = lseek(file_fd, 0, SEEK_END);
+    if ((position < 0) || (device_size < 0))
+    {
+        syslog(LOG_ERR, "lseek: %s", strerror(errno));
+        return NULL;
+    }
+    lseek(file_fd, position, SEEK_SET);
+
+    struct store_snapshot *const snapshot = malloc(sizeof(struct store_snapshot) + device_size);
+    if (snapshot == NULL)
+    {
+        syslog(LOG_ERR, "malloc `store_snapshot`: %s", strerror(errno));
+        return NULL;
+    }
+    char *const data = (char *)(snapshot + 1);
+
+    size_t size = 0;
+    while (size < (size_t)device_size)
+    {
+        const ssize_t bytes_read = pread(file_fd, data + size, device_size - size, size);
+        if (bytes_read == 0)
+        {
+            break;
+        }
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "pread: %s", strerror(errno));
+            free(snapshot);
+            return NULL;
+        }
+        size += bytes_read;
+    }
+
+    snapshot->refs = 1; // the cache reference
+    snapshot->data = data;
+    snapshot->size = size;
+    snapshot->base = 0;
+    snapshot->segment_count = 0;
+    snapshot->segments = NULL;
+    return snapshot;
+}
+
+bool snapshot_cache_publish(struct snapshot_cache *const cache, struct store_snapshot *const snapshot)
+{
+    assert(cache != NULL);
+
+    if (snapshot == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct store_snapshot *const previous = cache->current;
+    snapshot->generation = ++cache->generation;
+    cache->current = snapshot;
+    pthread_mutex_unlock(&cache->lock);
+
+    // Readers which still send the previous snapshot keep it alive with their own references.
+    if (previous != NULL)
+    {
+        store_snapshot_release(previous);
+    }
+    return true;
+}
+
+struct store_snapshot *snapshot_cache_acquire(struct snapshot_cache *const cache)
+{
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&cache->lock);
+    struct store_snapshot *const snapshot = cache->current;
+    if (snapshot != NULL)
+    {
+        __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return snapshot;
+}
+
+void store_snapshot_chunk(const struct store_snapshot *const snapshot, const size_t offset,
+                          struct snapshot_chunk *const chunk)
+{
+    assert(snapshot != NULL);
+    assert(offset < snapshot->size);
+    assert(chunk != NULL);
+
+    if (snapshot->data != NULL)
+    {
+        chunk->data = snapshot->data + offset;
+        chunk->size = snapshot->size - offset;
+        chunk->fd = -1;
+        chunk->file_offset = 0;
+        return;
+    }
+
+    // Binary search of the last segment starting at or before the offset.
+    //
+    const uint64_t position = snapshot->base + offset;
+    size_t low = 0;
+    size_t high = snapshot->segment_count;
+    while (low < high)
+    {
+        const size_t middle = low + ((high - low) / 2);
+        if (snapshot->segments[middle]->base <= position)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    assert(low > 0);
+    const struct log_segment *const segment = snapshot->segments[low - 1];
+
+    // The last segment could grow after the snapshot, so it's the snapshot end which bounds it.
+    const uint64_t end =
+        (low < snapshot->segment_count) ? snapshot->segments[low]->base : (snapshot->base + snapshot->size);
+    chunk->data = segment->map + (position - segment->base);
+    chunk->size = end - position;
+    chunk->fd = segment->fd;
+    chunk->file_offset = position - segment->base;
+}
+
+void store_snapshot_release(struct store_snapshot *const snapshot)
+{
+    assert(snapshot != NULL);
+
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        for (size_t i = 0; i < snapshot->segment_count; ++i)
+        {
+            log_segment_release(snapshot->segments[i]);
+        }
+        free(snapshot);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef AESDSOCKET_STORE_SNAPSHOT_H
+#define AESDSOCKET_STORE_SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct log_segment;
+
+/// Immutable, reference counted view of the store content at some generation.
+///
+/// For the char device `data` holds a copy of the whole device content.
+/// For the file backend `data` is NULL: the log is append-only, so the snapshot is just the retained range
+/// `[base, base + size)` of it, and references the segments covering it (which keeps them mapped
+/// even after the retention drops them).
+///
+/// Offsets into the snapshot (see `store_snapshot_chunk`) are relative to its first byte.
+///
+struct store_snapshot
+{
+    unsigned int refs;
+    uint64_t generation;
+    size_t size;
+    const char *data;
+
+    uint64_t base; // log offset of the first byte (file backend)
+    size_t segment_count;
+    struct log_segment **segments;
+};
+
+/// Contiguous part of a snapshot: in memory, and (for the file backend) in a file as well.
+struct snapshot_chunk
+{
+    const char *data;
+    size_t size;
+    int fd;            // -1 if the chunk is only in memory
+    off_t file_offset; // offset of `data` in `fd`
+};
+
+/// The most recent snapshot of the store.
+///
+/// Writers publish a new snapshot after each change (while still holding the store write lock),
+/// and readers acquire the current one without touching the store lock at all -
+/// `lock` only protects the pointer swap and the reference increment.
+///
+struct snapshot_cache
+{
+    pthread_mutex_t lock;
+    struct store_snapshot *current;
+    uint64_t generation;
+};
+
+void snapshot_cache_init(struct snapshot_cache *cache);
+
+void snapshot_cache_destroy(struct snapshot_cache *cache);
+
+/// Makes the snapshot (taking over its reference) the current one.
+///
+/// Must be called with the store write lock held (so the snapshot reflects the store right after the change).
+/// Returns false (leaving the previous snapshot current) if `snapshot` is NULL (it could not be built).
+///
+bool snapshot_cache_publish(struct snapshot_cache *cache, struct store_snapshot *snapshot);
+
+/// Returns the current snapshot with an extra reference (or NULL if nothing was published yet).
+struct store_snapshot *snapshot_cache_acquire(struct snapshot_cache *cache);
+
+/// Builds a snapshot with a copy of the whole device content. Returns NULL on failure.
+struct store_snapshot *store_snapshot_read(int file_fd);
+
+/// Finds the contiguous chunk of the snapshot starting at `offset` (which must be below its size).
+void store_snapshot_chunk(const struct store_snapshot *snapshot, size_t offset, struct snapshot_chunk *chunk);
+
+/// Drops the reference, and deallocates the snapshot when it was the last one.
+void store_snapshot_release(struct store_snapshot *snapshot);
+
+#endif // AESDSOCKET_STORE_SNAPSHOT_H
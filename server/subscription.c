@@ -0,0 +1,526 @@
+#include "subscription.h"
+#include "async_log.h"
+#include "background_thread.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SUBSCRIPTION_MAX_EVENTS 64
+
+/// Records are taken out of the ring for a subscriber in batches up to this size (or a single larger record).
+#define SUBSCRIPTION_TAKE_SIZE (64 * 1024)
+
+static void wake_hub(struct subscription_hub *const hub)
+{
+    const uint64_t one = 1;
+    if (write(hub->event_fd, &one, sizeof(one)) == -1)
+    {
+        syslog(LOG_ERR, "write eventfd: %s", strerror(errno));
+    }
+}
+
+static void close_subscriber(struct subscription_hub *const hub, struct subscriber *const subscriber)
+{
+    async_log(LOG_DEBUG, "Closing subscriber (peer_fd=%d).", subscriber->peer_fd);
+
+    // Closing the descriptor also removes it from the epoll set.
+    TAILQ_REMOVE(&hub->subscribers, subscriber, nodes);
+    close(subscriber->peer_fd);
+    free(subscriber->taken);
+    free(subscriber);
+    __atomic_sub_fetch(&hub->subscriber_count, 1, __ATOMIC_RELAXED);
+}
+
+/// Adds the bytes of the record `record` (up to two vectors, as the ring wraps around).
+/// Must be called with the hub lock held.
+///
+static size_t record_vectors(const struct subscription_hub *const hub, const uint64_t record, struct iovec *const iov)
+{
+    const struct subscription_record *const descriptor = &hub->records[record % hub->records_capacity];
+    const size_t start = descriptor->position % hub->buffer_size;
+    const size_t first_part =
+        ((start + descriptor->size) <= hub->buffer_size) ? descriptor->size : (hub->buffer_size - start);
+
+    iov[0].iov_base = hub->buffer + start;
+    iov[0].iov_len = first_part;
+    if (first_part == descriptor->size)
+    {
+        return 1;
+    }
+    iov[1].iov_base = hub->buffer;
+    iov[1].iov_len = descriptor->size - first_part;
+    return 2;
+}
+
+/// Handles a subscriber whose next record is overwritten already (the records it has taken are never lost).
+/// Returns false if it has to be disconnected. Must be called with the hub lock held.
+///
+static bool catch_up(struct subscription_hub *const hub, struct subscriber *const subscriber)
+{
+    if (subscriber->record >= hub->records_first)
+    {
+        return true;
+    }
+    if (hub->policy == SUBSCRIBER_DISCONNECT)
+    {
+        async_log(LOG_INFO, "Subscriber fell behind, disconnecting (peer_fd=%d).", subscriber->peer_fd);
+        return false;
+    }
+    async_log(LOG_DEBUG, "Subscriber fell behind, dropping %llu record(s) (peer_fd=%d).",
+              (unsigned long long)(hub->records_first - subscriber->record), subscriber->peer_fd);
+    stats_count(STATS_SUBSCRIBER_DROPS, hub->records_first - subscriber->record);
+    subscriber->record = hub->records_first;
+    return true;
+}
+
+/// Copies the next records of the subscriber out of the ring into its `taken` buffer (as many as fit
+/// into `SUBSCRIPTION_TAKE_SIZE`, but at least one), and moves it past them. Returns false if the buffer
+/// can't be allocated. Must be called with the hub lock held (after `catch_up`).
+///
+static bool take_records(struct subscription_hub *const hub, struct subscriber *const subscriber)
+{
+    assert(subscriber->taken_sent == subscriber->taken_size);
+
+    size_t size = 0;
+    uint64_t end = subscriber->record;
+    while (end < hub->records_next)
+    {
+        const size_t record_size = hub->records[end % hub->records_capacity].size;
+        if ((end > subscriber->record) && ((size + record_size) > SUBSCRIPTION_TAKE_SIZE))
+        {
+            break;
+        }
+        size += record_size;
+        end++;
+    }
+
+    // A buffer grown for a large record is not kept for the small ones.
+    if ((size > subscriber->taken_capacity) ||
+        ((subscriber->taken_capacity > SUBSCRIPTION_TAKE_SIZE) && (size <= SUBSCRIPTION_TAKE_SIZE)))
+    {
+        const size_t capacity = (size > SUBSCRIPTION_TAKE_SIZE) ? size : SUBSCRIPTION_TAKE_SIZE;
+        free(subscriber->taken);
+        subscriber->taken_capacity = 0;
+        subscriber->taken = malloc(capacity);
+        if (subscriber->taken == NULL)
+        {
+            syslog(LOG_ERR, "malloc subscriber records: %s", strerror(errno));
+            return false;
+        }
+        subscriber->taken_capacity = capacity;
+    }
+
+    size_t copied = 0;
+    for (; subscriber->record < end; ++subscriber->record)
+    {
+        struct iovec iov[2];
+        const size_t iov_count = record_vectors(hub, subscriber->record, iov);
+        for (size_t i = 0; i < iov_count; ++i)
+        {
+            memcpy(subscriber->taken + copied, iov[i].iov_base, iov[i].iov_len);
+            copied += iov[i].iov_len;
+        }
+    }
+    subscriber->taken_size = size;
+    subscriber->taken_sent = 0;
+    return true;
+}
+
+/// Sends the subscriber as many of its pending records as its socket takes.
+///
+/// The records are copied out of the ring under the lock (so the storage thread can't overwrite them
+/// meanwhile), and sent without holding it, so a commit never waits for the subscriber sockets.
+/// The sends are non-blocking. Returns false if the subscriber has to be closed.
+///
+static bool serve_subscriber(struct subscription_hub *const hub, struct subscriber *const subscriber)
+{
+    pthread_mutex_lock(&hub->lock);
+    bool keep = catch_up(hub, subscriber);
+    pthread_mutex_unlock(&hub->lock);
+
+    while (keep && subscriber->writable)
+    {
+        if (subscriber->taken_sent == subscriber->taken_size)
+        {
+            pthread_mutex_lock(&hub->lock);
+            keep = catch_up(hub, subscriber);
+            const bool pending = keep && (subscriber->record < hub->records_next);
+            if (pending)
+            {
+                keep = take_records(hub, subscriber);
+            }
+            pthread_mutex_unlock(&hub->lock);
+            if (!keep || !pending)
+            {
+                break;
+            }
+        }
+
+        const ssize_t bytes_sent = send(subscriber->peer_fd, subscriber->taken + subscriber->taken_sent,
+                                        subscriber->taken_size - subscriber->taken_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                subscriber->writable = false;
+                break;
+            }
+            async_log(LOG_DEBUG, "Subscriber is gone: %s (peer_fd=%d).", strerror(errno), subscriber->peer_fd);
+            keep = false;
+            break;
+        }
+        stats_count(STATS_BYTES_OUT, bytes_sent);
+        subscriber->taken_sent += bytes_sent;
+    }
+    return keep;
+}
+
+/// Registers the subscribers handed over since the last wake-up.
+static void register_incoming(struct subscription_hub *const hub)
+{
+    struct subscribers_s incoming;
+    TAILQ_INIT(&incoming);
+    pthread_mutex_lock(&hub->lock);
+    TAILQ_CONCAT(&incoming, &hub->incoming, nodes);
+    pthread_mutex_unlock(&hub->lock);
+
+    struct subscriber *subscriber = NULL;
+    struct subscriber *next = NULL;
+    TAILQ_FOREACH_SAFE(subscriber, &incoming, nodes, next)
+    {
+        TAILQ_REMOVE(&incoming, subscriber, nodes);
+        TAILQ_INSERT_TAIL(&hub->subscribers, subscriber, nodes);
+
+        // Edge-triggered, so the writability is tracked by `writable` (starting with a writable socket).
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = subscriber;
+        if (epoll_ctl(hub->epoll_fd, EPOLL_CTL_ADD, subscriber->peer_fd, &event) == -1)
+        {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+            close_subscriber(hub, subscriber);
+        }
+    }
+}
+
+/// Subscribers are not expected to send anything, so whatever comes is discarded.
+/// Returns false once the peer is gone.
+///
+static bool drain_subscriber(struct subscriber *const subscriber)
+{
+    char buffer[1024];
+    for (;;)
+    {
+        const ssize_t bytes_read = recv(subscriber->peer_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (bytes_read > 0)
+        {
+            continue;
+        }
+        if (bytes_read == 0)
+        {
+            return true; // the peer only closed its sending side - it still reads the records
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+    }
+}
+
+static void *hub_thread(void *const arg)
+{
+    struct subscription_hub *const hub = arg;
+
+    struct epoll_event events[SUBSCRIPTION_MAX_EVENTS];
+    while (!__atomic_load_n(&hub->stopping, __ATOMIC_ACQUIRE))
+    {
+        const int events_count = epoll_wait(hub->epoll_fd, events, SUBSCRIPTION_MAX_EVENTS, -1);
+        if (events_count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < events_count; ++i)
+        {
+            struct subscriber *const subscriber = events[i].data.ptr;
+            if (subscriber == NULL)
+            {
+                uint64_t value;
+                if (read(hub->event_fd, &value, sizeof(value)) == -1)
+                {
+                    syslog(LOG_ERR, "read eventfd: %s", strerror(errno));
+                }
+                woken = true;
+                continue;
+            }
+
+            bool keep = ((events[i].events & (EPOLLERR | EPOLLHUP)) == 0);
+            if (keep && (events[i].events & EPOLLIN))
+            {
+                keep = drain_subscriber(subscriber);
+            }
+            if (keep && (events[i].events & EPOLLOUT))
+            {
+                subscriber->writable = true;
+                keep = serve_subscriber(hub, subscriber);
+            }
+            if (!keep)
+            {
+                close_subscriber(hub, subscriber);
+            }
+        }
+
+        // New records (or subscribers) go to everyone who can take them; the others are only checked
+        // for falling behind (so that they are disconnected right away, if that's the policy).
+        //
+        if (woken)
+        {
+            register_incoming(hub);
+
+            struct subscriber *subscriber = NULL;
+            struct subscriber *next = NULL;
+            TAILQ_FOREACH_SAFE(subscriber, &hub->subscribers, nodes, next)
+            {
+                if (!serve_subscriber(hub, subscriber))
+                {
+                    close_subscriber(hub, subscriber);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+struct subscription_hub *subscription_hub_create(const size_t buffer_size, const enum subscriber_policy policy)
+{
+    assert(buffer_size > 0);
+
+    struct subscription_hub *const hub = calloc(1, sizeof(struct subscription_hub));
+    if (hub == NULL)
+    {
+        syslog(LOG_ERR, "malloc `subscription_hub`: %s", strerror(errno));
+        return NULL;
+    }
+    hub->policy = policy;
+    hub->epoll_fd = -1;
+    hub->event_fd = -1;
+    pthread_mutex_init(&hub->lock, NULL);
+    TAILQ_INIT(&hub->incoming);
+    TAILQ_INIT(&hub->subscribers);
+
+    // Short records are the common case, so there are plenty of descriptors per buffer byte.
+    hub->buffer_size = buffer_size;
+    hub->records_capacity = (buffer_size / 32) + 1;
+    hub->buffer = malloc(buffer_size);
+    hub->records = malloc(hub->records_capacity * sizeof(struct subscription_record));
+    if ((hub->buffer == NULL) || (hub->records == NULL))
+    {
+        syslog(LOG_ERR, "malloc subscription buffer: %s", strerror(errno));
+        subscription_hub_destroy(hub);
+        return NULL;
+    }
+
+    hub->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    hub->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ((hub->epoll_fd == -1) || (hub->event_fd == -1))
+    {
+        syslog(LOG_ERR, "epoll_create1/eventfd: %s", strerror(errno));
+        subscription_hub_destroy(hub);
+        return NULL;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(hub->epoll_fd, EPOLL_CTL_ADD, hub->event_fd, &event) == -1)
+    {
+        syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+        subscription_hub_destroy(hub);
+        return NULL;
+    }
+
+    if (!create_unsignalled_thread(&hub->thread, hub_thread, hub))
+    {
+        subscription_hub_destroy(hub);
+        return NULL;
+    }
+    hub->started = true;
+    return hub;
+}
+
+void subscription_hub_destroy(struct subscription_hub *const hub)
+{
+    if (hub == NULL)
+    {
+        return;
+    }
+
+    if (hub->started)
+    {
+        __atomic_store_n(&hub->stopping, true, __ATOMIC_RELEASE);
+        wake_hub(hub);
+        pthread_join(hub->thread, NULL);
+    }
+
+    register_incoming(hub);
+    while (!TAILQ_EMPTY(&hub->subscribers))
+    {
+        close_subscriber(hub, TAILQ_FIRST(&hub->subscribers));
+    }
+
+    if (hub->event_fd >= 0)
+    {
+        close(hub->event_fd);
+    }
+    if (hub->epoll_fd >= 0)
+    {
+        close(hub->epoll_fd);
+    }
+    free(hub->records);
+    free(hub->buffer);
+    pthread_mutex_destroy(&hub->lock);
+    free(hub);
+}
+
+/// Forgets the records which don't fit into the ring any more. Must be called with the hub lock held.
+static void evict_records(struct subscription_hub *const hub)
+{
+    const uint64_t oldest_byte = (hub->head > hub->buffer_size) ? (hub->head - hub->buffer_size) : 0;
+    while ((hub->records_first < hub->records_next) &&
+           (hub->records[hub->records_first % hub->records_capacity].position < oldest_byte))
+    {
+        hub->records_first++;
+    }
+}
+
+void subscription_hub_publish(struct subscription_hub *const hub, const struct iovec *const records,
+                              const size_t count, const uint64_t first_sequence)
+{
+    assert(hub != NULL);
+    assert(records != NULL);
+
+    pthread_mutex_lock(&hub->lock);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if ((hub->records_next - hub->records_first) == hub->records_capacity)
+        {
+            hub->records_first++; // its descriptor slot is taken by the new record
+        }
+
+        // A record larger than the whole ring is not copied at all: it's evicted right away,
+        // so the subscribers which didn't get past it yet are treated as fallen behind.
+        //
+        const size_t size = records[i].iov_len;
+        if (size <= hub->buffer_size)
+        {
+            const size_t start = hub->head % hub->buffer_size;
+            const size_t first_part = ((start + size) <= hub->buffer_size) ? size : (hub->buffer_size - start);
+            memcpy(hub->buffer + start, records[i].iov_base, first_part);
+            memcpy(hub->buffer, (const char *)records[i].iov_base + first_part, size - first_part);
+        }
+
+        struct subscription_record *const descriptor = &hub->records[hub->records_next % hub->records_capacity];
+        descriptor->sequence = first_sequence + i;
+        descriptor->position = hub->head;
+        descriptor->size = size;
+        hub->records_next++;
+        hub->head += size;
+        evict_records(hub);
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    if (__atomic_load_n(&hub->subscriber_count, __ATOMIC_RELAXED) > 0)
+    {
+        wake_hub(hub);
+    }
+}
+
+uint64_t subscription_hub_cursor(struct subscription_hub *const hub, const uint64_t from_sequence)
+{
+    assert(hub != NULL);
+
+    pthread_mutex_lock(&hub->lock);
+    uint64_t cursor = hub->records_next;
+    if (from_sequence > 0)
+    {
+        // Binary search of the first buffered record at or after the sequence number (they are in order).
+        uint64_t low = hub->records_first;
+        uint64_t high = hub->records_next;
+        while (low < high)
+        {
+            const uint64_t middle = low + ((high - low) / 2);
+            if (hub->records[middle % hub->records_capacity].sequence < from_sequence)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        cursor = low;
+    }
+    pthread_mutex_unlock(&hub->lock);
+    return cursor;
+}
+
+bool subscription_hub_add(struct subscription_hub *const hub, const int peer_fd, const uint64_t cursor)
+{
+    assert(hub != NULL);
+    assert(peer_fd >= 0);
+
+    // The thread engine hands over blocking sockets.
+    const int flags = fcntl(peer_fd, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(peer_fd, F_SETFL, flags | O_NONBLOCK) == -1))
+    {
+        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+        close(peer_fd);
+        return false;
+    }
+
+    struct subscriber *const subscriber = malloc(sizeof(struct subscriber));
+    if (subscriber == NULL)
+    {
+        syslog(LOG_ERR, "malloc `subscriber`: %s", strerror(errno));
+        close(peer_fd);
+        return false;
+    }
+    subscriber->peer_fd = peer_fd;
+    subscriber->record = cursor;
+    subscriber->taken = NULL;
+    subscriber->taken_capacity = 0;
+    subscriber->taken_size = 0;
+    subscriber->taken_sent = 0;
+    subscriber->writable = true;
+
+    pthread_mutex_lock(&hub->lock);
+    TAILQ_INSERT_TAIL(&hub->incoming, subscriber, nodes);
+    __atomic_add_fetch(&hub->subscriber_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hub->lock);
+
+    stats_count(STATS_SUBSCRIPTIONS, 1);
+    async_log(LOG_DEBUG, "New subscriber from record %llu (peer_fd=%d).", (unsigned long long)cursor, peer_fd);
+    wake_hub(hub);
+    return true;
+}
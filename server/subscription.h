@@ -0,0 +1,100 @@
+#ifndef AESDSOCKET_SUBSCRIPTION_H
+#define AESDSOCKET_SUBSCRIPTION_H
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/// Suggested size of the fan-out buffer of the most recent records (subscriptions are enabled by giving one).
+#define SUBSCRIPTION_SUGGESTED_BUFFER_SIZE (4UL * 1024 * 1024)
+
+/// What happens to a subscriber which falls behind the whole fan-out buffer.
+enum subscriber_policy
+{
+    SUBSCRIBER_DROP,       // skip to the oldest buffered record (the records in between are lost)
+    SUBSCRIBER_DISCONNECT, // close the connection
+};
+
+/// A record in the fan-out buffer.
+struct subscription_record
+{
+    uint64_t sequence; // commit sequence number (see `commit_position`)
+    uint64_t position; // of the first byte among all bytes ever buffered
+    size_t size;
+};
+
+/// A connection which receives the committed records (owned by the hub thread once registered).
+struct subscriber
+{
+    int peer_fd;
+    uint64_t record; // number of the next record to send
+    bool writable;   // the socket didn't report it's full since the last `EPOLLOUT`
+
+    // Records taken out of the ring (the ones before `record`), and not sent completely yet.
+    char *taken;
+    size_t taken_capacity;
+    size_t taken_size;
+    size_t taken_sent;
+
+    TAILQ_ENTRY(subscriber) nodes;
+};
+
+TAILQ_HEAD(subscribers_s, subscriber);
+
+/// Broadcast of the committed records to subscribed connections.
+///
+/// The storage thread copies every committed batch into a bounded ring (`buffer` plus the record descriptors)
+/// and wakes up the hub thread, which pushes the new records to all subscribers from there, each from
+/// its own cursor: a batch of records at a time is copied out of the ring under the lock, and sent without it.
+/// So a subscriber never blocks writers, nor other subscribers: one falling so far behind that its next record
+/// is overwritten is handled by the `policy`.
+///
+struct subscription_hub
+{
+    enum subscriber_policy policy;
+    int epoll_fd;
+    int event_fd; // bumped on new records (and new subscribers)
+    pthread_t thread;
+    bool started;
+    bool stopping;
+
+    // The ring is written by the storage thread and read by the hub thread under `lock`
+    // (which also protects `incoming`).
+    //
+    pthread_mutex_t lock;
+    char *buffer;
+    size_t buffer_size;
+    uint64_t head; // number of bytes ever buffered
+    struct subscription_record *records;
+    size_t records_capacity;
+    uint64_t records_first; // number of the oldest buffered record
+    uint64_t records_next;  // number of the next record to buffer
+    struct subscribers_s incoming;
+    unsigned subscriber_count;
+
+    struct subscribers_s subscribers; // registered ones (hub thread only)
+};
+
+/// Allocates the fan-out buffer, and starts the hub thread. Returns NULL on failure.
+struct subscription_hub *subscription_hub_create(size_t buffer_size, enum subscriber_policy policy);
+
+/// Stops the hub thread, and closes all subscribers.
+void subscription_hub_destroy(struct subscription_hub *hub);
+
+/// Buffers the committed records (storage thread only); `first_sequence` is the sequence number of the first one.
+void subscription_hub_publish(struct subscription_hub *hub, const struct iovec *records, size_t count,
+                              uint64_t first_sequence);
+
+/// Returns the cursor of a subscriber starting at the record `from_sequence`
+/// (the oldest one still buffered if it's gone already), or right after the last record if it's 0.
+///
+uint64_t subscription_hub_cursor(struct subscription_hub *hub, uint64_t from_sequence);
+
+/// Takes over the connection (closing it on failure), and streams the records to it from the `cursor`.
+bool subscription_hub_add(struct subscription_hub *hub, int peer_fd, uint64_t cursor);
+
+#endif // AESDSOCKET_SUBSCRIPTION_H
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE // accept4, MSG_CMSG_CLOEXEC
+
+#include "upgrade.h"
+#include "background_thread.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/// "AESU" and the protocol version, so a successor of an incompatible build is refused.
+#define UPGRADE_MAGIC 0x41455355U
+#define UPGRADE_VERSION 1U
+
+/// How often the engines are reminded to drain (a signal could arrive just before a blocking call).
+#define UPGRADE_DRAIN_KICK_MS 100
+
+/// The predecessor's first message, sent along with the listening sockets.
+struct upgrade_hello
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t listeners_count;
+};
+
+struct upgrade_server
+{
+    pthread_t thread;
+    int stop_fd;
+    int listen_fd;
+    int successor_fd; // -1 until the listeners are handed over
+    char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    ino_t path_inode; // of the socket file, to recognize a successor's one at the same path
+
+    const int *listeners;
+    size_t listeners_count;
+    long long drain_timeout_ms;
+    upgrade_drain_fn drain;
+    void *context;
+};
+
+static bool fill_address(struct sockaddr_un *const addr, const char *const path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        syslog(LOG_ERR, "upgrade socket path is too long: %s", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool send_all(const int fd, const void *const data, const size_t size)
+{
+    size_t sent = 0;
+    while (sent < size)
+    {
+        const ssize_t bytes = send(fd, (const char *)data + sent, size - sent, MSG_NOSIGNAL);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "send to the upgrade peer: %s", strerror(errno));
+            return false;
+        }
+        sent += bytes;
+    }
+    return true;
+}
+
+static bool recv_all(const int fd, void *const data, const size_t size)
+{
+    size_t received = 0;
+    while (received < size)
+    {
+        const ssize_t bytes = recv(fd, (char *)data + received, size - received, 0);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "recv from the upgrade peer: %s", strerror(errno));
+            return false;
+        }
+        if (bytes == 0)
+        {
+            syslog(LOG_ERR, "The upgrade peer has closed the connection.");
+            return false;
+        }
+        received += bytes;
+    }
+    return true;
+}
+
+/// Sends the hello with the listening sockets attached.
+static bool send_listeners(struct upgrade_server *const server, const int conn_fd)
+{
+    struct upgrade_hello hello;
+    hello.magic = UPGRADE_MAGIC;
+    hello.version = UPGRADE_VERSION;
+    hello.listeners_count = server->listeners_count;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+
+    union
+    {
+        char buffer[CMSG_SPACE(UPGRADE_MAX_LISTENERS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(server->listeners_count * sizeof(int));
+
+    struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(server->listeners_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), server->listeners, server->listeners_count * sizeof(int));
+
+    if (sendmsg(conn_fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello))
+    {
+        syslog(LOG_ERR, "sendmsg to the successor: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static long long elapsed_ms(const struct timespec *const since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - since->tv_sec) * 1000LL) + ((now.tv_nsec - since->tv_nsec) / 1000000LL);
+}
+
+static void *upgrade_thread(void *const arg)
+{
+    struct upgrade_server *const server = arg;
+    assert(server != NULL);
+
+    struct pollfd fds[2];
+    fds[0].fd = server->stop_fd;
+    fds[1].fd = server->listen_fd;
+    fds[0].events = fds[1].events = POLLIN;
+
+    // Wait for the successor.
+    //
+    while (server->successor_fd == -1)
+    {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "poll: %s", strerror(errno));
+            return NULL;
+        }
+        if (fds[0].revents != 0)
+        {
+            return NULL;
+        }
+        if (fds[1].revents != 0)
+        {
+            const int conn_fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn_fd == -1)
+            {
+                continue;
+            }
+            if (send_listeners(server, conn_fd))
+            {
+                server->successor_fd = conn_fd;
+            }
+            else
+            {
+                close(conn_fd);
+            }
+        }
+    }
+    syslog(LOG_INFO, "Listeners handed over to the successor, serving until there is no client.");
+
+    // Drain (and then stop) the engines until they are done.
+    //
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (;;)
+    {
+        server->drain(server->context, elapsed_ms(&started) >= server->drain_timeout_ms);
+
+        fds[0].revents = 0;
+        if ((poll(fds, 1, UPGRADE_DRAIN_KICK_MS) > 0) && (fds[0].revents != 0))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int open_endpoint(struct upgrade_server *const server, const char *const path)
+{
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path))
+    {
+        return -1;
+    }
+
+    const int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd == -1)
+    {
+        syslog(LOG_ERR, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // The predecessor's socket (if any) is replaced: it's done with the hand-over, or there is none running.
+    unlink(path);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        syslog(LOG_ERR, "bind upgrade socket %s: %s", path, strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    struct stat st;
+    server->path_inode = (stat(path, &st) == 0) ? st.st_ino : 0;
+    strcpy(server->path, path);
+
+    if (listen(sock_fd, 1) == -1)
+    {
+        syslog(LOG_ERR, "listen: %s", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+static void close_server_fds(struct upgrade_server *const server)
+{
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+    }
+    if (server->path[0] != '\0')
+    {
+        struct stat st;
+        if ((stat(server->path, &st) == 0) && (st.st_ino == server->path_inode))
+        {
+            unlink(server->path);
+        }
+    }
+    if (server->successor_fd >= 0)
+    {
+        close(server->successor_fd);
+    }
+    if (server->stop_fd >= 0)
+    {
+        close(server->stop_fd);
+    }
+}
+
+struct upgrade_server *upgrade_server_start(const char *const path, const int *const listen_fds, const size_t count,
+                                            const unsigned long drain_timeout_s, const upgrade_drain_fn drain,
+                                            void *const context)
+{
+    assert(path != NULL);
+    assert(listen_fds != NULL);
+    assert(drain != NULL);
+
+    if ((count == 0) || (count > UPGRADE_MAX_LISTENERS))
+    {
+        syslog(LOG_ERR, "Can't hand over %zu listeners (at most %d).", count, UPGRADE_MAX_LISTENERS);
+        return NULL;
+    }
+
+    struct upgrade_server *const server = malloc(sizeof(struct upgrade_server));
+    if (server == NULL)
+    {
+        syslog(LOG_ERR, "malloc `upgrade_server`: %s", strerror(errno));
+        return NULL;
+    }
+    server->stop_fd = -1;
+    server->listen_fd = -1;
+    server->successor_fd = -1;
+    server->path[0] = '\0';
+    server->listeners = listen_fds;
+    server->listeners_count = count;
+    server->drain_timeout_ms =
+        (drain_timeout_s < (unsigned long)(LLONG_MAX / 1000)) ? (long long)drain_timeout_s * 1000LL : LLONG_MAX;
+    server->drain = drain;
+    server->context = context;
+
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->stop_fd == -1)
+    {
+        syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+        close_server_fds(server);
+        free(server);
+        return NULL;
+    }
+    server->listen_fd = open_endpoint(server, path);
+    if (server->listen_fd == -1)
+    {
+        close_server_fds(server);
+        free(server);
+        return NULL;
+    }
+
+    if (!create_unsignalled_thread(&server->thread, upgrade_thread, server))
+    {
+        close_server_fds(server);
+        free(server);
+        return NULL;
+    }
+    return server;
+}
+
+bool upgrade_server_stop(struct upgrade_server *const server)
+{
+    if (server == NULL)
+    {
+        return false;
+    }
+
+    const uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        syslog(LOG_ERR, "write eventfd: %s", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+    return server->successor_fd >= 0;
+}
+
+void upgrade_server_release(struct upgrade_server *const server, const void *const store_state, const size_t size)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+
+    // Without any state the successor just sees the connection closed.
+    if ((server->successor_fd >= 0) && (store_state != NULL))
+    {
+        const uint64_t state_size = size;
+        if (send_all(server->successor_fd, &state_size, sizeof(state_size)))
+        {
+            send_all(server->successor_fd, store_state, state_size);
+        }
+    }
+    close_server_fds(server);
+    free(server);
+}
+
+int upgrade_take_over(const char *const path, int *const listen_fds, const size_t capacity, size_t *const count)
+{
+    assert(path != NULL);
+    assert(listen_fds != NULL);
+    assert(count != NULL);
+
+    struct sockaddr_un addr;
+    if (!fill_address(&addr, path))
+    {
+        return -1;
+    }
+    const int conn_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn_fd == -1)
+    {
+        syslog(LOG_ERR, "socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(conn_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        // Nobody to take over from (the first start, or the predecessor is gone).
+        close(conn_fd);
+        return -1;
+    }
+
+    struct upgrade_hello hello;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    union
+    {
+        char buffer[CMSG_SPACE(UPGRADE_MAX_LISTENERS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while ((received == -1) && (errno == EINTR));
+
+    const struct cmsghdr *const cmsg = (received == (ssize_t)sizeof(hello)) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+    {
+        syslog(LOG_ERR, "The predecessor at %s didn't hand over any listener.", path);
+        close(conn_fd);
+        return -1;
+    }
+    const size_t passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int passed_fds[UPGRADE_MAX_LISTENERS];
+    memcpy(passed_fds, CMSG_DATA(cmsg), passed * sizeof(int));
+
+    if ((hello.magic != UPGRADE_MAGIC) || (hello.version != UPGRADE_VERSION) || (passed == 0) ||
+        (passed != hello.listeners_count) || (passed > capacity))
+    {
+        syslog(LOG_ERR, "Incompatible hand-over from the predecessor at %s.", path);
+        for (size_t i = 0; i < passed; ++i)
+        {
+            close(passed_fds[i]);
+        }
+        close(conn_fd);
+        return -1;
+    }
+
+    memcpy(listen_fds, passed_fds, passed * sizeof(int));
+    *count = passed;
+    return conn_fd;
+}
+
+void *upgrade_receive_store(const int conn_fd, size_t *const size)
+{
+    assert(conn_fd >= 0);
+    assert(size != NULL);
+
+    void *state = NULL;
+    uint64_t state_size = 0;
+    if (recv_all(conn_fd, &state_size, sizeof(state_size)) && (state_size > 0))
+    {
+        state = malloc(state_size);
+        if (state == NULL)
+        {
+            syslog(LOG_ERR, "malloc store state: %s", strerror(errno));
+        }
+        else if (!recv_all(conn_fd, state, state_size))
+        {
+            free(state);
+            state = NULL;
+        }
+    }
+    close(conn_fd);
+
+    *size = (state != NULL) ? state_size : 0;
+    return state;
+}
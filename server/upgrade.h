@@ -0,0 +1,58 @@
+#ifndef AESDSOCKET_UPGRADE_H
+#define AESDSOCKET_UPGRADE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Maximum number of listening sockets handed over.
+#define UPGRADE_MAX_LISTENERS 64
+
+/// How long the predecessor lets its clients finish after the hand-over by default, before closing them.
+#define UPGRADE_DEFAULT_DRAIN_TIMEOUT_S 5
+
+/// Hot upgrade: a new server process takes over the listening sockets of the running one.
+///
+/// Every server started with an upgrade socket path serves it (see `upgrade_server_start`). A new process
+/// started with the same path connects to it first (see `upgrade_take_over`), and gets the listening sockets
+/// passed with SCM_RIGHTS, so the port is never closed and no connection is refused. The new process can't serve
+/// anything before it has the store, so the predecessor keeps serving and accepting until it has no client left
+/// (or the drain timeout expires, and it closes them), then stops accepting and passes its store state to the new
+/// process, which adopts the store files as they are (see `group_commit_hand_over`) and takes accepting over.
+///
+struct upgrade_server;
+
+/// Called by the upgrade thread once the listeners are handed over (and then periodically, until
+/// the server is stopped): the engines should return as soon as they have no client (accepting meanwhile),
+/// or close them right away if `stop` is set (the drain timeout has expired).
+///
+typedef void (*upgrade_drain_fn)(void *context, bool stop);
+
+/// Starts the thread which hands the listeners over to the first process connecting to `path`
+/// (a Unix socket, replacing the one of the predecessor if any), and then drains the engines for up to
+/// `drain_timeout_s` seconds. Returns NULL on failure.
+///
+struct upgrade_server *upgrade_server_start(const char *path, const int *listen_fds, size_t count,
+                                            unsigned long drain_timeout_s, upgrade_drain_fn drain, void *context);
+
+/// Stops and joins the upgrade thread. Returns true if the listeners were handed over
+/// (the successor is waiting for the store state then, see `upgrade_server_release`).
+///
+bool upgrade_server_stop(struct upgrade_server *server);
+
+/// Passes the store state (`size` bytes, unless NULL) to the successor (if any), removes the Unix socket
+/// (unless it's the successor's already), and deallocates the server.
+///
+void upgrade_server_release(struct upgrade_server *server, const void *store_state, size_t size);
+
+/// Connects to the predecessor serving `path`, and takes its listening sockets over (at most `capacity`;
+/// they are shared with the predecessor until it exits, including their O_NONBLOCK flag). Returns the connection to receive the store state through (see `upgrade_receive_store`),
+/// or -1 if there is no predecessor (or the hand-over failed).
+///
+int upgrade_take_over(const char *path, int *listen_fds, size_t capacity, size_t *count);
+
+/// Waits until the predecessor has released the store, and returns its state (allocated with `malloc`, `*size`
+/// bytes), or NULL if there is none (or on failure). Closes the connection.
+///
+void *upgrade_receive_store(int conn_fd, size_t *size);
+
+#endif // AESDSOCKET_UPGRADE_H
@@ -0,0 +1,990 @@
+#define _GNU_SOURCE // MAP_POPULATE
+
+#include "uring.h"
+#include "async_log.h"
+#include "client_flow.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && \
+    defined(IORING_CQE_F_MORE)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#if HAVE_IO_URING
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024 // number of provided receive buffers (must be a power of 2)
+#define URING_BUFFER_GROUP 0
+
+// Operation tag, stored in the low bits of the request `user_data` (the rest is the client pointer).
+//
+#define URING_OP_ACCEPT 0ULL
+#define URING_OP_RECV 1ULL
+#define URING_OP_SEND 2ULL
+#define URING_OP_READ 3ULL
+#define URING_OP_CANCEL 4ULL
+#define URING_OP_COMMIT 5ULL // the poll of the commit notifier
+#define URING_OP_MASK 7ULL
+
+struct uring_client
+{
+    struct client_info *client;
+
+    unsigned inflight; // requests still to complete (including the multishot recv)
+    bool recv_armed;   // the multishot recv is active
+    bool recv_paused;  // the multishot recv is being cancelled (see `pause_recv`)
+    bool sending;      // a reply chunk is in flight
+    bool linked;       // the chunk in flight is a linked read + send pair
+    bool short_read;   // the linked read was short, so the send is cancelled, and what was read is to be sent
+    bool header;       // the send in flight is the binary response header
+    size_t chunk_size; // bytes in the chunk in flight
+    char *chunk;       // buffer for the file reads (lazily allocated)
+    bool eof;          // the peer has closed its side (or failed)
+    bool closing;
+    bool handoff;      // the peer has subscribed, so the connection goes to the hub once closed here
+
+    TAILQ_ENTRY(uring_client) nodes;
+};
+
+struct uring
+{
+    int ring_fd;
+    void *ring_ptr;
+    size_t ring_size;
+
+    // Submission queue.
+    //
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail; // includes prepared but not yet published entries
+    unsigned sq_submitted;
+
+    // Completion queue.
+    //
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers.
+    //
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+
+    // The appends are asynchronous: the notifier is polled through the ring.
+    //
+    struct commit_notifier notifier;
+    bool notifier_ready;
+    bool commit_armed;
+    bool commit_cancelled;
+
+    int server_sock_fd;
+    struct shared_info *shared;
+    bool accept_armed;
+    bool accept_cancelled;
+    bool accepted_any;
+    bool unsupported;
+    TAILQ_HEAD(uring_clients_s, uring_client) clients;
+};
+
+static int sys_io_uring_setup(const unsigned entries, struct io_uring_params *const params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(const int ring_fd, const unsigned to_submit, const unsigned min_complete,
+                              const unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(const int ring_fd, const unsigned opcode, void *const arg, const unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/// Publishes prepared submissions, and waits for at least `wait_nr` completions.
+static int submit_and_wait(struct uring *const ring, const unsigned wait_nr)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    const unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+    const int res = sys_io_uring_enter(ring->ring_fd, to_submit, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    if (res > 0)
+    {
+        ring->sq_submitted += res;
+    }
+    return res;
+}
+
+/// Gets the next free submission entry (submitting the queue first if it's full).
+static struct io_uring_sqe *get_sqe(struct uring *const ring)
+{
+    if ((ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries)
+    {
+        submit_and_wait(ring, 0);
+        if ((ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries)
+        {
+            syslog(LOG_ERR, "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *const sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+static uint64_t make_user_data(const struct uring_client *const uring_client, const uint64_t op)
+{
+    return (uint64_t)(uintptr_t)uring_client | op;
+}
+
+static void provide_buffer(struct uring *const ring, const unsigned short buffer_id)
+{
+    struct io_uring_buf *const buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + ((size_t)buffer_id * BUFFER_SIZE));
+    buf->len = BUFFER_SIZE;
+    buf->bid = buffer_id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static bool uring_init(struct uring *const ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4; // multishot requests produce many completions per submission
+
+    ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->ring_fd == -1)
+    {
+        syslog(LOG_WARNING, "io_uring_setup: %s", strerror(errno));
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+    {
+        syslog(LOG_WARNING, "io_uring: single mmap is not supported");
+        return false;
+    }
+
+    // Both rings share the same mapping.
+    //
+    const size_t sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    const size_t cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        ring->ring_ptr = NULL;
+        syslog(LOG_ERR, "mmap io_uring: %s", strerror(errno));
+        return false;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        syslog(LOG_ERR, "mmap io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    char *const ring_ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned *)(ring_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ring_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(ring_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    unsigned *const sq_array = (unsigned *)(ring_ptr + params.sq_off.array);
+    for (unsigned i = 0; i < ring->sq_entries; ++i)
+    {
+        sq_array[i] = i; // submission entries are always used in the ring order
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sq_submitted = ring->sq_local_tail;
+
+    ring->cq_head = (unsigned *)(ring_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(ring_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring_ptr + params.cq_off.cqes);
+
+    // Register the ring of provided buffers, which multishot recv picks buffers from.
+    //
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        syslog(LOG_ERR, "mmap buffer ring: %s", strerror(errno));
+        return false;
+    }
+    ring->buffers = malloc((size_t)URING_BUFFERS * BUFFER_SIZE);
+    if (ring->buffers == NULL)
+    {
+        syslog(LOG_ERR, "malloc io_uring buffers: %s", strerror(errno));
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        syslog(LOG_WARNING, "io_uring_register (buffer ring): %s", strerror(errno));
+        return false;
+    }
+
+    ring->buf_tail = 0;
+    for (unsigned i = 0; i < URING_BUFFERS; ++i)
+    {
+        provide_buffer(ring, i);
+    }
+
+    return true;
+}
+
+static void uring_deinit(struct uring *const ring)
+{
+    if (ring->notifier_ready)
+    {
+        commit_notifier_destroy(&ring->notifier);
+    }
+    if (ring->ring_fd >= 0)
+    {
+        close(ring->ring_fd);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->ring_ptr != NULL)
+    {
+        munmap(ring->ring_ptr, ring->ring_size);
+    }
+    if (ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buffers);
+}
+
+static void arm_accept(struct uring *const ring)
+{
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = ring->server_sock_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = make_user_data(NULL, URING_OP_ACCEPT);
+        ring->accept_armed = true;
+        ring->accept_cancelled = false;
+    }
+}
+
+/// Cancels the multishot accept (if armed and not cancelled yet).
+static void cancel_accept(struct uring *const ring)
+{
+    if (ring->accept_armed && !ring->accept_cancelled)
+    {
+        struct io_uring_sqe *const sqe = get_sqe(ring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = make_user_data(NULL, URING_OP_ACCEPT);
+            sqe->user_data = make_user_data(NULL, URING_OP_CANCEL);
+            ring->accept_cancelled = true;
+        }
+    }
+}
+
+static void arm_commit(struct uring *const ring)
+{
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = ring->notifier.event_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = make_user_data(NULL, URING_OP_COMMIT);
+        ring->commit_armed = true;
+    }
+}
+
+/// Cancels the poll of the commit notifier (once no client is left to complete).
+static void cancel_commit(struct uring *const ring)
+{
+    if (ring->commit_armed && !ring->commit_cancelled)
+    {
+        struct io_uring_sqe *const sqe = get_sqe(ring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = make_user_data(NULL, URING_OP_COMMIT);
+            sqe->user_data = make_user_data(NULL, URING_OP_CANCEL);
+            ring->commit_cancelled = true;
+        }
+    }
+}
+
+static void arm_recv(struct uring *const ring, struct uring_client *const uring_client)
+{
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = uring_client->client->peer_fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = make_user_data(uring_client, URING_OP_RECV);
+        uring_client->recv_armed = true;
+        uring_client->recv_paused = false;
+        uring_client->inflight++;
+    }
+}
+
+/// Backpressure: cancels the multishot recv while the peer keeps sending without reading the pending reply
+/// (the received data is not processed until the reply is sent, or the append is committed, so it would pile up
+/// without a limit).
+/// It's re-armed by `pump_client` once the reply is sent.
+///
+static void pause_recv(struct uring *const ring, struct uring_client *const uring_client)
+{
+    const struct client_info *const client = uring_client->client;
+    const bool waiting = client->reply_pending || client_commit_pending(client);
+    if (!uring_client->recv_armed || uring_client->recv_paused || uring_client->closing || !waiting ||
+        ((recv_buffer_pending(&client->received) + recv_buffer_pending(&client->held)) <= BUFFER_SIZE))
+    {
+        return;
+    }
+
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_user_data(uring_client, URING_OP_RECV);
+        sqe->user_data = make_user_data(NULL, URING_OP_CANCEL);
+        uring_client->recv_paused = true;
+    }
+}
+
+/// Submits a send; with `more` set, more data follows right away, so it's not pushed out on its own.
+static bool submit_send(struct uring *const ring, struct uring_client *const uring_client, const char *const data,
+                        const size_t size, const bool more)
+{
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uring_client->client->peer_fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = size;
+    sqe->msg_flags = more ? (MSG_NOSIGNAL | MSG_WAITALL | MSG_MORE) : (MSG_NOSIGNAL | MSG_WAITALL);
+    sqe->user_data = make_user_data(uring_client, URING_OP_SEND);
+    uring_client->inflight++;
+    return true;
+}
+
+/// Submits the next chunk of the pending reply.
+///
+/// Snapshots are sent as is from memory (the device copy, or the mapped log segments). File content is read into the client's chunk buffer first;
+/// when the chunk size is known up front (the reply end is known) the send is linked to the read,
+/// so both are submitted at once.
+///
+static bool submit_reply_chunk(struct uring *const ring, struct uring_client *const uring_client)
+{
+    struct client_info *const client = uring_client->client;
+    assert(client->reply_pending);
+    assert(!uring_client->sending);
+
+    const struct store_snapshot *const snapshot = client->reply_snapshot;
+    if (snapshot != NULL)
+    {
+        // One contiguous chunk at a time (the log segments are not adjacent in memory).
+        struct snapshot_chunk chunk;
+        store_snapshot_chunk(snapshot, client->reply_offset, &chunk);
+        const off_t bytes_to_end = client->reply_end - client->reply_offset;
+        uring_client->linked = false;
+        uring_client->chunk_size = ((off_t)chunk.size < bytes_to_end) ? chunk.size : (size_t)bytes_to_end;
+        uring_client->sending = submit_send(ring, uring_client, chunk.data, uring_client->chunk_size,
+                                            (off_t)uring_client->chunk_size < bytes_to_end);
+        return uring_client->sending;
+    }
+
+    if (uring_client->chunk == NULL)
+    {
+        uring_client->chunk = malloc(BUFFER_SIZE);
+        if (uring_client->chunk == NULL)
+        {
+            syslog(LOG_ERR, "malloc reply chunk: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    size_t chunk_size = BUFFER_SIZE;
+    if ((client->reply_end >= 0) && ((off_t)chunk_size > (client->reply_end - client->reply_offset)))
+    {
+        chunk_size = client->reply_end - client->reply_offset;
+    }
+
+    struct io_uring_sqe *const sqe = get_sqe(ring);
+    if (sqe == NULL)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = client->file_fd;
+    sqe->addr = (uint64_t)(uintptr_t)uring_client->chunk;
+    sqe->len = chunk_size;
+    sqe->off = client->reply_offset;
+    sqe->user_data = make_user_data(uring_client, URING_OP_READ);
+    uring_client->inflight++;
+
+    uring_client->linked = (client->reply_end >= 0);
+    uring_client->short_read = false;
+    uring_client->chunk_size = chunk_size;
+    uring_client->sending = true;
+    if (uring_client->linked)
+    {
+        sqe->flags = IOSQE_IO_LINK;
+        submit_send(ring, uring_client, uring_client->chunk, chunk_size,
+                    (client->reply_offset + (off_t)chunk_size) < client->reply_end);
+    }
+    return true;
+}
+
+static void begin_close(struct uring_client *const uring_client)
+{
+    if (!uring_client->closing)
+    {
+        uring_client->closing = true;
+
+        // Completes the multishot recv (and any send in flight), so the client could be freed.
+        shutdown(uring_client->client->peer_fd, SHUT_RDWR);
+    }
+}
+
+/// Stops receiving on the peer socket (without shutting it down), so that it could be handed off
+/// once the multishot recv completes.
+///
+static void begin_handoff(struct uring *const ring, struct uring_client *const uring_client)
+{
+    uring_client->closing = true;
+    uring_client->handoff = true;
+    if (uring_client->recv_armed)
+    {
+        struct io_uring_sqe *const sqe = get_sqe(ring);
+        if (sqe == NULL)
+        {
+            // The subscription is lost, but the client can't hang around either.
+            uring_client->handoff = false;
+            shutdown(uring_client->client->peer_fd, SHUT_RDWR);
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_user_data(uring_client, URING_OP_RECV);
+        sqe->user_data = make_user_data(NULL, URING_OP_CANCEL);
+    }
+}
+
+static void free_if_closed(struct uring *const ring, struct uring_client *const uring_client)
+{
+    // An append in flight still has its requests in the client.
+    if (uring_client->closing && (uring_client->inflight == 0) && !client_commit_pending(uring_client->client))
+    {
+        if (uring_client->handoff)
+        {
+            client_hand_off(uring_client->client);
+        }
+        async_log(LOG_DEBUG, "Closing client (peer_fd=%d).", uring_client->client->peer_fd);
+
+        TAILQ_REMOVE(&ring->clients, uring_client, nodes);
+        client_info_destroy(uring_client->client);
+        free(uring_client->chunk);
+        free(uring_client);
+    }
+}
+
+/// Moves the client forward: sends the pending reply, processes received packets one by one,
+/// and re-arms the receiving when needed.
+///
+static void pump_client(struct uring *const ring, struct uring_client *const uring_client)
+{
+    struct client_info *const client = uring_client->client;
+    if (uring_client->closing || uring_client->sending)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        if (client->reply_pending)
+        {
+            if (client->reply_header_sent < client->reply_header_size)
+            {
+                uring_client->header = true;
+                uring_client->sending =
+                    submit_send(ring, uring_client, client->reply_header + client->reply_header_sent,
+                                client->reply_header_size - client->reply_header_sent,
+                                client->reply_offset < client->reply_end);
+                if (!uring_client->sending)
+                {
+                    begin_close(uring_client);
+                }
+                return;
+            }
+            if ((client->reply_end >= 0) && (client->reply_offset >= client->reply_end))
+            {
+                client_finish_reply(client);
+                continue;
+            }
+            if (!submit_reply_chunk(ring, uring_client))
+            {
+                begin_close(uring_client);
+            }
+            return;
+        }
+
+        if (!client_process_packet(client))
+        {
+            break;
+        }
+    }
+
+    if (client->subscribing)
+    {
+        begin_handoff(ring, uring_client);
+        return;
+    }
+    if (client_commit_pending(client))
+    {
+        return; // resumed by `on_commit`
+    }
+
+    // Nothing to send, and no complete packet.
+    //
+    if (recv_buffer_pending(&client->received) == 0)
+    {
+        recv_buffer_release(&client->received);
+    }
+    if (uring_client->eof)
+    {
+        begin_close(uring_client);
+    }
+    else if (!uring_client->recv_armed)
+    {
+        arm_recv(ring, uring_client);
+    }
+}
+
+static void log_peer(const int peer_fd)
+{
+    // Multishot accept doesn't provide the peer address, so it's only queried if it's going to be logged.
+    if (!async_log_enabled(LOG_INFO))
+    {
+        return;
+    }
+
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addrlen = sizeof(peer_addr);
+    if (getpeername(peer_fd, (struct sockaddr *)&peer_addr, &peer_addrlen) == -1)
+    {
+        syslog(LOG_WARNING, "getpeername: %s", strerror(errno));
+        return;
+    }
+
+    async_log_peer(LOG_INFO, "Accepted connection from", (struct sockaddr *)&peer_addr, peer_addrlen, peer_fd);
+}
+
+static void on_accept(struct uring *const ring, const struct io_uring_cqe *const cqe)
+{
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        ring->accept_armed = false;
+    }
+    if (cqe->res < 0)
+    {
+        if ((cqe->res == -EINVAL) && !ring->accepted_any)
+        {
+            syslog(LOG_WARNING, "io_uring: multishot accept is not supported");
+            ring->unsupported = true;
+        }
+        else if (cqe->res != -ECANCELED)
+        {
+            syslog(LOG_WARNING, "accept: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    const int peer_fd = cqe->res;
+    ring->accepted_any = true;
+    log_peer(peer_fd);
+
+    struct uring_client *const uring_client = malloc(sizeof(struct uring_client));
+    if (uring_client == NULL)
+    {
+        syslog(LOG_ERR, "malloc `uring_client`: %s", strerror(errno));
+        close(peer_fd);
+        return;
+    }
+    memset(uring_client, 0, sizeof(struct uring_client));
+    uring_client->chunk = NULL;
+
+    uring_client->client = client_info_create(ring->shared, peer_fd);
+    if (uring_client->client == NULL)
+    {
+        free(uring_client);
+        close(peer_fd);
+        return;
+    }
+
+    uring_client->client->notifier = &ring->notifier;
+    uring_client->client->commit_owner = uring_client;
+    TAILQ_INSERT_TAIL(&ring->clients, uring_client, nodes);
+    arm_recv(ring, uring_client);
+}
+
+static void on_recv(struct uring *const ring, struct uring_client *const uring_client,
+                    const struct io_uring_cqe *const cqe)
+{
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        uring_client->recv_armed = false;
+        uring_client->inflight--;
+    }
+
+    if (cqe->res > 0)
+    {
+        assert(cqe->flags & IORING_CQE_F_BUFFER);
+        const unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *const data = ring->buffers + ((size_t)buffer_id * BUFFER_SIZE);
+        const bool stored = client_store_received(uring_client->client, data, cqe->res);
+        provide_buffer(ring, buffer_id);
+        if (!stored)
+        {
+            begin_close(uring_client);
+        }
+    }
+    else if (cqe->res == 0)
+    {
+        uring_client->eof = true;
+    }
+    else if ((cqe->res != -ENOBUFS) && (cqe->res != -ECANCELED)) // out of provided buffers, or paused - re-arm later
+    {
+        if (!uring_client->closing)
+        {
+            syslog(LOG_ERR, "recv: %s", strerror(-cqe->res));
+        }
+        uring_client->eof = true;
+    }
+
+    pump_client(ring, uring_client);
+    pause_recv(ring, uring_client);
+}
+
+static void on_read(struct uring *const ring, struct uring_client *const uring_client,
+                    const struct io_uring_cqe *const cqe)
+{
+    uring_client->inflight--;
+    struct client_info *const client = uring_client->client;
+
+    if (cqe->res < 0)
+    {
+        // Not to be mistaken for the end of file: the client would take the truncated reply as complete.
+        // The linked send (if any) is cancelled.
+        syslog(LOG_ERR, "read: %s", strerror(-cqe->res));
+        if (!uring_client->linked)
+        {
+            uring_client->sending = false;
+        }
+        begin_close(uring_client);
+        return;
+    }
+    if (cqe->res == 0)
+    {
+        // End of file ends the reply. The linked send (if any) is cancelled then.
+        if (client->reply_pending)
+        {
+            client_finish_reply(client);
+        }
+        if (!uring_client->linked)
+        {
+            uring_client->sending = false;
+            pump_client(ring, uring_client);
+        }
+        return;
+    }
+
+    if (!uring_client->linked)
+    {
+        uring_client->chunk_size = cqe->res;
+        if (!submit_send(ring, uring_client, uring_client->chunk, cqe->res, false)) // the end is not known
+        {
+            uring_client->sending = false;
+            begin_close(uring_client);
+        }
+    }
+    else if ((size_t)cqe->res < uring_client->chunk_size)
+    {
+        // A short read (the device returns a single entry at a time) breaks the link, so the send is cancelled;
+        // what was read is sent on its own then (see `on_send`).
+        uring_client->chunk_size = cqe->res;
+        uring_client->short_read = true;
+    }
+}
+
+static void on_send(struct uring *const ring, struct uring_client *const uring_client,
+                    const struct io_uring_cqe *const cqe)
+{
+    uring_client->inflight--;
+    uring_client->sending = false;
+
+    if (cqe->res == -ECANCELED)
+    {
+        // Nothing was sent; either the reply is over, or the chunk is to be retried (or sent as far as it was read).
+        if (uring_client->short_read && !uring_client->closing)
+        {
+            struct client_info *const client = uring_client->client;
+            uring_client->short_read = false;
+            uring_client->linked = false;
+            uring_client->sending =
+                submit_send(ring, uring_client, uring_client->chunk, uring_client->chunk_size,
+                            (client->reply_offset + (off_t)uring_client->chunk_size) < client->reply_end);
+            if (!uring_client->sending)
+            {
+                begin_close(uring_client);
+            }
+            return;
+        }
+    }
+    else if (cqe->res < 0)
+    {
+        if (!uring_client->closing)
+        {
+            syslog(LOG_ERR, "send: %s", strerror(-cqe->res));
+        }
+        uring_client->eof = true;
+        begin_close(uring_client);
+    }
+    else if (uring_client->header)
+    {
+        uring_client->client->reply_header_sent += cqe->res;
+    }
+    else
+    {
+        uring_client->client->reply_offset += cqe->res;
+    }
+    uring_client->header = false;
+
+    pump_client(ring, uring_client);
+}
+
+/// Resumes the clients whose appends the storage thread has committed.
+static void on_commit(struct uring *const ring, const struct io_uring_cqe *const cqe)
+{
+    ring->commit_armed = false;
+    if ((cqe->res < 0) && (cqe->res != -ECANCELED))
+    {
+        syslog(LOG_ERR, "poll: %s", strerror(-cqe->res));
+    }
+
+    struct commit_request *request = commit_notifier_take(&ring->notifier, false);
+    while (request != NULL)
+    {
+        // The next append of the client could reuse the request.
+        struct commit_request *const next = request->completed_next;
+        struct uring_client *const uring_client = request->owner;
+        client_complete_commit(uring_client->client);
+        pump_client(ring, uring_client);
+        pause_recv(ring, uring_client);
+        free_if_closed(ring, uring_client);
+        request = next;
+    }
+
+    if (!ring->commit_cancelled)
+    {
+        arm_commit(ring);
+    }
+}
+
+static void on_completion(struct uring *const ring, const struct io_uring_cqe *const cqe)
+{
+    const uint64_t op = cqe->user_data & URING_OP_MASK;
+    struct uring_client *const uring_client = (struct uring_client *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+    switch (op)
+    {
+    case URING_OP_ACCEPT:
+        on_accept(ring, cqe);
+        return;
+    case URING_OP_COMMIT:
+        on_commit(ring, cqe);
+        return;
+    case URING_OP_RECV:
+        on_recv(ring, uring_client, cqe);
+        break;
+    case URING_OP_SEND:
+        on_send(ring, uring_client, cqe);
+        break;
+    case URING_OP_READ:
+        on_read(ring, uring_client, cqe);
+        break;
+    default:
+        return;
+    }
+
+    free_if_closed(ring, uring_client);
+}
+
+/// Reaps all available completions in one batch.
+static void reap_completions(struct uring *const ring)
+{
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        on_completion(ring, &ring->cqes[head & ring->cq_mask]);
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+bool uring_run(const int server_sock_fd, struct shared_info *const shared, volatile sig_atomic_t *const running)
+{
+    assert(server_sock_fd >= 0);
+    assert(shared != NULL);
+    assert(running != NULL);
+
+    struct uring ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+    ring.server_sock_fd = server_sock_fd;
+    ring.shared = shared;
+    TAILQ_INIT(&ring.clients);
+
+    if (!uring_init(&ring))
+    {
+        uring_deinit(&ring);
+        return false;
+    }
+    ring.notifier_ready = commit_notifier_init(&ring.notifier);
+    if (!ring.notifier_ready)
+    {
+        uring_deinit(&ring);
+        return false;
+    }
+
+    arm_commit(&ring);
+    arm_accept(&ring);
+
+    // The main loop.
+    //
+    while ((*running != SERVER_STOPPED) && !ring.unsupported)
+    {
+        // While draining it keeps accepting, until it's idle (what is left in the backlog is the successor's).
+        // A connection accepted before the cancellation completes is served as well.
+        const bool idle = (*running == SERVER_DRAINING) && TAILQ_EMPTY(&ring.clients) && clients_idle(shared);
+        if (idle)
+        {
+            cancel_accept(&ring);
+            if (!ring.accept_armed)
+            {
+                break;
+            }
+        }
+
+        if (submit_and_wait(&ring, 1) == -1)
+        {
+            if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+            {
+                continue;
+            }
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+            break;
+        }
+
+        reap_completions(&ring);
+
+        if (!ring.accept_armed && !ring.unsupported && !idle)
+        {
+            arm_accept(&ring);
+        }
+    }
+
+    // Cancel the accept, shut down all peers, and wait for their requests to complete
+    // (so that the kernel doesn't touch any memory which is about to be freed), including their appends.
+    //
+    cancel_accept(&ring);
+    struct uring_client *uring_client = NULL;
+    struct uring_client *next = NULL;
+    TAILQ_FOREACH_SAFE(uring_client, &ring.clients, nodes, next)
+    {
+        begin_close(uring_client);
+        free_if_closed(&ring, uring_client);
+    }
+    while (ring.accept_armed || ring.commit_armed || !TAILQ_EMPTY(&ring.clients))
+    {
+        if (TAILQ_EMPTY(&ring.clients))
+        {
+            cancel_commit(&ring);
+        }
+        if ((submit_and_wait(&ring, 1) == -1) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+        {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        reap_completions(&ring);
+    }
+
+    const bool unsupported = ring.unsupported;
+    uring_deinit(&ring);
+    return !unsupported;
+}
+
+#else // HAVE_IO_URING
+
+bool uring_run(const int server_sock_fd, struct shared_info *const shared, volatile sig_atomic_t *const running)
+{
+    (void)server_sock_fd;
+    (void)shared;
+    (void)running;
+
+    syslog(LOG_WARNING, "io_uring is not supported by the kernel headers");
+    return false;
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,22 @@
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include "client_flow.h"
+
+#include <signal.h>
+#include <stdbool.h>
+
+/// Serves all clients of the listening socket from the calling thread with io_uring.
+///
+/// Connections are accepted by a multishot accept, data is received by a multishot recv
+/// per peer into a ring of provided buffers, and replies are sent by send operations
+/// (linked to the file reads they depend on), so that completions are reaped in batches.
+/// Returns when `running` is reset (by a signal), or once no client is served any more (see `clients_idle`)
+/// after it turned `SERVER_DRAINING`.
+///
+/// Returns false (without serving anything) if io_uring, or any of the features above,
+/// is not available, so that the caller could fall back to another engine.
+///
+bool uring_run(int server_sock_fd, struct shared_info *shared, volatile sig_atomic_t *running);
+
+#endif // AESDSOCKET_URING_H
@@ -0,0 +1,221 @@
+#include "worker_pool.h"
+#include "async_log.h"
+#include "client_flow.h"
+#include "queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+TAILQ_HEAD(pool_clients_s, client_info);
+
+struct worker_pool
+{
+    struct shared_info *shared;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+    bool stopping;
+
+    // All the following lists and counters are protected by the `lock`.
+    //
+    struct pool_clients_s pending; // accepted connections waiting for a worker
+    struct pool_clients_s active;  // connections being served by workers
+    struct pool_clients_s idle;    // finished clients (with their data file still open) ready for reuse
+    size_t pending_count;
+
+    size_t workers_count;
+    pthread_t workers[];
+};
+
+static void *worker_thread(void *const arg)
+{
+    struct worker_pool *const pool = arg;
+    assert(pool != NULL);
+
+    if (pool->shared->cpus != NULL)
+    {
+        pin_thread(cpu_rotation_next(pool->shared->cpus));
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->stopping && TAILQ_EMPTY(&pool->pending))
+        {
+            pthread_cond_wait(&pool->job_available, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+
+        struct client_info *const client = TAILQ_FIRST(&pool->pending);
+        TAILQ_REMOVE(&pool->pending, client, nodes);
+        pool->pending_count--;
+        TAILQ_INSERT_TAIL(&pool->active, client, nodes);
+        pthread_mutex_unlock(&pool->lock);
+
+        async_log(LOG_DEBUG, "Worker started client (peer_fd=%d, thread=%p).", //
+                  client->peer_fd, (const void *)pthread_self());
+
+        process_client(client);
+
+        async_log(LOG_DEBUG, "Worker finished client (peer_fd=%d, thread=%p).", //
+                  client->peer_fd, (const void *)pthread_self());
+
+        // The peer descriptor is closed under the lock, so that `worker_pool_destroy`
+        // never shuts down a descriptor which was already closed (and maybe reused).
+        //
+        pthread_mutex_lock(&pool->lock);
+        if (client->peer_fd >= 0) // unless it was handed off to the subscription hub
+        {
+            close(client->peer_fd);
+        }
+        client->peer_fd = -1;
+        TAILQ_REMOVE(&pool->active, client, nodes);
+        TAILQ_INSERT_HEAD(&pool->idle, client, nodes);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct worker_pool *worker_pool_create(struct shared_info *const shared, const size_t workers_count)
+{
+    assert(shared != NULL);
+    assert(workers_count > 0);
+
+    struct worker_pool *const pool = malloc(sizeof(struct worker_pool) + (workers_count * sizeof(pthread_t)));
+    if (pool == NULL)
+    {
+        syslog(LOG_ERR, "malloc `worker_pool`: %s", strerror(errno));
+        return NULL;
+    }
+
+    pool->shared = shared;
+    pool->stopping = false;
+    pool->pending_count = 0;
+    pool->workers_count = 0;
+    TAILQ_INIT(&pool->pending);
+    TAILQ_INIT(&pool->active);
+    TAILQ_INIT(&pool->idle);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_available, NULL);
+
+    for (size_t i = 0; i < workers_count; ++i)
+    {
+        const int res = pthread_create(&pool->workers[i], NULL, worker_thread, pool);
+        if (res != 0)
+        {
+            syslog(LOG_ERR, "pthread_create: %s", strerror(res));
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+        pool->workers_count++;
+    }
+
+    syslog(LOG_INFO, "Started worker pool (workers=%zu).", workers_count);
+    return pool;
+}
+
+bool worker_pool_submit(struct worker_pool *const pool, const int peer_fd)
+{
+    assert(pool != NULL);
+    assert(peer_fd >= 0);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping || (pool->pending_count >= WORKER_POOL_MAX_PENDING))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        syslog(LOG_WARNING, "Too many pending connections, dropping (peer_fd=%d).", peer_fd);
+        close(peer_fd);
+        return false;
+    }
+
+    // Prefer reusing a finished client (it saves both allocation and opening of the data file).
+    //
+    struct client_info *client = TAILQ_FIRST(&pool->idle);
+    if (client != NULL)
+    {
+        TAILQ_REMOVE(&pool->idle, client, nodes);
+        client_info_recycle(client, peer_fd);
+    }
+    else
+    {
+        client = client_info_create(pool->shared, peer_fd);
+        if (client == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            close(peer_fd);
+            return false;
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&pool->pending, client, nodes);
+    pool->pending_count++;
+    pthread_cond_signal(&pool->job_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+bool worker_pool_idle(struct worker_pool *const pool)
+{
+    assert(pool != NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    const bool idle = TAILQ_EMPTY(&pool->pending) && TAILQ_EMPTY(&pool->active);
+    pthread_mutex_unlock(&pool->lock);
+    return idle;
+}
+
+static void destroy_clients(struct pool_clients_s *const clients)
+{
+    struct client_info *client = NULL;
+    struct client_info *next = NULL;
+    TAILQ_FOREACH_SAFE(client, clients, nodes, next)
+    {
+        TAILQ_REMOVE(clients, client, nodes);
+        client_info_destroy(client);
+    }
+}
+
+void worker_pool_destroy(struct worker_pool *const pool)
+{
+    assert(pool != NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    {
+        pool->stopping = true;
+
+        // Wake up workers blocked on their peers.
+        //
+        struct client_info *client = NULL;
+        TAILQ_FOREACH(client, &pool->active, nodes)
+        {
+            shutdown(client->peer_fd, SHUT_RDWR);
+        }
+
+        pthread_cond_broadcast(&pool->job_available);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->workers_count; ++i)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+    assert(TAILQ_EMPTY(&pool->active));
+
+    destroy_clients(&pool->pending);
+    destroy_clients(&pool->idle);
+
+    pthread_cond_destroy(&pool->job_available);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,35 @@
+#ifndef AESDSOCKET_WORKER_POOL_H
+#define AESDSOCKET_WORKER_POOL_H
+
+#include "client_flow.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Maximum number of accepted connections waiting for a free worker.
+#define WORKER_POOL_MAX_PENDING 1024
+
+struct worker_pool;
+
+/// Creates a pool with a fixed number of worker threads.
+///
+/// Each worker serves one connection at a time (until the peer closes it),
+/// and then picks the next one from the job queue.
+/// Returns NULL on failure.
+///
+struct worker_pool *worker_pool_create(struct shared_info *shared, size_t workers_count);
+
+/// Queues the accepted connection for processing by the next free worker.
+///
+/// The pool takes ownership of `peer_fd` - it is closed on failure
+/// (e.g. when there are already `WORKER_POOL_MAX_PENDING` connections waiting).
+///
+bool worker_pool_submit(struct worker_pool *pool, int peer_fd);
+
+/// Returns true if no connection is being served or waiting for a worker.
+bool worker_pool_idle(struct worker_pool *pool);
+
+/// Stops all workers (interrupting their connections), joins them, and deallocates the pool.
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif // AESDSOCKET_WORKER_POOL_H